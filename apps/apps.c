@@ -5,6 +5,8 @@
 #include "../file/file.h"
 
 int main() {
+    // vfs_open() mounts an existing image, the demo starts from a blank one.
+    remove("vdisk.img");
     vfs_t vfs = vfs_open("vdisk.img");
 
     directory_close(directory_create(vfs, "/home"));
@@ -0,0 +1,433 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "../file/file.h"
+
+/*
+ * Micro-benchmarks of the core operations, run against images in a
+ * temporary directory. Results are written as JSON to stdout, or to the file
+ * given with -o, so runs of different builds can be compared. Messages the
+ * library prints go to stderr.
+ *
+ * usage: vfs_bench [-p page_size] [-o results.json]
+ */
+
+#define BENCH_MAX_RESULTS 64
+
+// Bytes written by each append benchmark and read back by the read ones.
+#define BENCH_FILE_BYTES (4u * 1024 * 1024)
+#define BENCH_FORMATS 20
+#define BENCH_MOUNTS 200
+#define BENCH_CREATES 5000
+#define BENCH_OPENS 20000
+#define BENCH_DIRECTORY_ENTRIES 2000
+#define BENCH_RANDOM_READS 20000
+#define BENCH_ALLOCATIONS 20000
+#define BENCH_OPEN_MAX_DEPTH 8
+
+struct bench_result {
+    const char * name;
+    uint64_t ops;
+    uint64_t bytes;
+    double seconds;
+};
+
+struct bench {
+    char directory[256];
+    char image[288];
+    struct vfs_options options;
+    uint64_t random_state;
+    struct bench_result results[BENCH_MAX_RESULTS];
+    uint32_t result_count;
+};
+
+static double bench_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+static uint64_t bench_random(struct bench * bench)
+{
+    // xorshift64, the same sequence on every run.
+    uint64_t x = bench->random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    bench->random_state = x;
+    return x;
+}
+
+static void bench_record(struct bench * bench, const char * name, uint64_t ops, uint64_t bytes, double start)
+{
+    double seconds = bench_now() - start;
+    if(bench->result_count == BENCH_MAX_RESULTS)
+    {
+        ERR("Too many benchmark results.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct bench_result * result = &bench->results[bench->result_count++];
+    result->name = name;
+    result->ops = ops;
+    result->bytes = bytes;
+    result->seconds = seconds;
+    fprintf(stderr, "%-24s %10.0f ops/s\r\n", name, seconds > 0 ? (double) ops / seconds : 0.0);
+}
+
+static vfs_t bench_mount(struct bench * bench)
+{
+    return vfs_open_with(bench->image, &bench->options);
+}
+
+/*
+ * @brief: formats fresh images, each one created and closed.
+ */
+static void bench_format(struct bench * bench)
+{
+    char path[288];
+    snprintf(path, sizeof(path), "%s/format.img", bench->directory);
+
+    double start = bench_now();
+    int i = 0;
+    for(i = 0; i < BENCH_FORMATS; ++i)
+    {
+        vfs_close(vfs_open_with(path, &bench->options));
+        remove(path);
+    }
+    bench_record(bench, "format", BENCH_FORMATS, 0, start);
+}
+
+/*
+ * @brief: creates files in a hashed directory, then mounts and unmounts the
+ *         image holding them.
+ */
+static void bench_create_and_mount(struct bench * bench)
+{
+    vfs_t vfs = bench_mount(bench);
+    directory_close(directory_create_hashed(vfs, "/create"));
+
+    char path[64];
+    double start = bench_now();
+    int i = 0;
+    for(i = 0; i < BENCH_CREATES; ++i)
+    {
+        snprintf(path, sizeof(path), "/create/f%d", i);
+        file_close(file_create(vfs, path));
+    }
+    bench_record(bench, "file_create", BENCH_CREATES, 0, start);
+    vfs_close(vfs);
+
+    start = bench_now();
+    for(i = 0; i < BENCH_MOUNTS; ++i)
+        vfs_close(bench_mount(bench));
+    bench_record(bench, "mount", BENCH_MOUNTS, 0, start);
+}
+
+/*
+ * @brief: opens and closes a file at path depths 1, 4 and 8.
+ */
+static void bench_open_depth(struct bench * bench)
+{
+    static const int depths[] = { 1, 4, BENCH_OPEN_MAX_DEPTH };
+    static const char * names[] = { "file_open_depth_1", "file_open_depth_4", "file_open_depth_8" };
+
+    vfs_t vfs = bench_mount(bench);
+    char path[256] = "";
+    int depth = 0;
+    for(depth = 1; depth < BENCH_OPEN_MAX_DEPTH; ++depth)
+    {
+        size_t length = strlen(path);
+        snprintf(path + length, sizeof(path) - length, "/d%d", depth);
+        directory_close(directory_create(vfs, path));
+    }
+
+    int i = 0;
+    for(i = 0; i < 3; ++i)
+    {
+        // Directories d1 .. d(depth - 1), then the file.
+        path[0] = '\0';
+        for(depth = 1; depth < depths[i]; ++depth)
+        {
+            size_t length = strlen(path);
+            snprintf(path + length, sizeof(path) - length, "/d%d", depth);
+        }
+        size_t length = strlen(path);
+        snprintf(path + length, sizeof(path) - length, "/open%d", depths[i]);
+        file_close(file_create(vfs, path));
+
+        double start = bench_now();
+        int j = 0;
+        for(j = 0; j < BENCH_OPENS; ++j)
+            file_close(file_open(vfs, path));
+        bench_record(bench, names[i], BENCH_OPENS, 0, start);
+    }
+    vfs_close(vfs);
+}
+
+/*
+ * @brief: appends BENCH_FILE_BYTES to a new file in writes of each size, the
+ *         time includes closing the file.
+ */
+static void bench_append(struct bench * bench)
+{
+    static const uint32_t sizes[] = { 16, 512, 4096, 65536 };
+    static const char * names[] = { "append_16", "append_512", "append_4096", "append_65536" };
+
+    vfs_t vfs = bench_mount(bench);
+    uint8_t * buffer = (uint8_t *) malloc(sizes[3]);
+    uint32_t k = 0;
+    for(k = 0; k < sizes[3]; ++k)
+        buffer[k] = (uint8_t) (k * 7);
+
+    int i = 0;
+    for(i = 0; i < 4; ++i)
+    {
+        char path[32];
+        snprintf(path, sizeof(path), "/append%u", sizes[i]);
+        file_t file = file_create(vfs, path);
+
+        uint64_t writes = BENCH_FILE_BYTES / sizes[i];
+        double start = bench_now();
+        uint64_t j = 0;
+        for(j = 0; j < writes; ++j)
+            file_write(buffer, 1, sizes[i], file);
+        file_close(file);
+        bench_record(bench, names[i], writes, BENCH_FILE_BYTES, start);
+    }
+
+    free(buffer);
+    vfs_close(vfs);
+}
+
+/*
+ * @brief: reads the file written by bench_append() sequentially, then at
+ *         random offsets, on a freshly mounted image.
+ */
+static void bench_read(struct bench * bench)
+{
+    static const uint32_t sizes[] = { 512, 4096, 65536 };
+    static const char * names[] = { "read_sequential_512", "read_sequential_4096", "read_sequential_65536" };
+
+    vfs_t vfs = bench_mount(bench);
+    uint8_t * buffer = (uint8_t *) malloc(sizes[2]);
+
+    int i = 0;
+    for(i = 0; i < 3; ++i)
+    {
+        file_t file = file_open(vfs, "/append65536");
+        uint64_t reads = 0;
+        uint64_t bytes = 0;
+        size_t n = 0;
+        double start = bench_now();
+        while((n = file_read(buffer, 1, sizes[i], file)) > 0)
+        {
+            bytes += n;
+            reads++;
+        }
+        bench_record(bench, names[i], reads, bytes, start);
+        file_close(file);
+    }
+
+    file_t file = file_open(vfs, "/append65536");
+    uint64_t bytes = 0;
+    double start = bench_now();
+    for(i = 0; i < BENCH_RANDOM_READS; ++i)
+    {
+        file_seek(file, (uint32_t) (bench_random(bench) % (BENCH_FILE_BYTES - 512)), VFS_SEEK_SET);
+        bytes += file_read(buffer, 1, 512, file);
+    }
+    bench_record(bench, "read_random_512", BENCH_RANDOM_READS, bytes, start);
+    file_close(file);
+
+    free(buffer);
+    vfs_close(vfs);
+}
+
+/*
+ * @brief: looks every entry of a large plain and a large hashed directory up
+ *         once, in random order, after a fresh mount so no lookup is cached.
+ */
+static void bench_lookup(struct bench * bench)
+{
+    static char * directories[] = { "/linear", "/hashed" };
+    static const char * names[] = { "lookup_linear_2000", "lookup_hashed_2000" };
+
+    vfs_t vfs = bench_mount(bench);
+    directory_close(directory_create(vfs, directories[0]));
+    directory_close(directory_create_hashed(vfs, directories[1]));
+
+    char path[64];
+    int i = 0;
+    int j = 0;
+    for(i = 0; i < 2; ++i)
+    {
+        for(j = 0; j < BENCH_DIRECTORY_ENTRIES; ++j)
+        {
+            snprintf(path, sizeof(path), "%s/entry%d", directories[i], j);
+            file_close(file_create(vfs, path));
+        }
+    }
+    vfs_close(vfs);
+
+    int order[BENCH_DIRECTORY_ENTRIES];
+    for(j = 0; j < BENCH_DIRECTORY_ENTRIES; ++j)
+        order[j] = j;
+    for(j = BENCH_DIRECTORY_ENTRIES - 1; j > 0; --j)
+    {
+        int other = (int) (bench_random(bench) % (uint64_t) (j + 1));
+        int swap = order[j];
+        order[j] = order[other];
+        order[other] = swap;
+    }
+
+    for(i = 0; i < 2; ++i)
+    {
+        vfs = bench_mount(bench);
+        double start = bench_now();
+        for(j = 0; j < BENCH_DIRECTORY_ENTRIES; ++j)
+        {
+            snprintf(path, sizeof(path), "%s/entry%d", directories[i], order[j]);
+            file_close(file_open(vfs, path));
+        }
+        bench_record(bench, names[i], BENCH_DIRECTORY_ENTRIES, 0, start);
+        vfs_close(vfs);
+    }
+}
+
+/*
+ * @brief: allocates single pages, frees every other one so the free map is
+ *         fragmented, then allocates runs of 8 pages around the holes.
+ */
+static void bench_allocator(struct bench * bench)
+{
+    vfs_t vfs = bench_mount(bench);
+    uint32_t * pages = (uint32_t *) malloc(BENCH_ALLOCATIONS * sizeof(*pages));
+
+    uint32_t allocated = 0;
+    double start = bench_now();
+    int i = 0;
+    for(i = 0; i < BENCH_ALLOCATIONS; ++i)
+        pages[i] = vfs_allocate_pages(vfs, 1, &allocated);
+    bench_record(bench, "allocate_page", BENCH_ALLOCATIONS, 0, start);
+
+    start = bench_now();
+    for(i = 0; i < BENCH_ALLOCATIONS; i += 2)
+        vfs_page_free_unmark(vfs, pages[i]);
+    bench_record(bench, "free_page", BENCH_ALLOCATIONS / 2, 0, start);
+    // Freed pages can be allocated again once the frees are committed.
+    vfs_sync(vfs);
+
+    uint64_t runs = 0;
+    start = bench_now();
+    for(i = 0; i < BENCH_ALLOCATIONS / 8; ++i)
+    {
+        uint32_t remaining = 8;
+        while(remaining != 0)
+        {
+            vfs_allocate_pages(vfs, remaining, &allocated);
+            remaining -= allocated;
+            runs++;
+        }
+    }
+    bench_record(bench, "allocate_run_8_fragmented", runs, 0, start);
+
+    // The pages belong to no file, the image is thrown away.
+    free(pages);
+    vfs_close(vfs);
+}
+
+static void bench_print_json(struct bench * bench, FILE * out)
+{
+    fprintf(out, "{\n  \"benchmark\": \"vfs_bench\",\n");
+    fprintf(out, "  \"page_size\": %u,\n", bench->options.page_size);
+    fprintf(out, "  \"results\": [\n");
+    uint32_t i = 0;
+    for(i = 0; i < bench->result_count; ++i)
+    {
+        struct bench_result * result = &bench->results[i];
+        double seconds = result->seconds > 0 ? result->seconds : 1e-9;
+        // MB is 10^6 bytes.
+        fprintf(out, "    { \"name\": \"%s\", \"ops\": %llu, \"bytes\": %llu, \"seconds\": %.6f, "
+                     "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f }%s\n",
+                result->name, (unsigned long long) result->ops, (unsigned long long) result->bytes,
+                result->seconds, (double) result->ops / seconds, (double) result->bytes / seconds / 1e6,
+                (i + 1 == bench->result_count) ? "" : ",");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char ** argv)
+{
+    struct bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.options.page_size = VFS_DEFAULT_PAGE_SIZE;
+    bench.random_state = 0x9e3779b97f4a7c15ull;
+
+    const char * output_path = NULL;
+    int option = 0;
+    while((option = getopt(argc, argv, "p:o:")) != -1)
+    {
+        switch(option)
+        {
+            case 'p':
+                bench.options.page_size = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p page_size] [-o results.json]\r\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    // Keep stdout for the results, the library's messages go to stderr.
+    FILE * out = NULL;
+    if(output_path != NULL)
+        out = fopen(output_path, "w");
+    else
+        out = fdopen(dup(STDOUT_FILENO), "w");
+    if(out == NULL)
+    {
+        ERR("Unable to open the results file.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    fflush(stdout);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    const char * temporary = getenv("TMPDIR");
+    snprintf(bench.directory, sizeof(bench.directory), "%s/vfs_bench.XXXXXX", temporary != NULL ? temporary : "/tmp");
+    if(mkdtemp(bench.directory) == NULL)
+    {
+        ERR("Unable to create a temporary directory.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(bench.image, sizeof(bench.image), "%s/bench.img", bench.directory);
+
+    bench_format(&bench);
+    bench_create_and_mount(&bench);
+    bench_open_depth(&bench);
+    bench_append(&bench);
+    bench_read(&bench);
+    bench_lookup(&bench);
+    bench_allocator(&bench);
+
+    remove(bench.image);
+    rmdir(bench.directory);
+
+    bench_print_json(&bench, out);
+    fclose(out);
+    return EXIT_SUCCESS;
+}
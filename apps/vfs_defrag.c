@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "../file/defrag.h"
+
+/*
+ * Defragments and compacts an image, see vfs_defrag(). The image is changed
+ * in place and is lost if this is interrupted, keep a copy.
+ *
+ * usage: vfs_defrag [-n] [-m] image
+ *   -n  only report how fragmented the image is
+ *   -m  open the image with vfs_options.mmap
+ */
+
+static void defrag_print(const char * label, const struct vfs_fragmentation * fragmentation)
+{
+    printf("%-7s fragmentation %.4f, %llu extents in %u files and directories of %llu pages\r\n", label,
+           fragmentation->score, (unsigned long long) fragmentation->extents, fragmentation->objects,
+           (unsigned long long) fragmentation->pages);
+}
+
+int main(int argc, char ** argv)
+{
+    struct vfs_options options;
+    memset(&options, 0, sizeof(options));
+    bool report_only = false;
+    bool usage = false;
+
+    int option = 0;
+    while((option = getopt(argc, argv, "nm")) != -1)
+    {
+        switch(option)
+        {
+            case 'n':
+                report_only = true;
+                break;
+            case 'm':
+                options.mmap = true;
+                break;
+            default:
+                usage = true;
+                break;
+        }
+    }
+    if(usage || argc - optind != 1)
+    {
+        fprintf(stderr, "usage: %s [-n] [-m] image\r\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if(access(argv[optind], R_OK | W_OK) != 0)
+    {
+        fprintf(stderr, "%s: no such image\r\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    vfs_t vfs = vfs_open_with(argv[optind], &options);
+    if(report_only)
+    {
+        struct vfs_fragmentation fragmentation = vfs_fragmentation(vfs);
+        defrag_print("image", &fragmentation);
+    }
+    else
+    {
+        struct vfs_defrag_report report;
+        vfs_defrag(vfs, &report);
+        defrag_print("before", &report.before);
+        defrag_print("after", &report.after);
+        printf("moved %u pages, released %u pages\r\n", report.pages_moved, report.pages_released);
+    }
+    vfs_close(vfs);
+    return EXIT_SUCCESS;
+}
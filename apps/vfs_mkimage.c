@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "../file/mkimage.h"
+
+/*
+ * Creates an image holding a copy of a host directory tree, see
+ * vfs_mkimage().
+ *
+ * usage: vfs_mkimage [-p page_size] [-c capacity] [-j journal_pages] [-n]
+ *                    [-t threads] [-s segment_size] source image
+ *   -p  page size of the image
+ *   -c  pages the image can hold, by default enough for the tree
+ *   -j  journal size in pages
+ *   -n  create the image without a journal
+ *   -t  threads reading host files
+ *   -s  bytes of file data written to the image at once
+ */
+
+static double mkimage_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+int main(int argc, char ** argv)
+{
+    struct vfs_mkimage_options options;
+    memset(&options, 0, sizeof(options));
+    bool usage = false;
+
+    int option = 0;
+    while((option = getopt(argc, argv, "p:c:j:nt:s:")) != -1)
+    {
+        switch(option)
+        {
+            case 'p':
+                options.image.page_size = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                options.image.capacity = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'j':
+                options.image.journal_pages = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                options.image.no_journal = true;
+                break;
+            case 't':
+                options.threads = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                options.segment_size = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage = true;
+                break;
+        }
+    }
+    if(usage || argc - optind != 2)
+    {
+        fprintf(stderr, "usage: %s [-p page_size] [-c capacity] [-j journal_pages] [-n] [-t threads] [-s segment_size] "
+                        "source image\r\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    double start = mkimage_now();
+    struct vfs_mkimage_summary summary;
+    vfs_mkimage(argv[optind + 1], argv[optind], &options, &summary);
+    double seconds = mkimage_now() - start;
+
+    printf("directories %u files %u skipped %u\r\n", summary.directories, summary.files, summary.skipped);
+    printf("%.2f MB in %u pages, %.3f s, %.2f MB/s\r\n", (double) summary.bytes / 1e6, summary.pages, seconds,
+           seconds > 0 ? (double) summary.bytes / 1e6 / seconds : 0.0);
+    return EXIT_SUCCESS;
+}
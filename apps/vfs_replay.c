@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "../file/file.h"
+
+/*
+ * Replays a page access trace, recorded with vfs_options.trace_path, against
+ * an image. Reads and writes go through the page cache as they did when the
+ * trace was recorded, so the cache, the allocator's layout and the disk are
+ * exercised the same way without the application that made them.
+ *
+ * Whole page writes rewrite the page's own contents, writes of byte ranges
+ * write filler. Replay against a copy of the image as it was when the trace
+ * started, or against a scratch image.
+ *
+ * usage: vfs_replay [-f] [-m] [-c cache_pages] trace image
+ *   -f  replay as fast as possible instead of keeping the recorded timing
+ *   -m  open the image with vfs_options.mmap
+ *   -c  page cache size in pages
+ */
+
+#define REPLAY_BATCH_RECORDS 4096
+
+struct replay_totals {
+    uint64_t records;
+    uint64_t operations[VFS_TRACE_SYNC + 1];
+    uint64_t bytes[VFS_TRACE_SYNC + 1];
+    uint64_t origins[VFS_TRACE_ORIGINS];
+    uint64_t skipped;
+    // Longest a record was replayed after its recorded time.
+    uint64_t max_lag_ns;
+};
+
+static uint64_t replay_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+static void replay_wait_until(uint64_t target_ns)
+{
+    struct timespec target = {
+            .tv_sec = (time_t) (target_ns / 1000000000ull),
+            .tv_nsec = (long) (target_ns % 1000000000ull)
+    };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) != 0)
+        ;
+}
+
+/*
+ * @brief: makes the image file cover every page it can hold, so pages a trace
+ *         reads before writing exist. The file stays sparse.
+ */
+static void replay_extend_image(vfs_t vfs)
+{
+    struct stat image_stat;
+    uint64_t size = (uint64_t) vfs->capacity * vfs->page_size;
+    if(vfs->map != NULL || fstat(vfs->fd, &image_stat) != 0 || (uint64_t) image_stat.st_size >= size)
+        return;
+
+    if(ftruncate(vfs->fd, (off_t) size) != 0)
+    {
+        ERR("Unable to extend the disk image.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void replay_record(vfs_t vfs, const struct vfs_trace_record * record, uint8_t ** buffer, size_t * capacity)
+{
+    if(record->operation == VFS_TRACE_SYNC)
+    {
+        vfs_sync(vfs);
+        return;
+    }
+
+    bool whole_page = record->offset == 0 && record->size == vfs->page_size;
+    if(whole_page)
+    {
+        vfs_page_put(vfs, vfs_page_get(vfs, record->page_number), record->operation == VFS_TRACE_WRITE);
+        return;
+    }
+
+    if(*capacity < record->size)
+    {
+        *capacity = record->size;
+        *buffer = (uint8_t *) realloc(*buffer, *capacity);
+        memset(*buffer, 0xA5, *capacity);
+    }
+    if(record->operation == VFS_TRACE_READ)
+        vfs_range_read(vfs, record->page_number, record->offset, record->size, *buffer);
+    else
+        vfs_range_write(vfs, record->page_number, record->offset, record->size, *buffer);
+}
+
+static bool replay_record_valid(vfs_t vfs, const struct vfs_trace_record * record)
+{
+    if(record->operation > VFS_TRACE_SYNC)
+        return false;
+    if(record->operation == VFS_TRACE_SYNC)
+        return true;
+
+    uint64_t end = (uint64_t) record->page_number * vfs->page_size + record->offset + record->size;
+    return record->size != 0 && end <= (uint64_t) vfs->capacity * vfs->page_size;
+}
+
+static void replay_print_totals(const struct replay_totals * totals, double seconds, vfs_t vfs)
+{
+    static const char * operation_names[] = { "read", "write", "sync" };
+
+    printf("records   %llu in %.3f s, %.0f records/s\r\n", (unsigned long long) totals->records, seconds,
+           seconds > 0 ? (double) totals->records / seconds : 0.0);
+    int operation = 0;
+    for(operation = 0; operation <= VFS_TRACE_SYNC; ++operation)
+    {
+        printf("%-9s %llu, %.2f MB, %.2f MB/s\r\n", operation_names[operation],
+               (unsigned long long) totals->operations[operation], (double) totals->bytes[operation] / 1e6,
+               seconds > 0 ? (double) totals->bytes[operation] / 1e6 / seconds : 0.0);
+    }
+    if(totals->skipped != 0)
+        printf("skipped   %llu records outside the image\r\n", (unsigned long long) totals->skipped);
+    printf("max lag   %.3f ms\r\n", (double) totals->max_lag_ns / 1e6);
+
+    int origin = 0;
+    for(origin = 0; origin < VFS_TRACE_ORIGINS; ++origin)
+    {
+        if(totals->origins[origin] != 0)
+            printf("  %-18s %llu\r\n", vfs_trace_origin_name((uint8_t) origin), (unsigned long long) totals->origins[origin]);
+    }
+
+    struct vfs_cache_stats cache = vfs_cache_stats(vfs);
+    printf("page cache %llu hits %llu misses %llu evictions %llu writebacks\r\n",
+           (unsigned long long) cache.hits, (unsigned long long) cache.misses,
+           (unsigned long long) cache.evictions, (unsigned long long) cache.writebacks);
+}
+
+int main(int argc, char ** argv)
+{
+    struct vfs_options options;
+    memset(&options, 0, sizeof(options));
+    bool fast = false;
+
+    int option = 0;
+    while((option = getopt(argc, argv, "fmc:")) != -1)
+    {
+        switch(option)
+        {
+            case 'f':
+                fast = true;
+                break;
+            case 'm':
+                options.mmap = true;
+                break;
+            case 'c':
+                options.cache_pages = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if(argc - optind != 2)
+    {
+        fprintf(stderr, "usage: %s [-f] [-m] [-c cache_pages] trace image\r\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE * trace = fopen(argv[optind], "rb");
+    struct vfs_trace_header header;
+    if(trace == NULL || fread(&header, sizeof(header), 1, trace) != 1
+       || memcmp(header.magic_number, "vfT", sizeof("vfT")) != 0 || header.version != VFS_TRACE_VERSION)
+    {
+        ERR("Not a trace file.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    // A new image gets the geometry the trace was recorded with.
+    options.page_size = header.page_size;
+    options.capacity = header.capacity;
+    vfs_t vfs = vfs_open_with(argv[optind + 1], &options);
+    if(vfs->page_size != header.page_size)
+    {
+        ERR("The image and the trace have different page sizes.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    replay_extend_image(vfs);
+
+    struct vfs_trace_record * records = (struct vfs_trace_record *) malloc(REPLAY_BATCH_RECORDS * sizeof(*records));
+    uint8_t * buffer = NULL;
+    size_t capacity = 0;
+    struct replay_totals totals;
+    memset(&totals, 0, sizeof(totals));
+
+    uint64_t start_ns = replay_now();
+    size_t count = 0;
+    while((count = fread(records, sizeof(*records), REPLAY_BATCH_RECORDS, trace)) > 0)
+    {
+        size_t i = 0;
+        for(i = 0; i < count; ++i)
+        {
+            const struct vfs_trace_record * record = &records[i];
+            if(!replay_record_valid(vfs, record))
+            {
+                totals.skipped++;
+                continue;
+            }
+
+            if(!fast)
+            {
+                uint64_t target_ns = start_ns + record->time_ns;
+                uint64_t now_ns = replay_now();
+                if(now_ns < target_ns)
+                    replay_wait_until(target_ns);
+                else if(now_ns - target_ns > totals.max_lag_ns)
+                    totals.max_lag_ns = now_ns - target_ns;
+            }
+
+            replay_record(vfs, record, &buffer, &capacity);
+            totals.records++;
+            totals.operations[record->operation]++;
+            totals.bytes[record->operation] += record->size;
+            totals.origins[record->origin < VFS_TRACE_ORIGINS ? record->origin : VFS_TRACE_ORIGIN_OTHER]++;
+        }
+    }
+    double seconds = (double) (replay_now() - start_ns) / 1e9;
+
+    replay_print_totals(&totals, seconds, vfs);
+
+    free(buffer);
+    free(records);
+    fclose(trace);
+    vfs_close(vfs);
+    return EXIT_SUCCESS;
+}
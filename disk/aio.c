@@ -0,0 +1,525 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "disk.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define VFS_HAVE_IO_URING 1
+#endif
+#endif
+
+/*
+ * @brief: runs the part of a transfer from done bytes on with blocking
+ *         positioned I/O.
+ *
+ * @return: 0, or the errno of the failed call.
+ */
+static int vfs_aio_transfer_run(vfs_t vfs, struct vfs_aio_transfer * transfer, size_t done)
+{
+    while(done < transfer->size)
+    {
+        ssize_t result = 0;
+        if(transfer->write)
+            result = pwrite(vfs->fd, transfer->buffer + done, transfer->size - done, (off_t) (transfer->offset + done));
+        else
+            result = pread(vfs->fd, transfer->buffer + done, transfer->size - done, (off_t) (transfer->offset + done));
+
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result < 0)
+            return errno;
+        if(result == 0)
+            return EIO;
+        done += (size_t) result;
+    }
+    return 0;
+}
+
+static void vfs_io_release(vfs_t vfs, struct vfs_io * io, int error)
+{
+    struct vfs_aio * aio = &vfs->aio;
+
+    pthread_mutex_lock(&aio->lock);
+    if(error != 0 && io->error == 0)
+        io->error = error;
+    bool last = (--io->pending == 0);
+    pthread_mutex_unlock(&aio->lock);
+
+    if(!last)
+        return;
+
+    if(io->callback != NULL)
+        io->callback(io);
+
+    pthread_mutex_lock(&aio->lock);
+    io->done = true;
+    pthread_cond_broadcast(&aio->changed);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+static void vfs_aio_transfer_done(vfs_t vfs, struct vfs_aio_transfer * transfer, int error)
+{
+    struct vfs_io * io = transfer->io;
+    free(transfer);
+
+    pthread_mutex_lock(&vfs->aio.lock);
+    vfs->aio.outstanding--;
+    pthread_cond_broadcast(&vfs->aio.changed);
+    pthread_mutex_unlock(&vfs->aio.lock);
+
+    vfs_io_release(vfs, io, error);
+}
+
+#ifdef VFS_HAVE_IO_URING
+static int vfs_ring_setup(uint32_t entries, struct io_uring_params * params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int vfs_ring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/*
+ * @brief: creates the ring and maps its queues.
+ *
+ * @return: false if the kernel does not offer io_uring.
+ */
+static bool vfs_ring_open(struct vfs_aio_ring * ring)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = vfs_ring_setup(VFS_AIO_RING_ENTRIES, &params);
+    if(ring->fd < 0)
+        return false;
+
+    ring->sq_entries = params.sq_entries;
+    ring->cq_entries = params.cq_entries;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Newer kernels map both queues with one call.
+    bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(single_map && ring->cq_map_size > ring->sq_map_size)
+        ring->sq_map_size = ring->cq_map_size;
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = single_map ? ring->sq_map
+                              : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        ERR("Unable to map the io_uring queues.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    if(single_map)
+        ring->cq_map_size = 0;
+
+    uint8_t * sq = (uint8_t *) ring->sq_map;
+    uint8_t * cq = (uint8_t *) ring->cq_map;
+    ring->sq_head = (uint32_t *) (sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t *) (sq + params.sq_off.tail);
+    ring->sq_mask = (uint32_t *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t *) (sq + params.sq_off.array);
+    ring->cq_head = (uint32_t *) (cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t *) (cq + params.cq_off.tail);
+    ring->cq_mask = (uint32_t *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return true;
+}
+
+static void vfs_ring_close(struct vfs_aio_ring * ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_map_size != 0)
+        munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+// Callers hold the aio lock and have checked there is room in the ring.
+static void vfs_ring_queue(struct vfs_aio_ring * ring, uint8_t opcode, int fd, void * buffer, size_t size, uint64_t offset, void * user_data)
+{
+    uint32_t tail = *ring->sq_tail;
+    uint32_t index = tail & *ring->sq_mask;
+    struct io_uring_sqe * sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buffer;
+    sqe->len = (uint32_t) size;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t) (uintptr_t) user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * @brief: submits transfers to the ring, waiting for completions whenever the
+ *         ring is full.
+ */
+static void vfs_ring_submit(vfs_t vfs, struct vfs_aio_transfer * transfers)
+{
+    struct vfs_aio * aio = &vfs->aio;
+
+    pthread_mutex_lock(&aio->lock);
+    while(transfers != NULL)
+    {
+        uint32_t queued = 0;
+        while(transfers != NULL && aio->ring_in_flight < aio->ring.sq_entries)
+        {
+            struct vfs_aio_transfer * transfer = transfers;
+            transfers = transfer->next;
+            vfs_ring_queue(&aio->ring, transfer->write ? IORING_OP_WRITE : IORING_OP_READ,
+                           vfs->fd, transfer->buffer, transfer->size, transfer->offset, transfer);
+            aio->ring_in_flight++;
+            queued++;
+        }
+
+        while(queued != 0)
+        {
+            int submitted = vfs_ring_enter(aio->ring.fd, queued, 0, 0);
+            if(submitted < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+                continue;
+            if(submitted < 0)
+            {
+                ERR("io_uring_enter() failed to submit.\r\n\t"
+                    "Exiting.");
+                exit(EXIT_FAILURE);
+            }
+            queued -= (uint32_t) submitted;
+        }
+
+        while(transfers != NULL && aio->ring_in_flight >= aio->ring.sq_entries)
+            pthread_cond_wait(&aio->changed, &aio->lock);
+    }
+    pthread_mutex_unlock(&aio->lock);
+}
+
+/*
+ * @brief: completes transfers as the ring reports them. A short transfer, or
+ *         one using an operation the kernel lacks, is finished with blocking
+ *         I/O. A completion without a transfer stops the thread.
+ */
+static void * vfs_ring_reap(void * argument)
+{
+    vfs_t vfs = (vfs_t) argument;
+    struct vfs_aio * aio = &vfs->aio;
+    struct vfs_aio_ring * ring = &aio->ring;
+
+    bool stopping = false;
+    while(!stopping)
+    {
+        if(vfs_ring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+        {
+            ERR("io_uring_enter() failed to wait.\r\n\t"
+                "Exiting.");
+            exit(EXIT_FAILURE);
+        }
+
+        uint32_t head = *ring->cq_head;
+        uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while(head != tail)
+        {
+            struct io_uring_cqe * cqe = &ring->cqes[head & *ring->cq_mask];
+            struct vfs_aio_transfer * transfer = (struct vfs_aio_transfer *) (uintptr_t) cqe->user_data;
+            int32_t result = cqe->res;
+            __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+            pthread_mutex_lock(&aio->lock);
+            aio->ring_in_flight--;
+            pthread_cond_broadcast(&aio->changed);
+            pthread_mutex_unlock(&aio->lock);
+
+            if(transfer == NULL)
+            {
+                stopping = true;
+                continue;
+            }
+
+            int error = 0;
+            if(result == -EINVAL || result == -EOPNOTSUPP || result == -EAGAIN || result == -EINTR)
+                error = vfs_aio_transfer_run(vfs, transfer, 0);
+            else if(result < 0)
+                error = -result;
+            else if((size_t) result < transfer->size)
+                error = vfs_aio_transfer_run(vfs, transfer, (size_t) result);
+            vfs_aio_transfer_done(vfs, transfer, error);
+        }
+    }
+    return NULL;
+}
+#endif
+
+static void * vfs_aio_work(void * argument)
+{
+    vfs_t vfs = (vfs_t) argument;
+    struct vfs_aio * aio = &vfs->aio;
+
+    while(true)
+    {
+        pthread_mutex_lock(&aio->lock);
+        while(aio->queue_head == NULL && !aio->stopping)
+            pthread_cond_wait(&aio->changed, &aio->lock);
+        struct vfs_aio_transfer * transfer = aio->queue_head;
+        if(transfer == NULL)
+        {
+            pthread_mutex_unlock(&aio->lock);
+            return NULL;
+        }
+        aio->queue_head = transfer->next;
+        if(aio->queue_head == NULL)
+            aio->queue_tail = NULL;
+        pthread_mutex_unlock(&aio->lock);
+
+        vfs_aio_transfer_done(vfs, transfer, vfs_aio_transfer_run(vfs, transfer, 0));
+    }
+}
+
+/*
+ * @brief: prepares the engine of a file system, nothing is started until the
+ *         first request is submitted.
+ *
+ * @param use_threads: use the thread pool even where io_uring is available.
+ */
+void vfs_aio_init(vfs_t vfs, bool use_threads)
+{
+    struct vfs_aio * aio = &vfs->aio;
+    memset(aio, 0, sizeof(*aio));
+    aio->use_threads = use_threads;
+    aio->ring.fd = -1;
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->changed, NULL);
+}
+
+// Callers hold the aio lock.
+static void vfs_aio_start(vfs_t vfs)
+{
+    struct vfs_aio * aio = &vfs->aio;
+    if(aio->started)
+        return;
+    aio->started = true;
+
+#ifdef VFS_HAVE_IO_URING
+    if(!aio->use_threads && vfs_ring_open(&aio->ring))
+    {
+        aio->uring = true;
+        pthread_create(&aio->reaper, NULL, vfs_ring_reap, vfs);
+        return;
+    }
+#endif
+
+    int i = 0;
+    for(i = 0; i < VFS_AIO_WORKERS; ++i)
+        pthread_create(&aio->workers[i], NULL, vfs_aio_work, vfs);
+}
+
+/*
+ * @brief: waits for every submitted transfer to complete.
+ */
+void vfs_aio_drain(vfs_t vfs)
+{
+    struct vfs_aio * aio = &vfs->aio;
+
+    pthread_mutex_lock(&aio->lock);
+    while(aio->outstanding != 0)
+        pthread_cond_wait(&aio->changed, &aio->lock);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+/*
+ * @brief: waits for every submitted transfer to complete and stops the
+ *         engine's threads.
+ */
+void vfs_aio_destroy(vfs_t vfs)
+{
+    struct vfs_aio * aio = &vfs->aio;
+
+    pthread_mutex_lock(&aio->lock);
+    while(aio->outstanding != 0)
+        pthread_cond_wait(&aio->changed, &aio->lock);
+    bool started = aio->started;
+    aio->stopping = true;
+    pthread_cond_broadcast(&aio->changed);
+    pthread_mutex_unlock(&aio->lock);
+
+    if(started)
+    {
+#ifdef VFS_HAVE_IO_URING
+        if(aio->uring)
+        {
+            // A completion with no transfer tells the reaper to stop.
+            pthread_mutex_lock(&aio->lock);
+            vfs_ring_queue(&aio->ring, IORING_OP_NOP, -1, NULL, 0, 0, NULL);
+            aio->ring_in_flight++;
+            while(vfs_ring_enter(aio->ring.fd, 1, 0, 0) < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+                continue;
+            pthread_mutex_unlock(&aio->lock);
+
+            pthread_join(aio->reaper, NULL);
+            vfs_ring_close(&aio->ring);
+        }
+#endif
+        if(!aio->uring)
+        {
+            int i = 0;
+            for(i = 0; i < VFS_AIO_WORKERS; ++i)
+                pthread_join(aio->workers[i], NULL);
+        }
+    }
+
+    pthread_cond_destroy(&aio->changed);
+    pthread_mutex_destroy(&aio->lock);
+}
+
+/*
+ * @return: the engine requests are sent to, "none" before the first request.
+ */
+const char * vfs_aio_engine(vfs_t vfs)
+{
+    pthread_mutex_lock(&vfs->aio.lock);
+    const char * engine = !vfs->aio.started ? "none" : (vfs->aio.uring ? "io_uring" : "threads");
+    pthread_mutex_unlock(&vfs->aio.lock);
+    return engine;
+}
+
+/*
+ * @brief: starts building a request. Transfers are added with vfs_io_read()
+ *         and vfs_io_write() and sent together by vfs_io_submit().
+ */
+void vfs_io_begin(struct vfs_io * io, vfs_io_callback callback, void * context)
+{
+    io->callback = callback;
+    io->context = context;
+    io->bytes = 0;
+    io->error = 0;
+    io->pending = 1;
+    io->done = false;
+    io->queued = NULL;
+}
+
+static void vfs_io_add(struct vfs_io * io, bool write, uint64_t offset, size_t size, void * buffer)
+{
+    struct vfs_aio_transfer * transfer = (struct vfs_aio_transfer *) malloc(sizeof(*transfer));
+    if(transfer == NULL)
+    {
+        ERR("Unable to allocate an I/O transfer.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    transfer->io = io;
+    transfer->write = write;
+    transfer->buffer = (uint8_t *) buffer;
+    transfer->size = size;
+    transfer->offset = offset;
+    transfer->next = io->queued;
+    io->queued = transfer;
+    io->pending++;
+}
+
+/*
+ * @brief: adds a read of size bytes at byte offset of the image to a request.
+ *         The page cache is not consulted.
+ */
+void vfs_io_read(struct vfs_io * io, uint64_t offset, size_t size, void * buffer)
+{
+    vfs_io_add(io, false, offset, size, buffer);
+}
+
+/*
+ * @brief: adds a write of size bytes at byte offset of the image to a
+ *         request. buffer must stay valid until the request is done.
+ */
+void vfs_io_write(struct vfs_io * io, uint64_t offset, size_t size, const void * buffer)
+{
+    vfs_io_add(io, true, offset, size, (void *) buffer);
+}
+
+/*
+ * @brief: sends every transfer of a request to the engine. The request is
+ *         done once they have all completed, at once if it has none.
+ */
+void vfs_io_submit(vfs_t vfs, struct vfs_io * io)
+{
+    struct vfs_aio * aio = &vfs->aio;
+
+    // Transfers were added newest first, submit them in the order they were built.
+    struct vfs_aio_transfer * transfers = NULL;
+    uint32_t count = 0;
+    while(io->queued != NULL)
+    {
+        struct vfs_aio_transfer * transfer = io->queued;
+        io->queued = transfer->next;
+        transfer->next = transfers;
+        transfers = transfer;
+        count++;
+    }
+
+    if(transfers != NULL)
+    {
+        pthread_mutex_lock(&aio->lock);
+        vfs_aio_start(vfs);
+        aio->outstanding += count;
+        bool uring = aio->uring;
+        if(!uring)
+        {
+            struct vfs_aio_transfer * last = transfers;
+            while(last->next != NULL)
+                last = last->next;
+            if(aio->queue_tail != NULL)
+                aio->queue_tail->next = transfers;
+            else
+                aio->queue_head = transfers;
+            aio->queue_tail = last;
+            pthread_cond_broadcast(&aio->changed);
+        }
+        pthread_mutex_unlock(&aio->lock);
+
+#ifdef VFS_HAVE_IO_URING
+        if(uring)
+            vfs_ring_submit(vfs, transfers);
+#endif
+    }
+
+    // Drop the hold taken by vfs_io_begin().
+    vfs_io_release(vfs, io, 0);
+}
+
+/*
+ * @return: true once every transfer of the request has completed and its
+ *          callback has returned.
+ */
+bool vfs_io_poll(vfs_t vfs, struct vfs_io * io)
+{
+    pthread_mutex_lock(&vfs->aio.lock);
+    bool done = io->done;
+    pthread_mutex_unlock(&vfs->aio.lock);
+    return done;
+}
+
+/*
+ * @brief: blocks until the request is done.
+ *
+ * @return: 0, or the errno of the first transfer that failed.
+ */
+int vfs_io_wait(vfs_t vfs, struct vfs_io * io)
+{
+    pthread_mutex_lock(&vfs->aio.lock);
+    while(!io->done)
+        pthread_cond_wait(&vfs->aio.changed, &vfs->aio.lock);
+    pthread_mutex_unlock(&vfs->aio.lock);
+    return io->error;
+}
@@ -0,0 +1,109 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Submission queue depth of the io_uring engine.
+#define VFS_AIO_RING_ENTRIES 64
+// Threads of the fallback engine.
+#define VFS_AIO_WORKERS 4
+
+struct vfs;
+struct vfs_io;
+
+typedef void (* vfs_io_callback)(struct vfs_io * io);
+
+/*
+ * One asynchronous request, made of one positioned transfer per contiguous
+ * run of pages. The caller owns it and keeps it alive until vfs_io_wait()
+ * returns or vfs_io_poll() reports it done.
+ */
+struct vfs_io {
+    // Called once every transfer has completed, from whichever thread
+    // completed the last one. It must not change the file system, a
+    // journal commit may be waiting for the request.
+    vfs_io_callback callback;
+    void * context;
+    // Bytes the request covers, and 0 or the errno of the first failed transfer.
+    size_t bytes;
+    int error;
+
+    // Transfers not yet complete, plus one while the request is being built.
+    uint32_t pending;
+    bool done;
+    // Transfers built but not yet submitted.
+    struct vfs_aio_transfer * queued;
+};
+
+struct vfs_aio_transfer {
+    struct vfs_io * io;
+    bool write;
+    uint8_t * buffer;
+    size_t size;
+    uint64_t offset;
+    struct vfs_aio_transfer * next;
+};
+
+struct vfs_aio_ring {
+    int fd;
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    uint32_t * sq_head;
+    uint32_t * sq_tail;
+    uint32_t * sq_mask;
+    uint32_t * sq_array;
+    struct io_uring_sqe * sqes;
+    uint32_t * cq_head;
+    uint32_t * cq_tail;
+    uint32_t * cq_mask;
+    struct io_uring_cqe * cqes;
+
+    void * sq_map;
+    size_t sq_map_size;
+    void * cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
+
+/*
+ * Asynchronous I/O engine. Transfers go to io_uring where the kernel allows
+ * it, else to a small pool of threads doing positioned reads and writes.
+ * Nothing is started until the first request is submitted.
+ */
+struct vfs_aio {
+    bool started;
+    bool use_threads;
+    bool uring;
+    bool stopping;
+    pthread_mutex_t lock;
+    // Signalled when a transfer or a request completes.
+    pthread_cond_t changed;
+    // Transfers submitted and not yet complete.
+    uint32_t outstanding;
+
+    struct vfs_aio_ring ring;
+    uint32_t ring_in_flight;
+    pthread_t reaper;
+
+    struct vfs_aio_transfer * queue_head;
+    struct vfs_aio_transfer * queue_tail;
+    pthread_t workers[VFS_AIO_WORKERS];
+};
+
+void vfs_aio_init(struct vfs * vfs, bool use_threads);
+void vfs_aio_destroy(struct vfs * vfs);
+void vfs_aio_drain(struct vfs * vfs);
+const char * vfs_aio_engine(struct vfs * vfs);
+
+void vfs_io_begin(struct vfs_io * io, vfs_io_callback callback, void * context);
+void vfs_io_read(struct vfs_io * io, uint64_t offset, size_t size, void * buffer);
+void vfs_io_write(struct vfs_io * io, uint64_t offset, size_t size, const void * buffer);
+void vfs_io_submit(struct vfs * vfs, struct vfs_io * io);
+
+bool vfs_io_poll(struct vfs * vfs, struct vfs_io * io);
+int vfs_io_wait(struct vfs * vfs, struct vfs_io * io);
+
+#endif
@@ -0,0 +1,722 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+
+static inline uint32_t vfs_cache_bucket(struct page_cache * cache, uint32_t page_number)
+{
+    return (page_number * 2654435761u) % cache->bucket_count;
+}
+
+static inline uint8_t * vfs_cache_frame_data(struct page_cache * cache, int32_t frame)
+{
+    return cache->data + (size_t) frame * cache->page_size;
+}
+
+static inline void vfs_cache_mark(struct page_cache * cache, int32_t frame, bool dirty)
+{
+    if(cache->frames[frame].dirty == dirty)
+        return;
+    cache->frames[frame].dirty = dirty;
+    if(dirty)
+        cache->dirty_count++;
+    else
+        cache->dirty_count--;
+}
+
+/*
+ * @brief: allocates a cache of capacity pages for the file system. With a
+ *         journal there are as many spare frames as one transaction holds
+ *         pages, more dirty pages than that can not be committed anyway.
+ *
+ * @param vfs: file system which the cache belongs to.
+ * @param capacity: number of pages to hold, at least VFS_CACHE_MIN_PAGES.
+ */
+void vfs_cache_init(vfs_t vfs, uint32_t capacity)
+{
+    struct page_cache * cache = &vfs->cache;
+
+    if(capacity < VFS_CACHE_MIN_PAGES)
+        capacity = VFS_CACHE_MIN_PAGES;
+
+    cache->capacity = capacity;
+    cache->frame_limit = capacity;
+    if(vfs->journal_pages != 0)
+        cache->frame_limit += vfs_journal_max_pages(vfs);
+    cache->bucket_count = capacity * 2;
+    cache->clock_hand = 0;
+    cache->page_size = vfs->page_size;
+    cache->data = (uint8_t *) calloc(cache->frame_limit, cache->page_size);
+    cache->frames = (struct cache_frame *) calloc(cache->frame_limit, sizeof(*cache->frames));
+    cache->buckets = (int32_t *) malloc(cache->bucket_count * sizeof(*cache->buckets));
+    if(cache->data == NULL || cache->frames == NULL || cache->buckets == NULL)
+    {
+        ERR("Unable to allocate page cache.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t i = 0;
+    for(i = 0; i < cache->bucket_count; ++i)
+        cache->buckets[i] = -1;
+    for(i = 0; i < cache->frame_limit; ++i)
+        cache->frames[i].hash_next = -1;
+
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+    cache->writebacks = 0;
+    cache->overflows = 0;
+    cache->dirty_count = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+}
+
+/*
+ * @brief: releases the cache memory. Dirty pages are dropped, call
+ *         vfs_cache_flush() first to keep them.
+ */
+void vfs_cache_destroy(vfs_t vfs)
+{
+    if(vfs->cache.frames != NULL)
+    {
+        pthread_mutex_destroy(&vfs->cache.lock);
+        pthread_cond_destroy(&vfs->cache.loaded);
+    }
+    free(vfs->cache.data);
+    free(vfs->cache.frames);
+    free(vfs->cache.buckets);
+    memset(&vfs->cache, 0, sizeof(vfs->cache));
+}
+
+static int32_t vfs_cache_find(struct page_cache * cache, uint32_t page_number)
+{
+    int32_t frame = cache->buckets[vfs_cache_bucket(cache, page_number)];
+    while(frame != -1 && cache->frames[frame].page_number != page_number)
+        frame = cache->frames[frame].hash_next;
+    return frame;
+}
+
+// Callers hold the cache lock.
+static bool vfs_cache_holds_any(struct page_cache * cache, uint32_t page_number, uint32_t count)
+{
+    uint32_t i = 0;
+    for(i = 0; i < count; ++i)
+    {
+        if(vfs_cache_find(cache, page_number + i) != -1)
+            return true;
+    }
+    return false;
+}
+
+static void vfs_cache_unlink(struct page_cache * cache, int32_t frame)
+{
+    int32_t * link = &cache->buckets[vfs_cache_bucket(cache, cache->frames[frame].page_number)];
+    while(*link != frame)
+        link = &cache->frames[*link].hash_next;
+    *link = cache->frames[frame].hash_next;
+    cache->frames[frame].hash_next = -1;
+    cache->frames[frame].valid = false;
+}
+
+static void vfs_cache_write_frame(vfs_t vfs, int32_t frame)
+{
+    struct page_cache * cache = &vfs->cache;
+    vfs_disk_write(vfs, cache->frames[frame].page_number, 1, vfs_cache_frame_data(cache, frame));
+    vfs_cache_mark(cache, frame, false);
+    cache->writebacks++;
+}
+
+/*
+ * @brief: finds a frame to reuse with the CLOCK algorithm, writing back its
+ *         page if it is dirty. With a journal a dirty page written back
+ *         before its transaction commits breaks the transaction, so dirty
+ *         frames are passed over and a spare frame is taken when no clean
+ *         one is left.
+ */
+static int32_t vfs_cache_claim_frame(vfs_t vfs)
+{
+    struct page_cache * cache = &vfs->cache;
+    bool journaled = vfs_journal_active(vfs);
+
+    // The first sweep clears every referenced bit, a second finding nothing
+    // means every frame is pinned, or dirty when journaling.
+    uint32_t steps = 0;
+    for(steps = 0; steps < cache->capacity * 2; ++steps)
+    {
+        int32_t frame = (int32_t) cache->clock_hand;
+        struct cache_frame * entry = &cache->frames[frame];
+        cache->clock_hand = (cache->clock_hand + 1) % cache->capacity;
+
+        if(!entry->valid)
+            return frame;
+        if(entry->pins != 0)
+            continue;
+        if(entry->referenced)
+        {
+            entry->referenced = false;
+            continue;
+        }
+        if(entry->dirty && journaled)
+            continue;
+
+        if(entry->dirty)
+            vfs_cache_write_frame(vfs, frame);
+        vfs_cache_unlink(cache, frame);
+        cache->evictions++;
+        return frame;
+    }
+
+    uint32_t frame = 0;
+    for(frame = cache->capacity; frame < cache->frame_limit; ++frame)
+    {
+        if(!cache->frames[frame].valid)
+        {
+            cache->overflows++;
+            return (int32_t) frame;
+        }
+    }
+
+    ERR("Every page in the cache is pinned or waiting for its transaction to commit.\r\n\t"
+        "Exiting.");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * @brief: gives a spare frame back once its page is clean and unpinned.
+ *         Callers hold the cache lock.
+ */
+static void vfs_cache_release_spare(struct page_cache * cache, int32_t frame)
+{
+    struct cache_frame * entry = &cache->frames[frame];
+    if((uint32_t) frame >= cache->capacity && entry->valid && entry->pins == 0 && !entry->dirty)
+        vfs_cache_unlink(cache, frame);
+}
+
+/*
+ * @brief: finds or loads a page and pins its frame. Callers hold the cache
+ *         lock, it is released while a miss is read from disk.
+ */
+static int32_t vfs_cache_lookup(vfs_t vfs, uint32_t page_number, bool read_page)
+{
+    struct page_cache * cache = &vfs->cache;
+
+    int32_t frame = vfs_cache_find(cache, page_number);
+    if(frame != -1)
+    {
+        cache->hits++;
+        cache->frames[frame].referenced = true;
+        cache->frames[frame].pins++;
+        while(cache->frames[frame].loading)
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+        return frame;
+    }
+
+    cache->misses++;
+    frame = vfs_cache_claim_frame(vfs);
+    struct cache_frame * entry = &cache->frames[frame];
+    entry->page_number = page_number;
+    entry->valid = true;
+    entry->dirty = false;
+    entry->referenced = true;
+    entry->pins = 1;
+    entry->loading = read_page;
+    uint32_t bucket = vfs_cache_bucket(cache, page_number);
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = frame;
+
+    if(read_page)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        vfs_disk_read(vfs, page_number, 1, vfs_cache_frame_data(cache, frame));
+        pthread_mutex_lock(&cache->lock);
+        entry->loading = false;
+        pthread_cond_broadcast(&cache->loaded);
+    }
+    return frame;
+}
+
+/*
+ * @brief: waits until no page in the range is being loaded, so what a write
+ *         puts in a cached copy is not replaced by the disk read finishing.
+ *         Callers hold the cache lock.
+ */
+static void vfs_cache_wait_loaded(struct page_cache * cache, uint32_t page_number, uint32_t count)
+{
+    uint32_t i = 0;
+    while(i < count)
+    {
+        int32_t frame = vfs_cache_find(cache, page_number + i);
+        if(frame != -1 && cache->frames[frame].loading)
+        {
+            // Other pages in the range may have started loading meanwhile.
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+            i = 0;
+            continue;
+        }
+        ++i;
+    }
+}
+
+/*
+ * @brief: returns a pointer to the cached contents of a page, reading it from
+ *         disk on a miss. The page stays pinned in the cache until it is
+ *         released with vfs_page_put(). When the image is mapped the page is
+ *         returned in place and no cache is involved.
+ *
+ * @param vfs: file system which the operation executes on.
+ * @param page_number: page to access.
+ * @return: vfs->page_size bytes of page contents.
+ */
+uint8_t * vfs_page_get(vfs_t vfs, uint32_t page_number)
+{
+    VFS_TRACE(vfs, VFS_TRACE_READ, page_number, 0, vfs->page_size);
+    if(vfs->map != NULL)
+        return vfs_map_pages(vfs, page_number, 1);
+
+    pthread_mutex_lock(&vfs->cache.lock);
+    uint8_t * page = vfs_cache_frame_data(&vfs->cache, vfs_cache_lookup(vfs, page_number, true));
+    pthread_mutex_unlock(&vfs->cache.lock);
+    return page;
+}
+
+/*
+ * @brief: like vfs_page_get() but the page contents are set to zero and
+ *         marked dirty instead of being read from disk. Used for pages that
+ *         were just allocated.
+ */
+uint8_t * vfs_page_get_zeroed(vfs_t vfs, uint32_t page_number)
+{
+    VFS_TRACE(vfs, VFS_TRACE_WRITE, page_number, 0, vfs->page_size);
+    if(vfs->map != NULL)
+        return memset(vfs_map_pages(vfs, page_number, 1), 0, vfs->page_size);
+
+    pthread_mutex_lock(&vfs->cache.lock);
+    int32_t frame = vfs_cache_lookup(vfs, page_number, false);
+    memset(vfs_cache_frame_data(&vfs->cache, frame), 0, vfs->page_size);
+    vfs_cache_mark(&vfs->cache, frame, true);
+    pthread_mutex_unlock(&vfs->cache.lock);
+    return vfs_cache_frame_data(&vfs->cache, frame);
+}
+
+/*
+ * @brief: releases a page returned by vfs_page_get().
+ *
+ * @param page: pointer returned by vfs_page_get().
+ * @param dirty: true if the page contents were modified.
+ */
+void vfs_page_put(vfs_t vfs, uint8_t * page, bool dirty)
+{
+    struct page_cache * cache = &vfs->cache;
+    if(vfs->map != NULL)
+    {
+        if(dirty)
+            VFS_TRACE(vfs, VFS_TRACE_WRITE, (uint32_t) ((page - vfs->map) / vfs->page_size), 0, vfs->page_size);
+        return;
+    }
+
+    int32_t frame = (int32_t) ((page - cache->data) / cache->page_size);
+    if(dirty)
+        VFS_TRACE(vfs, VFS_TRACE_WRITE, cache->frames[frame].page_number, 0, vfs->page_size);
+
+    pthread_mutex_lock(&cache->lock);
+    if(cache->frames[frame].pins == 0)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        ERR("Releasing a page that is not pinned.");
+        return;
+    }
+
+    cache->frames[frame].pins--;
+    if(dirty)
+        vfs_cache_mark(cache, frame, true);
+    vfs_cache_release_spare(cache, frame);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * @brief: marks a page returned by vfs_page_get() as modified while it stays
+ *         pinned, so the next commit or flush writes it.
+ */
+void vfs_page_dirty(vfs_t vfs, uint8_t * page)
+{
+    struct page_cache * cache = &vfs->cache;
+    if(vfs->map != NULL)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    vfs_cache_mark(cache, (int32_t) ((page - cache->data) / cache->page_size), true);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * @brief: copies size bytes at offset within a page into buffer.
+ */
+void vfs_page_read(vfs_t vfs, uint32_t page_number, uint32_t offset, void * buffer, size_t size)
+{
+    if(offset + size > vfs->page_size)
+    {
+        ERR("Attempting to read past the end of a page.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t * page = vfs_page_get(vfs, page_number);
+    memcpy(buffer, page + offset, size);
+    vfs_page_put(vfs, page, false);
+}
+
+/*
+ * @brief: copies size bytes from buffer to offset within a page. The page is
+ *         written to disk when it is evicted or on vfs_sync().
+ */
+void vfs_page_write(vfs_t vfs, uint32_t page_number, uint32_t offset, const void * buffer, size_t size)
+{
+    if(offset + size > vfs->page_size)
+    {
+        ERR("Attempting to write past the end of a page.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t * page = vfs_page_get(vfs, page_number);
+    memcpy(page + offset, buffer, size);
+    vfs_page_put(vfs, page, true);
+}
+
+/*
+ * @brief: reads count consecutive pages into buffer with one disk read,
+ *         taking the contents of any page held in the cache from the cache.
+ *         Used for file data so large reads do not displace metadata. The
+ *         disk read runs without the cache lock.
+ */
+void vfs_pages_read(vfs_t vfs, uint32_t page_number, uint32_t count, void * buffer)
+{
+    struct page_cache * cache = &vfs->cache;
+    VFS_TRACE(vfs, VFS_TRACE_READ, page_number, 0, (size_t) count * vfs->page_size);
+
+    if(vfs->map != NULL)
+    {
+        vfs_disk_read(vfs, page_number, count, buffer);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    bool cached = vfs_cache_holds_any(cache, page_number, count);
+    uint64_t writebacks = cache->writebacks;
+    pthread_mutex_unlock(&cache->lock);
+
+    vfs_disk_read(vfs, page_number, count, buffer);
+    if(!cached)
+        return;
+
+    // A dirty page written back during the read may have been missed by it,
+    // and is no longer dirty to be copied from the cache.
+    pthread_mutex_lock(&cache->lock);
+    if(cache->writebacks != writebacks)
+        vfs_disk_read(vfs, page_number, count, buffer);
+    uint32_t i = 0;
+    for(i = 0; i < count; ++i)
+    {
+        int32_t frame = vfs_cache_find(cache, page_number + i);
+        if(frame != -1 && cache->frames[frame].dirty)
+            memcpy((uint8_t *) buffer + (size_t) i * vfs->page_size, vfs_cache_frame_data(cache, frame), vfs->page_size);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * @brief: reads size bytes starting offset bytes into page page_number, which
+ *         may span consecutive pages, with one disk read. Cached pages that
+ *         are dirty take precedence over the disk contents.
+ */
+void vfs_range_read(vfs_t vfs, uint32_t page_number, uint32_t offset, size_t size, void * buffer)
+{
+    struct page_cache * cache = &vfs->cache;
+    uint32_t page_count = (uint32_t) ((offset + size + vfs->page_size - 1) / vfs->page_size);
+    VFS_TRACE(vfs, VFS_TRACE_READ, page_number, offset, size);
+
+    if(vfs->map != NULL)
+    {
+        memcpy(buffer, vfs_map_pages(vfs, page_number, page_count) + offset, size);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    bool cached = vfs_cache_holds_any(cache, page_number, page_count);
+    uint64_t writebacks = cache->writebacks;
+    pthread_mutex_unlock(&cache->lock);
+
+    vfs_disk_read_range(vfs, (uint64_t) page_number * vfs->page_size + offset, size, buffer);
+    if(!cached)
+        return;
+
+    // As in vfs_pages_read(), a write back during the read means reading again.
+    pthread_mutex_lock(&cache->lock);
+    if(cache->writebacks != writebacks)
+        vfs_disk_read_range(vfs, (uint64_t) page_number * vfs->page_size + offset, size, buffer);
+    uint32_t i = 0;
+    for(i = 0; i < page_count; ++i)
+    {
+        int32_t frame = vfs_cache_find(cache, page_number + i);
+        if(frame == -1 || !cache->frames[frame].dirty)
+            continue;
+
+        // Intersect the page with [offset, offset + size).
+        size_t page_start = (size_t) i * vfs->page_size;
+        size_t copy_start = (page_start > offset) ? page_start : offset;
+        size_t copy_end = (page_start + vfs->page_size < offset + size) ? page_start + vfs->page_size : offset + size;
+        memcpy((uint8_t *) buffer + (copy_start - offset),
+               vfs_cache_frame_data(cache, frame) + (copy_start - page_start), copy_end - copy_start);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * @brief: writes size bytes starting offset bytes into page page_number, which
+ *         may span consecutive pages, with one disk write. Cached copies of
+ *         the pages are updated so the cache stays coherent.
+ */
+void vfs_range_write(vfs_t vfs, uint32_t page_number, uint32_t offset, size_t size, const void * buffer)
+{
+    struct page_cache * cache = &vfs->cache;
+    uint32_t page_count = (uint32_t) ((offset + size + vfs->page_size - 1) / vfs->page_size);
+    VFS_TRACE(vfs, VFS_TRACE_WRITE, page_number, offset, size);
+
+    if(vfs->map != NULL)
+    {
+        memcpy(vfs_map_pages(vfs, page_number, page_count) + offset, buffer, size);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if(!vfs_cache_holds_any(cache, page_number, page_count))
+    {
+        pthread_mutex_unlock(&cache->lock);
+        vfs_disk_write_range(vfs, (uint64_t) page_number * vfs->page_size + offset, size, buffer);
+        return;
+    }
+
+    vfs_cache_wait_loaded(cache, page_number, page_count);
+    vfs_disk_write_range(vfs, (uint64_t) page_number * vfs->page_size + offset, size, buffer);
+    uint32_t i = 0;
+    for(i = 0; i < page_count; ++i)
+    {
+        int32_t frame = vfs_cache_find(cache, page_number + i);
+        if(frame == -1)
+            continue;
+
+        // Intersect the page with [offset, offset + size). A dirty page stays
+        // dirty, the rest of it has not been written yet.
+        size_t page_start = (size_t) i * vfs->page_size;
+        size_t copy_start = (page_start > offset) ? page_start : offset;
+        size_t copy_end = (page_start + vfs->page_size < offset + size) ? page_start + vfs->page_size : offset + size;
+        memcpy(vfs_cache_frame_data(cache, frame) + (copy_start - page_start),
+               (const uint8_t *) buffer + (copy_start - offset), copy_end - copy_start);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * @brief: writes count consecutive pages from buffer with one disk write.
+ *         Cached copies of the pages are updated so the cache stays coherent.
+ */
+void vfs_pages_write(vfs_t vfs, uint32_t page_number, uint32_t count, const void * buffer)
+{
+    struct page_cache * cache = &vfs->cache;
+    VFS_TRACE(vfs, VFS_TRACE_WRITE, page_number, 0, (size_t) count * vfs->page_size);
+
+    if(vfs->map != NULL)
+    {
+        vfs_disk_write(vfs, page_number, count, buffer);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if(!vfs_cache_holds_any(cache, page_number, count))
+    {
+        pthread_mutex_unlock(&cache->lock);
+        vfs_disk_write(vfs, page_number, count, buffer);
+        return;
+    }
+
+    vfs_cache_wait_loaded(cache, page_number, count);
+    vfs_disk_write(vfs, page_number, count, buffer);
+    uint32_t i = 0;
+    for(i = 0; i < count; ++i)
+    {
+        int32_t frame = vfs_cache_find(cache, page_number + i);
+        if(frame != -1)
+        {
+            memcpy(vfs_cache_frame_data(cache, frame), (const uint8_t *) buffer + (size_t) i * vfs->page_size, vfs->page_size);
+            vfs_cache_mark(cache, frame, false);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * @brief: like vfs_range_read() but the disk read is added to io instead of
+ *         being done at once. A range with a page in the cache, or in a mapped
+ *         image, is read at once instead.
+ */
+void vfs_range_read_async(vfs_t vfs, struct vfs_io * io, uint32_t page_number, uint32_t offset, size_t size, void * buffer)
+{
+    struct page_cache * cache = &vfs->cache;
+    uint32_t page_count = (uint32_t) ((offset + size + vfs->page_size - 1) / vfs->page_size);
+
+    if(vfs->map == NULL)
+    {
+        pthread_mutex_lock(&cache->lock);
+        bool cached = vfs_cache_holds_any(cache, page_number, page_count);
+        pthread_mutex_unlock(&cache->lock);
+        if(!cached)
+        {
+            VFS_TRACE(vfs, VFS_TRACE_READ, page_number, offset, size);
+            vfs_io_read(io, (uint64_t) page_number * vfs->page_size + offset, size, buffer);
+            return;
+        }
+    }
+    vfs_range_read(vfs, page_number, offset, size, buffer);
+}
+
+/*
+ * @brief: like vfs_range_write() but the disk write is added to io instead of
+ *         being done at once. A range with a page in the cache, or in a mapped
+ *         image, is written at once instead.
+ */
+void vfs_range_write_async(vfs_t vfs, struct vfs_io * io, uint32_t page_number, uint32_t offset, size_t size, const void * buffer)
+{
+    struct page_cache * cache = &vfs->cache;
+    uint32_t page_count = (uint32_t) ((offset + size + vfs->page_size - 1) / vfs->page_size);
+
+    if(vfs->map == NULL)
+    {
+        pthread_mutex_lock(&cache->lock);
+        bool cached = vfs_cache_holds_any(cache, page_number, page_count);
+        pthread_mutex_unlock(&cache->lock);
+        if(!cached)
+        {
+            VFS_TRACE(vfs, VFS_TRACE_WRITE, page_number, offset, size);
+            vfs_io_write(io, (uint64_t) page_number * vfs->page_size + offset, size, buffer);
+            return;
+        }
+    }
+    vfs_range_write(vfs, page_number, offset, size, buffer);
+}
+
+struct cache_dirty_frame {
+    uint32_t page_number;
+    int32_t frame;
+};
+
+static int vfs_cache_compare_dirty(const void * a, const void * b)
+{
+    uint32_t page_a = ((const struct cache_dirty_frame *) a)->page_number;
+    uint32_t page_b = ((const struct cache_dirty_frame *) b)->page_number;
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+/*
+ * @brief: writes every dirty page in the cache back to disk, in page order,
+ *         first logging them as one journal transaction if journal is set.
+ */
+static void vfs_cache_write_back(vfs_t vfs, bool journal)
+{
+    struct page_cache * cache = &vfs->cache;
+    if(cache->frames == NULL)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    struct cache_dirty_frame * dirty = (struct cache_dirty_frame *) malloc(cache->frame_limit * sizeof(*dirty));
+    uint32_t dirty_count = 0;
+
+    uint32_t i = 0;
+    for(i = 0; i < cache->frame_limit; ++i)
+    {
+        if(cache->frames[i].valid && cache->frames[i].dirty)
+        {
+            dirty[dirty_count].page_number = cache->frames[i].page_number;
+            dirty[dirty_count].frame = (int32_t) i;
+            dirty_count++;
+        }
+    }
+
+    qsort(dirty, dirty_count, sizeof(*dirty), vfs_cache_compare_dirty);
+
+    if(journal && dirty_count != 0)
+    {
+        uint32_t * page_numbers = (uint32_t *) malloc(dirty_count * sizeof(*page_numbers));
+        const uint8_t ** contents = (const uint8_t **) malloc(dirty_count * sizeof(*contents));
+        for(i = 0; i < dirty_count; ++i)
+        {
+            page_numbers[i] = dirty[i].page_number;
+            contents[i] = vfs_cache_frame_data(cache, dirty[i].frame);
+        }
+        vfs_journal_write(vfs, page_numbers, contents, dirty_count);
+        free(page_numbers);
+        free(contents);
+    }
+
+    for(i = 0; i < dirty_count; ++i)
+    {
+        vfs_cache_write_frame(vfs, dirty[i].frame);
+        vfs_cache_release_spare(cache, dirty[i].frame);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    free(dirty);
+}
+
+void vfs_cache_flush(vfs_t vfs)
+{
+    vfs_cache_write_back(vfs, false);
+}
+
+/*
+ * @brief: commits every dirty page as one journal transaction, then writes
+ *         them in place. Callers make sure no operation is half done.
+ */
+void vfs_cache_commit(vfs_t vfs)
+{
+    vfs_cache_write_back(vfs, true);
+}
+
+uint32_t vfs_cache_dirty_count(vfs_t vfs)
+{
+    if(vfs->cache.frames == NULL)
+        return 0;
+
+    pthread_mutex_lock(&vfs->cache.lock);
+    uint32_t dirty_count = vfs->cache.dirty_count;
+    pthread_mutex_unlock(&vfs->cache.lock);
+    return dirty_count;
+}
+
+struct vfs_cache_stats vfs_cache_stats(vfs_t vfs)
+{
+    struct page_cache * cache = &vfs->cache;
+    if(cache->frames == NULL)
+        return (struct vfs_cache_stats) {0};
+
+    pthread_mutex_lock(&cache->lock);
+    struct vfs_cache_stats stats = {
+            .capacity = cache->capacity,
+            .dirty = 0,
+            .hits = cache->hits,
+            .misses = cache->misses,
+            .evictions = cache->evictions,
+            .writebacks = cache->writebacks,
+            .overflows = cache->overflows
+    };
+
+    uint32_t i = 0;
+    for(i = 0; i < cache->frame_limit; ++i)
+    {
+        if(cache->frames[i].valid && cache->frames[i].dirty)
+            stats.dirty++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return stats;
+}
@@ -0,0 +1,95 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define VFS_CACHE_DEFAULT_PAGES 256
+#define VFS_CACHE_MIN_PAGES 16
+
+struct vfs;
+struct vfs_io;
+
+struct cache_frame {
+    uint32_t page_number;
+    uint16_t pins;
+    bool valid;
+    bool dirty;
+    // Second chance bit for the CLOCK sweep.
+    bool referenced;
+    // The page is being read from disk without the cache lock. The frame is
+    // pinned until it is loaded.
+    bool loading;
+    // Next frame in the same hash bucket, -1 ends the chain.
+    int32_t hash_next;
+};
+
+/*
+ * Write-back cache of whole disk pages, keyed by page number. Frames are
+ * replaced with CLOCK, pinned frames are never replaced. lock guards the
+ * frames and the counters, the contents of a pinned page are guarded by
+ * whatever lock the caller holds on the structure the page belongs to.
+ * Misses are read from disk with lock released, anyone else wanting the
+ * same page waits on loaded until its frame is no longer loading.
+ *
+ * With a journal a dirty page may not reach the disk before its transaction
+ * commits. When every frame CLOCK may take is dirty a spare frame past
+ * capacity is used instead, and dropped again once its page is committed.
+ */
+struct page_cache {
+    uint8_t * data;
+    struct cache_frame * frames;
+    int32_t * buckets;
+    uint32_t capacity;
+    // capacity plus the spare frames, every frame that is allocated.
+    uint32_t frame_limit;
+    uint32_t bucket_count;
+    uint32_t clock_hand;
+    uint32_t page_size;
+    uint32_t dirty_count;
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+    // Spare frames taken because every other frame was dirty.
+    uint64_t overflows;
+};
+
+struct vfs_cache_stats {
+    uint32_t capacity;
+    uint32_t dirty;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+    uint64_t overflows;
+};
+
+void vfs_cache_init(struct vfs * vfs, uint32_t capacity);
+void vfs_cache_destroy(struct vfs * vfs);
+void vfs_cache_flush(struct vfs * vfs);
+void vfs_cache_commit(struct vfs * vfs);
+uint32_t vfs_cache_dirty_count(struct vfs * vfs);
+struct vfs_cache_stats vfs_cache_stats(struct vfs * vfs);
+
+uint8_t * vfs_page_get(struct vfs * vfs, uint32_t page_number);
+uint8_t * vfs_page_get_zeroed(struct vfs * vfs, uint32_t page_number);
+void vfs_page_put(struct vfs * vfs, uint8_t * page, bool dirty);
+void vfs_page_dirty(struct vfs * vfs, uint8_t * page);
+
+void vfs_page_read(struct vfs * vfs, uint32_t page_number, uint32_t offset, void * buffer, size_t size);
+void vfs_page_write(struct vfs * vfs, uint32_t page_number, uint32_t offset, const void * buffer, size_t size);
+
+void vfs_pages_read(struct vfs * vfs, uint32_t page_number, uint32_t count, void * buffer);
+void vfs_pages_write(struct vfs * vfs, uint32_t page_number, uint32_t count, const void * buffer);
+void vfs_range_read(struct vfs * vfs, uint32_t page_number, uint32_t offset, size_t size, void * buffer);
+void vfs_range_write(struct vfs * vfs, uint32_t page_number, uint32_t offset, size_t size, const void * buffer);
+void vfs_range_read_async(struct vfs * vfs, struct vfs_io * io, uint32_t page_number, uint32_t offset, size_t size, void * buffer);
+void vfs_range_write_async(struct vfs * vfs, struct vfs_io * io, uint32_t page_number, uint32_t offset, size_t size, const void * buffer);
+
+#endif
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+
+static uint32_t vfs_dentry_hash(struct dentry_cache * dentries, uint16_t parent, const char * name)
+{
+    // FNV-1a over the parent inode number and the name.
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ (parent & 0xFFu)) * 16777619u;
+    hash = (hash ^ (parent >> 8)) * 16777619u;
+
+    int i = 0;
+    for(i = 0; i < VFS_DENTRY_NAME_LENGTH && name[i] != '\0'; ++i)
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+
+    return hash % dentries->bucket_count;
+}
+
+/*
+ * @brief: allocates a dentry cache of capacity entries for the file system.
+ */
+void vfs_dentry_init(vfs_t vfs, uint32_t capacity)
+{
+    struct dentry_cache * dentries = &vfs->dentries;
+
+    dentries->capacity = capacity;
+    dentries->bucket_count = capacity * 2;
+    dentries->next_victim = 0;
+    dentries->entries = (struct dentry *) calloc(capacity, sizeof(*dentries->entries));
+    dentries->buckets = (int32_t *) malloc(dentries->bucket_count * sizeof(*dentries->buckets));
+    if(dentries->entries == NULL || dentries->buckets == NULL)
+    {
+        ERR("Unable to allocate dentry cache.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t i = 0;
+    for(i = 0; i < dentries->bucket_count; ++i)
+        dentries->buckets[i] = -1;
+    for(i = 0; i < capacity; ++i)
+        dentries->entries[i].hash_next = -1;
+
+    dentries->hits = 0;
+    dentries->misses = 0;
+    pthread_mutex_init(&dentries->lock, NULL);
+}
+
+void vfs_dentry_destroy(vfs_t vfs)
+{
+    pthread_mutex_destroy(&vfs->dentries.lock);
+    free(vfs->dentries.entries);
+    free(vfs->dentries.buckets);
+    memset(&vfs->dentries, 0, sizeof(vfs->dentries));
+}
+
+static int32_t vfs_dentry_find(struct dentry_cache * dentries, uint16_t parent, const char * name, int32_t ** link)
+{
+    *link = &dentries->buckets[vfs_dentry_hash(dentries, parent, name)];
+    while(**link != -1)
+    {
+        struct dentry * entry = &dentries->entries[**link];
+        if(entry->parent == parent && strncmp(entry->name, name, VFS_DENTRY_NAME_LENGTH) == 0)
+            return **link;
+        *link = &entry->hash_next;
+    }
+    return -1;
+}
+
+static void vfs_dentry_remove(struct dentry_cache * dentries, int32_t index)
+{
+    struct dentry * entry = &dentries->entries[index];
+    int32_t * link = NULL;
+    vfs_dentry_find(dentries, entry->parent, entry->name, &link);
+    *link = entry->hash_next;
+    entry->hash_next = -1;
+    entry->valid = false;
+}
+
+/*
+ * @brief: looks up name in directory parent.
+ *
+ * @param inode_number: set to the cached inode number, 0 if the name is
+ *                      cached as not existing.
+ * @return: true if the lookup was answered from the cache.
+ */
+bool vfs_dentry_lookup(vfs_t vfs, uint16_t parent, const char * name, uint16_t * inode_number)
+{
+    struct dentry_cache * dentries = &vfs->dentries;
+    int32_t * link = NULL;
+    pthread_mutex_lock(&dentries->lock);
+    int32_t index = vfs_dentry_find(dentries, parent, name, &link);
+    if(index == -1)
+    {
+        dentries->misses++;
+        pthread_mutex_unlock(&dentries->lock);
+        return false;
+    }
+
+    dentries->hits++;
+    *inode_number = dentries->entries[index].inode_number;
+    pthread_mutex_unlock(&dentries->lock);
+    return true;
+}
+
+/*
+ * @brief: records the result of looking up name in directory parent,
+ *         inode_number 0 records that it does not exist. Directories call
+ *         this when they gain an entry so a negative entry is replaced.
+ */
+void vfs_dentry_insert(vfs_t vfs, uint16_t parent, const char * name, uint16_t inode_number)
+{
+    struct dentry_cache * dentries = &vfs->dentries;
+    int32_t * link = NULL;
+    pthread_mutex_lock(&dentries->lock);
+    int32_t index = vfs_dentry_find(dentries, parent, name, &link);
+    if(index != -1)
+    {
+        dentries->entries[index].inode_number = inode_number;
+        pthread_mutex_unlock(&dentries->lock);
+        return;
+    }
+
+    index = (int32_t) dentries->next_victim;
+    dentries->next_victim = (dentries->next_victim + 1) % dentries->capacity;
+    if(dentries->entries[index].valid)
+        vfs_dentry_remove(dentries, index);
+
+    struct dentry * entry = &dentries->entries[index];
+    entry->parent = parent;
+    entry->inode_number = inode_number;
+    memset(entry->name, 0, sizeof(entry->name));
+    strncpy(entry->name, name, VFS_DENTRY_NAME_LENGTH);
+    entry->valid = true;
+
+    uint32_t bucket = vfs_dentry_hash(dentries, parent, name);
+    entry->hash_next = dentries->buckets[bucket];
+    dentries->buckets[bucket] = index;
+    pthread_mutex_unlock(&dentries->lock);
+}
@@ -0,0 +1,45 @@
+#ifndef DENTRY_H
+#define DENTRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define VFS_DENTRY_CACHE_ENTRIES 1024
+#define VFS_DENTRY_NAME_LENGTH 30
+
+struct vfs;
+
+/*
+ * A cached directory lookup. inode_number 0 is a negative entry, the name is
+ * known not to exist in the parent directory.
+ */
+struct dentry {
+    uint16_t parent;
+    uint16_t inode_number;
+    char name[VFS_DENTRY_NAME_LENGTH + 1];
+    bool valid;
+    // Next entry in the same hash bucket, -1 ends the chain.
+    int32_t hash_next;
+};
+
+struct dentry_cache {
+    struct dentry * entries;
+    int32_t * buckets;
+    uint32_t capacity;
+    uint32_t bucket_count;
+    // Entries are replaced round robin once the cache is full.
+    uint32_t next_victim;
+    pthread_mutex_t lock;
+
+    uint64_t hits;
+    uint64_t misses;
+};
+
+void vfs_dentry_init(struct vfs * vfs, uint32_t capacity);
+void vfs_dentry_destroy(struct vfs * vfs);
+
+bool vfs_dentry_lookup(struct vfs * vfs, uint16_t parent, const char * name, uint16_t * inode_number);
+void vfs_dentry_insert(struct vfs * vfs, uint16_t parent, const char * name, uint16_t inode_number);
+
+#endif
@@ -3,55 +3,363 @@
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "disk.h"
 
-void fseek_w(FILE * file, long int offset, int whence)
+void pread_w(int fd, void * buffer, size_t size, uint64_t offset)
 {
-    if(fseek(file, offset, whence) != 0)
+    uint8_t * bytes = (uint8_t *) buffer;
+    while(size != 0)
     {
-        ERR("fseek() result doesn't match requested.\r\n\t"
+        ssize_t result = pread(fd, bytes, size, (off_t) offset);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result <= 0)
+        {
+            ERR("pread() result doesn't match requested.\r\n\t"
+                "Exiting.");
+            exit(EXIT_FAILURE);
+        }
+        bytes += result;
+        size -= (size_t) result;
+        offset += (uint64_t) result;
+    }
+}
+
+void pwrite_w(int fd, const void * buffer, size_t size, uint64_t offset)
+{
+    const uint8_t * bytes = (const uint8_t *) buffer;
+    while(size != 0)
+    {
+        ssize_t result = pwrite(fd, bytes, size, (off_t) offset);
+        if(result < 0 && errno == EINTR)
+            continue;
+        if(result <= 0)
+        {
+            ERR("pwrite() result doesn't match requested.\r\n\t"
+                "Exiting.");
+            exit(EXIT_FAILURE);
+        }
+        bytes += result;
+        size -= (size_t) result;
+        offset += (uint64_t) result;
+    }
+}
+
+/*
+ * @brief: reads count consecutive pages from the disk image, bypassing the
+ *         page cache. Only the cache should call this directly.
+ */
+void vfs_disk_read(vfs_t vfs, uint32_t page_number, uint32_t count, void * buffer)
+{
+    if(vfs->map != NULL)
+    {
+        memcpy(buffer, vfs_map_pages(vfs, page_number, count), (size_t) count * vfs->page_size);
+        return;
+    }
+
+    pread_w(vfs->fd, buffer, (size_t) count * vfs->page_size, (uint64_t) page_number * vfs->page_size);
+}
+
+/*
+ * @brief: reads size bytes at byte offset of the disk image, bypassing the
+ *         page cache. Only the cache should call this directly.
+ */
+void vfs_disk_read_range(vfs_t vfs, uint64_t offset, size_t size, void * buffer)
+{
+    pread_w(vfs->fd, buffer, size, offset);
+}
+
+/*
+ * @brief: writes size bytes at byte offset of the disk image, bypassing the
+ *         page cache. Only the cache should call this directly.
+ */
+void vfs_disk_write_range(vfs_t vfs, uint64_t offset, size_t size, const void * buffer)
+{
+    pwrite_w(vfs->fd, buffer, size, offset);
+}
+
+/*
+ * @brief: writes count consecutive pages to the disk image, bypassing the
+ *         page cache. Only the cache should call this directly.
+ */
+void vfs_disk_write(vfs_t vfs, uint32_t page_number, uint32_t count, const void * buffer)
+{
+    if(vfs->map != NULL)
+    {
+        memcpy(vfs_map_pages(vfs, page_number, count), buffer, (size_t) count * vfs->page_size);
+        return;
+    }
+
+    pwrite_w(vfs->fd, buffer, (size_t) count * vfs->page_size, (uint64_t) page_number * vfs->page_size);
+}
+
+/*
+ * @brief: maps the image file over the start of the reserved address range,
+ *         growing the file to size bytes first if it is smaller.
+ */
+static void vfs_map_resize(vfs_t vfs, size_t size)
+{
+    int fd = vfs->fd;
+
+    struct stat image_stat;
+    if(fstat(fd, &image_stat) != 0)
+    {
+        ERR("fstat() on disk image failed.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    if((size_t) image_stat.st_size < size && ftruncate(fd, (off_t) size) != 0)
+    {
+        ERR("ftruncate() unable to grow disk image.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    if(mmap(vfs->map, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        ERR("mmap() of disk image failed.\r\n\t"
             "Exiting.");
         exit(EXIT_FAILURE);
     }
+    __atomic_store_n(&vfs->map_size, size, __ATOMIC_RELEASE);
 }
 
-void fread_w(void *ptr, size_t size, size_t nmemb, FILE * stream)
+/*
+ * @brief: reserves address space for the largest image the free block vector
+ *         can describe and maps the image file into it.
+ */
+static void vfs_map_open(vfs_t vfs)
 {
-    long x = 0;
-    if((x = fread(ptr, size, nmemb, stream)) != nmemb) {
-        ERR("fread() result doesn't match requested.\r\n\t"
+    vfs->map_reserved = (size_t) vfs->capacity * vfs->page_size;
+    void * reserved = mmap(NULL, vfs->map_reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(reserved == MAP_FAILED)
+    {
+        ERR("mmap() unable to reserve address space for disk image.\r\n\t"
             "Exiting.");
         exit(EXIT_FAILURE);
     }
+    vfs->map = (uint8_t *) reserved;
+    vfs->map_size = 0;
+
+    struct stat image_stat;
+    fstat(vfs->fd, &image_stat);
+    size_t size = (size_t) image_stat.st_size;
+    if(size < vfs->page_size)
+        size = vfs->page_size;
+    if(size > vfs->map_reserved)
+        size = vfs->map_reserved;
+    vfs_map_resize(vfs, size);
 }
 
-void fwrite_w(void *ptr, size_t size, size_t nmemb, FILE * stream)
+/*
+ * @brief: returns a pointer to count pages of the mapped image, growing the
+ *         image and the mapping if they do not reach that far yet.
+ *
+ * @param vfs: file system opened with vfs_options.mmap.
+ * @param page_number: first page wanted.
+ * @param count: number of pages that must be mapped.
+ * @return: pointer to page page_number, valid until vfs_close().
+ */
+uint8_t * vfs_map_pages(vfs_t vfs, uint32_t page_number, uint32_t count)
 {
-    if(fwrite(ptr, size, nmemb, stream) != nmemb) {
-        ERR("fwrite() result doesn't match requested.\r\n\t"
+    size_t end = ((size_t) page_number + count) * vfs->page_size;
+    if(end > __atomic_load_n(&vfs->map_size, __ATOMIC_ACQUIRE))
+    {
+        if(end > vfs->map_reserved)
+        {
+            ERR("Page outside of the disk image.\r\n\t"
+                "Exiting.");
+            exit(EXIT_FAILURE);
+        }
+
+        // Pages already mapped stay valid while the mapping grows, only one
+        // thread grows it at a time.
+        pthread_mutex_lock(&vfs->map_lock);
+        if(end > vfs->map_size)
+        {
+            // Grow geometrically so appends do not remap for every page.
+            size_t size = vfs->map_size * 2;
+            if(size < end)
+                size = end;
+            if(size > vfs->map_reserved)
+                size = vfs->map_reserved;
+            vfs_map_resize(vfs, size);
+        }
+        pthread_mutex_unlock(&vfs->map_lock);
+    }
+    return vfs->map + (size_t) page_number * vfs->page_size;
+}
+
+static void vfs_map_close(vfs_t vfs)
+{
+    munmap(vfs->map, vfs->map_reserved);
+    vfs->map = NULL;
+    vfs->map_size = 0;
+    vfs->map_reserved = 0;
+}
+
+
+/*
+ * The on disk free block vector stores page 0 in the most significant bit of
+ * byte 0. The in memory copy stores page 0 in the least significant bit of
+ * word 0 so a count trailing zeros finds the lowest free page directly.
+ */
+static inline uint8_t vfs_reverse_byte(uint8_t byte)
+{
+    byte = (uint8_t)((byte & 0xF0u) >> 4 | (byte & 0x0Fu) << 4);
+    byte = (uint8_t)((byte & 0xCCu) >> 2 | (byte & 0x33u) << 2);
+    byte = (uint8_t)((byte & 0xAAu) >> 1 | (byte & 0x55u) << 1);
+    return byte;
+}
+
+/*
+ * @brief: reads the free block vector from disk into vfs->free_map.
+ *
+ * @param vfs: file system which the operation executes on.
+ */
+static void vfs_free_map_alloc(vfs_t vfs)
+{
+    if(vfs->free_map != NULL)
+        return;
+
+    vfs->free_map_words = vfs->free_vector_pages * (vfs->page_size / sizeof(uint64_t));
+    vfs->free_map = (uint64_t *) calloc(vfs->free_map_words, sizeof(*vfs->free_map));
+    vfs->free_map_dirty = (uint64_t *) calloc(vfs->free_map_words / 64 + 1, sizeof(*vfs->free_map_dirty));
+    if(vfs->free_map == NULL || vfs->free_map_dirty == NULL)
+    {
+        ERR("Unable to allocate the free map.\r\n\t"
             "Exiting.");
         exit(EXIT_FAILURE);
     }
+}
+
+void vfs_free_map_load(vfs_t vfs)
+{
+    uint32_t words_per_page = vfs->page_size / sizeof(uint64_t);
 
+    vfs_free_map_alloc(vfs);
+
+    uint32_t fbv_page = 0;
+    for(fbv_page = 0; fbv_page < vfs->free_vector_pages; ++fbv_page)
+    {
+        uint8_t * fbv_contents = vfs_page_get(vfs, vfs->free_vector_start + fbv_page);
+        uint32_t word = 0;
+        for(word = 0; word < words_per_page; ++word)
+        {
+            uint64_t bits = 0;
+            int byte = 0;
+            for(byte = 0; byte < 8; ++byte)
+                bits |= (uint64_t) vfs_reverse_byte(fbv_contents[word * 8 + byte]) << (8 * byte);
+            vfs->free_map[fbv_page * words_per_page + word] = bits;
+        }
+        vfs_page_put(vfs, fbv_contents, false);
+    }
+    memset(vfs->free_map_dirty, 0, (vfs->free_map_words / 64 + 1) * sizeof(*vfs->free_map_dirty));
+    vfs->free_map_hint = 0;
 }
 
+/*
+ * @brief: writes every dirty word of the free map back to the free block
+ *         vector pages in the page cache. Each free block vector page with
+ *         dirty words is fetched once for all of them.
+ *
+ * @param vfs: file system which the operation executes on.
+ */
+void vfs_free_map_sync(vfs_t vfs)
+{
+    pthread_mutex_lock(&vfs->alloc_lock);
+    if(vfs->free_map == NULL)
+    {
+        pthread_mutex_unlock(&vfs->alloc_lock);
+        return;
+    }
+
+    uint32_t words_per_page = vfs->page_size / sizeof(uint64_t);
+    uint32_t word = 0;
+    while(word < vfs->free_map_words)
+    {
+        // Skip 64 clean words at a time.
+        if(vfs->free_map_dirty[word / 64] == 0)
+        {
+            word = (word / 64 + 1) * 64;
+            continue;
+        }
+        if((vfs->free_map_dirty[word / 64] & (1ull << word % 64)) == 0)
+        {
+            ++word;
+            continue;
+        }
+
+        uint32_t fbv_page = word / words_per_page;
+        uint32_t page_end = (fbv_page + 1) * words_per_page;
+        uint8_t * fbv_contents = vfs_page_get(vfs, vfs->free_vector_start + fbv_page);
+        for(; word < page_end; ++word)
+        {
+            if((vfs->free_map_dirty[word / 64] & (1ull << word % 64)) == 0)
+                continue;
+
+            int byte = 0;
+            for(byte = 0; byte < 8; ++byte)
+                fbv_contents[(word % words_per_page) * 8 + byte] = vfs_reverse_byte((uint8_t)(vfs->free_map[word] >> (8 * byte)));
+            vfs->free_map_dirty[word / 64] &= ~(1ull << word % 64);
+        }
+        vfs_page_put(vfs, fbv_contents, true);
+    }
+    pthread_mutex_unlock(&vfs->alloc_lock);
+}
+
+// Callers hold alloc_lock.
+static inline void vfs_free_map_require(vfs_t vfs)
+{
+    if(vfs->free_map == NULL)
+        vfs_free_map_load(vfs);
+}
+
+// Page numbers come from the image, a corrupt one must not reach past the free map.
+static void vfs_free_map_check(vfs_t vfs, uint32_t page_number)
+{
+    if(page_number >= vfs->capacity)
+    {
+        ERR("Page outside of the free block vector.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+}
 
-int8_t vfs_page_free_check(vfs_t vfs, uint16_t page_number)
+bool vfs_page_free_check(vfs_t vfs, uint32_t page_number)
 {
-    // Create the bit mask
-    uint8_t byte_mask =  0b10000000u >> page_number % 8;
+    vfs_free_map_check(vfs, page_number);
+    pthread_mutex_lock(&vfs->alloc_lock);
+    vfs_free_map_require(vfs);
+    bool free_page = (vfs->free_map[page_number / 64] & (1ull << page_number % 64)) != 0;
+    pthread_mutex_unlock(&vfs->alloc_lock);
+    return free_page;
+}
 
-    // Seek to free block vector location + offset
-    uint16_t byte_offset = VFS_PAGE_SIZE + page_number / 8;
-    // TODO check this is in proper range
-    fseek_w(vfs->vdisk, byte_offset, SEEK_SET);
+// Callers hold alloc_lock.
+static void vfs_free_map_set(vfs_t vfs, uint32_t page_number, bool marking_as_used)
+{
+    uint32_t word = page_number / 64;
+    uint64_t bit_mask = 1ull << page_number % 64;
+    vfs_free_map_check(vfs, page_number);
 
-    uint8_t byte = 0;
-    // Read a single byte from the file
-    fread_w(&byte, 1, 1, vfs->vdisk);
+    if(marking_as_used)
+    {
+        vfs->free_map[word] &= ~bit_mask;
+    }
+    else
+    {
+        vfs->free_map[word] |= bit_mask;
+        if(word < vfs->free_map_hint)
+            vfs->free_map_hint = word;
+    }
 
-    return byte & byte_mask;
+    vfs->free_map_dirty[word / 64] |= 1ull << word % 64;
 }
 
 /*
@@ -63,77 +371,182 @@ int8_t vfs_page_free_check(vfs_t vfs, uint16_t page_number)
  *                      false indicates bit is being set to 1
  *
  * Macros with defines have been provided to make usage easier, and increase
- * readability.
+ * readability. Only the in memory free map is changed, the free block vector
+ * on disk is updated by vfs_sync(). With a journal a freed page is held back
+ * until vfs_sync() has committed the transaction that freed it.
  */
-void vfs_page_free_modify(vfs_t vfs, uint16_t page_number, bool marking_as_used)
+void vfs_page_free_modify(vfs_t vfs, uint32_t page_number, bool marking_as_used)
 {
-    uint8_t byte_mask = 0b10000000u >> page_number % 8u;
-
-    // Seek to free block vector location + offset
-    uint16_t byte_offset = VFS_PAGE_SIZE + page_number / 8;
-    // TODO check this is in proper range
-    fseek_w(vfs->vdisk, byte_offset, SEEK_SET);
-
-    uint8_t byte;
-    // Read a single byte from the file
-    fread_w(&byte, 1, 1, vfs->vdisk);
-
-    //byte = (marking_as_used ? (byte ^ byte_mask) : (byte | (uint8_t)~byte_mask));
-    byte = byte ^ byte_mask;
+    vfs_free_map_check(vfs, page_number);
+    pthread_mutex_lock(&vfs->alloc_lock);
+    vfs_free_map_require(vfs);
+    if(!marking_as_used && vfs_journal_active(vfs))
+    {
+        if(vfs->free_pending_count == vfs->free_pending_size)
+        {
+            vfs->free_pending_size = (vfs->free_pending_size == 0) ? 64 : vfs->free_pending_size * 2;
+            vfs->free_pending = (uint32_t *) realloc(vfs->free_pending, vfs->free_pending_size * sizeof(*vfs->free_pending));
+            if(vfs->free_pending == NULL)
+            {
+                ERR("Unable to allocate memory for the freed pages.\r\n\t"
+                    "Exiting.");
+                exit(EXIT_FAILURE);
+            }
+        }
+        vfs->free_pending[vfs->free_pending_count++] = page_number;
+    }
+    else
+    {
+        vfs_free_map_set(vfs, page_number, marking_as_used);
+    }
+    pthread_mutex_unlock(&vfs->alloc_lock);
+    if(!marking_as_used)
+        VFS_STATS_ADD(vfs, pages_freed, 1);
+}
 
-    fseek_w(vfs->vdisk, byte_offset, SEEK_SET);
+struct inode vfs_get_inode_page(vfs_t vfs, uint32_t page_number, uint32_t page_index)
+{
+    struct inode inode;
+    // TODO check page_number and page_index is in proper range
+    vfs_page_read(vfs, page_number, page_index * sizeof(inode), &inode, sizeof(inode));
+    return inode;
+}
 
-    fwrite_w(&byte, 1, 1, vfs->vdisk);
+/*
+ * This function adds inodes to pages. Assumes the page is allocated.
+ */
+void vfs_add_inode_page(vfs_t vfs, inode_t inode, uint32_t page_number, uint32_t page_index)
+{
+    // TODO check page_number and page_index is in proper range
+    vfs_page_write(vfs, page_number, page_index * sizeof(*inode), inode, sizeof(*inode));
 }
 
 /*
- * @brief Writes the contents of the buffer to page page_number
+ * The dense index holds the page number of every page of inodes, one entry
+ * for each inodes_per_page inodes, in the dense index pages. It is kept in
+ * vfs->dense_index, each page of it read the first time it is needed.
+ * Changes are written through to the page cache.
+ */
+static void vfs_dense_index_alloc(vfs_t vfs)
+{
+    vfs->dense_index_entries = vfs->dense_index_pages * vfs->page_size / sizeof(uint32_t);
+    vfs->dense_index = (uint32_t *) calloc(vfs->dense_index_entries, sizeof(uint32_t));
+    vfs->dense_index_loaded = (bool *) calloc(vfs->dense_index_pages, sizeof(bool));
+}
 
-void vfs_page_write(vfs_t vfs, uint16_t page_number, int8_t * buffer, int16_t buffer_size)
+static void vfs_dense_index_require(vfs_t vfs, uint32_t entry)
 {
-    // Buffer size checking.
-    if(buffer_size > VFS_PAGE_SIZE)
+    if(vfs->dense_index == NULL)
+        vfs_dense_index_alloc(vfs);
+
+    uint32_t page = entry * sizeof(uint32_t) / vfs->page_size;
+    if(entry < vfs->dense_index_entries && !vfs->dense_index_loaded[page])
     {
-        ERR("Attempting to write more than 1 page worth at a time.\r\n\t"
-            "Writing just one page.");
-        buffer_size = 512;
+        uint32_t entries_per_page = vfs->page_size / sizeof(uint32_t);
+        vfs_page_read(vfs, vfs->dense_index_start + page, 0, vfs->dense_index + page * entries_per_page, vfs->page_size);
+        vfs->dense_index_loaded[page] = true;
     }
+}
 
-    if(fseek(vfs->vdisk, page_number * VFS_PAGE_SIZE, SEEK_SET) != 0)
+static uint32_t vfs_dense_index_read(vfs_t vfs, uint32_t inode_number)
+{
+    vfs_dense_index_require(vfs, inode_number / vfs->inodes_per_page);
+    if(inode_number / vfs->inodes_per_page >= vfs->dense_index_entries)
     {
-        ERR("fseek() result doesn't match requested.\r\n\t"
+        ERR("Inode number outside of the dense index.\r\n\t"
             "Exiting.");
         exit(EXIT_FAILURE);
     }
-    if(fwrite(buffer, sizeof(*buffer), buffer_size, vfs->vdisk) != buffer_size)
+    return vfs->dense_index[inode_number / vfs->inodes_per_page];
+}
+
+static void vfs_dense_index_write(vfs_t vfs, uint32_t inode_number, uint32_t page_number)
+{
+    vfs_dense_index_require(vfs, inode_number / vfs->inodes_per_page);
+    if(inode_number / vfs->inodes_per_page >= vfs->dense_index_entries)
     {
-        ERR("fwrite() result doesn't match requested.\r\n\t"
+        ERR("Out of room in the dense index for more inodes.\r\n\t"
             "Exiting.");
         exit(EXIT_FAILURE);
     }
+    vfs->dense_index[inode_number / vfs->inodes_per_page] = page_number;
+
+    uint32_t offset = (inode_number / vfs->inodes_per_page) * sizeof(uint32_t);
+    vfs_page_write(vfs, vfs->dense_index_start + offset / vfs->page_size, offset % vfs->page_size,
+                   &page_number, sizeof(page_number));
 }
- */
 
-struct inode vfs_get_inode_page(vfs_t vfs, uint16_t page_number, uint16_t page_index)
+/*
+ * @brief: returns the inode table entry for inode_number, creating an empty
+ *         one if it is not loaded yet.
+ */
+static struct inode_entry * vfs_inode_entry(vfs_t vfs, uint32_t inode_number, bool * created)
 {
-    struct inode inode;
-    // TODO check page_number and page_index is in proper range
-    fseek_w(vfs->vdisk, page_number * VFS_PAGE_SIZE + page_index * 32, SEEK_SET);
+    if(inode_number >= vfs->inode_table_size)
+    {
+        uint32_t size = (vfs->inode_table_size < 64) ? 64 : vfs->inode_table_size;
+        while(size <= inode_number)
+            size *= 2;
+        vfs->inode_table = (struct inode_entry **) realloc(vfs->inode_table, size * sizeof(*vfs->inode_table));
+        memset(vfs->inode_table + vfs->inode_table_size, 0, (size - vfs->inode_table_size) * sizeof(*vfs->inode_table));
+        vfs->inode_table_size = size;
+    }
 
-    fread_w(&inode, sizeof(inode), 1, vfs->vdisk);
-    return inode;
+    *created = false;
+    if(vfs->inode_table[inode_number] == NULL)
+    {
+        vfs->inode_table[inode_number] = (struct inode_entry *) calloc(1, sizeof(struct inode_entry));
+        pthread_rwlock_init(&vfs->inode_table[inode_number]->lock, NULL);
+        *created = true;
+    }
+    return vfs->inode_table[inode_number];
 }
 
 /*
- * This function adds inodes to pages. Assumes the page is allocated.
+ * @brief: writes every dirty inode in the inode table to its inode page.
+ *
+ * @param vfs: file system which the operation executes on.
  */
-void vfs_add_inode_page(vfs_t vfs, inode_t inode, uint16_t page_number, uint16_t page_index)
+void vfs_inode_sync(vfs_t vfs)
 {
-    // TODO check page_number and page_index is in proper range
-    fseek_w(vfs->vdisk, page_number * VFS_PAGE_SIZE + page_index * 32, SEEK_SET);
-    fwrite_w(inode, sizeof(*inode), 1, vfs->vdisk);
-}
+    // Collect the dirty inodes first, an inode's lock must not be taken while
+    // inode_lock is held. An inode changed after this is marked dirty again.
+    pthread_mutex_lock(&vfs->inode_lock);
+    struct inode_entry ** dirty = (struct inode_entry **) malloc((vfs->inode_table_size + 1) * sizeof(*dirty));
+    uint32_t * dirty_numbers = (uint32_t *) malloc((vfs->inode_table_size + 1) * sizeof(*dirty_numbers));
+    uint32_t dirty_count = 0;
 
+    uint32_t inode_number = 0;
+    for(inode_number = 0; inode_number < vfs->inode_table_size; ++inode_number)
+    {
+        struct inode_entry * entry = vfs->inode_table[inode_number];
+        if(entry == NULL || !entry->dirty)
+            continue;
+
+        entry->dirty = false;
+        dirty[dirty_count] = entry;
+        dirty_numbers[dirty_count++] = inode_number;
+    }
+    __atomic_store_n(&vfs->dirty_inodes, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&vfs->inode_lock);
+
+    uint32_t i = 0;
+    for(i = 0; i < dirty_count; ++i)
+    {
+        struct inode copy;
+        pthread_rwlock_rdlock(&dirty[i]->lock);
+        copy = dirty[i]->inode;
+        pthread_rwlock_unlock(&dirty[i]->lock);
+
+        pthread_mutex_lock(&vfs->inode_lock);
+        vfs_add_inode_page(vfs, &copy, vfs_dense_index_read(vfs, dirty_numbers[i]), dirty_numbers[i] % vfs->inodes_per_page);
+        pthread_mutex_unlock(&vfs->inode_lock);
+    }
+    VFS_STATS_ADD(vfs, inode_writes, dirty_count);
+
+    free(dirty);
+    free(dirty_numbers);
+}
 
 /*
  * @brief: this function allocates a new page, returns page number
@@ -141,67 +554,263 @@ void vfs_add_inode_page(vfs_t vfs, inode_t inode, uint16_t page_number, uint16_t
  * @param vfs: virtual file system of which to allocate a new page on.
  * @return: page number allocated.
  */
-uint16_t vfs_allocate_new_page(vfs_t vfs)
+uint32_t vfs_allocate_new_page(vfs_t vfs)
 {
-    uint8_t fbv_contents[VFS_PAGE_SIZE];
-    fseek_w(vfs->vdisk, VFS_FREE_BLOCK_VECTOR_PAGE_OFFSET, SEEK_SET);
-    fread_w(fbv_contents, sizeof(*fbv_contents), sizeof(fbv_contents), vfs->vdisk);
+    pthread_mutex_lock(&vfs->alloc_lock);
+    vfs_free_map_require(vfs);
 
-    // Iterate through the bytes in the free block vector
-    int first_free_blocks = 0;
-    for(first_free_blocks = 0; first_free_blocks < VFS_PAGE_SIZE; ++first_free_blocks)
+    // Every word before the hint is known to be full.
+    uint32_t word = 0;
+    for(word = vfs->free_map_hint; word < vfs->free_map_words; ++word)
     {
-        if (fbv_contents[first_free_blocks] != 0)
+        if(vfs->free_map[word] != 0)
             break;
     }
-    // Find where the free block is.
-    uint8_t bit_offset = 0;
-    for(bit_offset = 0; bit_offset < 8; ++bit_offset)
+    vfs->free_map_hint = word;
+
+    if(word == vfs->free_map_words)
     {
-        if((fbv_contents[first_free_blocks] & 0b10000000u >> bit_offset) != 0)
-            break;
+        ERR("No free pages left on disk.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
     }
 
-    uint16_t allocated_page_index = first_free_blocks * 8 + bit_offset;
+    uint32_t allocated_page_index = word * 64 + __builtin_ctzll(vfs->free_map[word]);
 
     // mark page as taken
-    vfs_page_free_mark(vfs, allocated_page_index);
-
-    // populate page with zeros
-    fseek_w(vfs->vdisk, allocated_page_index * VFS_PAGE_SIZE, SEEK_SET);
-    uint8_t zeros[VFS_PAGE_SIZE] = {};
-    fwrite_w(zeros, sizeof(*zeros), sizeof(zeros), vfs->vdisk);
+    vfs_free_map_set(vfs, allocated_page_index, true);
+    if(allocated_page_index >= vfs->pages)
+        vfs->pages = allocated_page_index + 1;
+    pthread_mutex_unlock(&vfs->alloc_lock);
+    VFS_STATS_ADD(vfs, pages_allocated, 1);
 
+    // populate page with zeros, written back with the rest of the cache.
+    vfs_page_put(vfs, vfs_page_get_zeroed(vfs, allocated_page_index), true);
 
     return allocated_page_index;
 }
 
-void vfs_update_inode(vfs_t vfs, inode_t inode, uint16_t inode_number)
+/*
+ * @brief: finds the first run of free pages starting at or after page_number.
+ *
+ * @param vfs: file system which the operation executes on.
+ * @param page_number: page to start searching from.
+ * @param run_length: set to the number of free pages in the run.
+ * @return: first page of the run, or the page count if no free page is left.
+ */
+static uint32_t vfs_free_map_next_run(vfs_t vfs, uint32_t page_number, uint32_t * run_length)
+{
+    uint32_t page_total = vfs->free_map_words * 64;
+    *run_length = 0;
+    if(page_number >= page_total)
+        return page_total;
+
+    // Find the next set bit, the start of the run.
+    uint32_t word = page_number / 64;
+    uint64_t bits = vfs->free_map[word] & (~0ull << page_number % 64);
+    while(bits == 0)
+    {
+        if(++word == vfs->free_map_words)
+            return page_total;
+        bits = vfs->free_map[word];
+    }
+    uint32_t run_start = word * 64 + __builtin_ctzll(bits);
+
+    // Find the next clear bit, the end of the run.
+    bits = ~vfs->free_map[word] & (~0ull << run_start % 64);
+    while(bits == 0)
+    {
+        if(++word == vfs->free_map_words)
+            break;
+        bits = ~vfs->free_map[word];
+    }
+    uint32_t run_end = (word == vfs->free_map_words) ? page_total : word * 64 + __builtin_ctzll(bits);
+
+    *run_length = run_end - run_start;
+    return run_start;
+}
+
+/*
+ * @brief: this function allocates a run of contiguous pages, first fit.
+ *
+ * If no run of count pages is free the longest free run is allocated instead,
+ * callers that need more pages call again for the rest. Unlike
+ * vfs_allocate_new_page() the pages are not zeroed, the caller is expected to
+ * write all of them.
+ *
+ * @param vfs: virtual file system of which to allocate the pages on.
+ * @param count: number of pages wanted.
+ * @param allocated: set to the number of pages allocated, at most count.
+ * @return: first page number of the run.
+ */
+uint32_t vfs_allocate_pages(vfs_t vfs, uint32_t count, uint32_t * allocated)
+{
+    pthread_mutex_lock(&vfs->alloc_lock);
+    vfs_free_map_require(vfs);
+
+    uint32_t best_start = 0;
+    uint32_t best_length = 0;
+
+    uint32_t run_length = 0;
+    uint32_t run_start = vfs_free_map_next_run(vfs, vfs->free_map_hint * 64, &run_length);
+    if(run_length != 0)
+        vfs->free_map_hint = run_start / 64;
+
+    while(run_length != 0)
+    {
+        if(run_length > best_length)
+        {
+            best_start = run_start;
+            best_length = run_length;
+        }
+        if(run_length >= count)
+            break;
+        run_start = vfs_free_map_next_run(vfs, run_start + run_length, &run_length);
+    }
+
+    if(best_length == 0)
+    {
+        ERR("No free pages left on disk.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    *allocated = (best_length < count) ? best_length : count;
+
+    uint32_t page = 0;
+    for(page = best_start; page < best_start + *allocated; ++page)
+        vfs_free_map_set(vfs, page, true);
+    if(best_start + *allocated > vfs->pages)
+        vfs->pages = best_start + *allocated;
+    pthread_mutex_unlock(&vfs->alloc_lock);
+    VFS_STATS_ADD(vfs, pages_allocated, *allocated);
+
+    return best_start;
+}
+
+/*
+ * @brief: marks every data page below pages as used and every page from
+ *         pages up to the high-water mark as free, and lowers the mark to
+ *         pages. For after the data region has been compacted. The free
+ *         block vector is changed and committed a piece at a time, so each
+ *         commit fits in the journal.
+ */
+void vfs_free_map_compact(vfs_t vfs, uint32_t pages)
 {
-    // TODO this so it doesn't read initial inode data everytime.
+    pthread_mutex_lock(&vfs->alloc_lock);
+    vfs_free_map_require(vfs);
+    uint32_t high_water = vfs->pages;
+    pthread_mutex_unlock(&vfs->alloc_lock);
 
-    // Lookup dense index for page.
-    fseek_w(vfs->vdisk, VFS_RESERVED_PAGES_START_OFFSET + (inode_number / 16) * 2, SEEK_SET);
-    uint16_t page_number = 0;
-    fread_w(&page_number, sizeof(page_number), 1, vfs->vdisk);
+    uint32_t piece_pages = high_water;
+    if(vfs_journal_active(vfs))
+        piece_pages = vfs_journal_max_pages(vfs) / 2 * vfs->page_size * 8;
 
-    vfs_add_inode_page(vfs, inode, page_number, inode_number % 16);
+    uint32_t piece_start = vfs->data_start;
+    while(piece_start < high_water)
+    {
+        uint32_t piece_end = (high_water - piece_start < piece_pages) ? high_water : piece_start + piece_pages;
+        pthread_mutex_lock(&vfs->alloc_lock);
+        uint32_t page = 0;
+        for(page = piece_start; page < piece_end; ++page)
+        {
+            bool page_free = (vfs->free_map[page / 64] & (1ull << page % 64)) != 0;
+            if(page_free == (page < pages))
+                vfs_free_map_set(vfs, page, page < pages);
+        }
+        pthread_mutex_unlock(&vfs->alloc_lock);
+        vfs_sync(vfs);
+        piece_start = piece_end;
+    }
+
+    pthread_mutex_lock(&vfs->alloc_lock);
+    if(pages < vfs->pages)
+        vfs->pages = pages;
+    pthread_mutex_unlock(&vfs->alloc_lock);
 }
 
+/*
+ * @brief: marks an inode as modified. The inode is written to its inode page
+ *         by vfs_sync().
+ *
+ * @param inode: inode returned by vfs_get_inode(), or a copy whose contents
+ *               replace the shared inode.
+ */
+void vfs_update_inode(vfs_t vfs, inode_t inode, uint16_t inode_number)
+{
+    pthread_mutex_lock(&vfs->inode_lock);
+    bool created = false;
+    struct inode_entry * entry = vfs_inode_entry(vfs, inode_number, &created);
+    if(&entry->inode != inode)
+        entry->inode = *inode;
+    if(!entry->dirty)
+        __atomic_fetch_add(&vfs->dirty_inodes, 1, __ATOMIC_RELAXED);
+    entry->dirty = true;
+    pthread_mutex_unlock(&vfs->inode_lock);
+}
+
+/*
+ * @brief: returns the shared in memory copy of an inode, reading it from its
+ *         inode page the first time. Release it with vfs_put_inode().
+ */
 inode_t vfs_get_inode(vfs_t vfs, int16_t inode_number)
 {
-    inode_t inode = (inode_t) malloc(sizeof(struct inode));
+    pthread_mutex_lock(&vfs->inode_lock);
+    bool created = false;
+    struct inode_entry * entry = vfs_inode_entry(vfs, (uint16_t) inode_number, &created);
 
-    // query dense index.
-    fseek_w(vfs->vdisk, VFS_RESERVED_PAGES_START_OFFSET + (inode_number / 16) * 2, SEEK_SET);
-    uint16_t page_number = 0;
-    fread_w(&page_number, sizeof(page_number), 1, vfs->vdisk);
+    if(created)
+    {
+        // query dense index.
+        uint32_t page_number = vfs_dense_index_read(vfs, (uint16_t) inode_number);
 
-    // visit page pointed to by dense index
-    // go to inode offset on page
-    *inode = vfs_get_inode_page(vfs, page_number, inode_number % 16);
+        // visit page pointed to by dense index
+        // go to inode offset on page
+        entry->inode = vfs_get_inode_page(vfs, page_number, (uint16_t) inode_number % vfs->inodes_per_page);
+        VFS_STATS_ADD(vfs, inode_reads, 1);
+    }
 
-    return inode;
+    entry->references++;
+    pthread_mutex_unlock(&vfs->inode_lock);
+    return &entry->inode;
+}
+
+/*
+ * @brief: releases an inode returned by vfs_get_inode(). The inode stays in
+ *         the inode table so the next vfs_get_inode() costs no I/O.
+ */
+void vfs_put_inode(vfs_t vfs, inode_t inode)
+{
+    struct inode_entry * entry = (struct inode_entry *) inode;
+    pthread_mutex_lock(&vfs->inode_lock);
+    if(entry->references == 0)
+    {
+        pthread_mutex_unlock(&vfs->inode_lock);
+        ERR("Releasing an inode that is not referenced.");
+        return;
+    }
+    entry->references--;
+    pthread_mutex_unlock(&vfs->inode_lock);
+}
+
+/*
+ * @brief: per inode reader-writer lock, shared for reading a file or
+ *         directory and exclusive for changing it. Take it before any other
+ *         vfs lock.
+ */
+void vfs_inode_read_lock(inode_t inode)
+{
+    pthread_rwlock_rdlock(&((struct inode_entry *) inode)->lock);
+}
+
+void vfs_inode_write_lock(inode_t inode)
+{
+    pthread_rwlock_wrlock(&((struct inode_entry *) inode)->lock);
+}
+
+void vfs_inode_unlock(inode_t inode)
+{
+    pthread_rwlock_unlock(&((struct inode_entry *) inode)->lock);
 }
 
 uint16_t vfs_new_inode(vfs_t vfs, int32_t flags)
@@ -211,93 +820,553 @@ uint16_t vfs_new_inode(vfs_t vfs, int32_t flags)
             .file_flags = flags,
             .d_pages = {},
             .si_page = 0,
-            .di_page = 0
+            .di_page = 0,
+            .reserved = {}
     };
 
+    pthread_mutex_lock(&vfs->inode_lock);
+    if(vfs->inodes >= VFS_MAX_INODES)
+    {
+        ERR("No inode numbers left.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
     // Adding new page or adding to exisiting page?
-    uint16_t page_index = vfs->inodes % 16;
-    int page_number = 0;
+    uint32_t page_index = vfs->inodes % vfs->inodes_per_page;
+    uint32_t page_number = 0;
     if(page_index == 0)
     {
         // Allocate new page for holding inodes.
         page_number = vfs_allocate_new_page(vfs);
 
         // Add dense index to page.
-        fseek_w(vfs->vdisk, VFS_RESERVED_PAGES_START_OFFSET + (vfs->inodes / 16) * 2, SEEK_SET);
-        fwrite_w(&page_number, sizeof(page_number), 1, vfs->vdisk);
+        vfs_dense_index_write(vfs, vfs->inodes, page_number);
     }
     else {
         // Lookup dense index for page.
-        fseek_w(vfs->vdisk, VFS_RESERVED_PAGES_START_OFFSET + (vfs->inodes / 16) * 2, SEEK_SET);
-
-        fread_w(&page_number, sizeof(page_number), 1, vfs->vdisk);
+        page_number = vfs_dense_index_read(vfs, vfs->inodes);
     }
 
     vfs_add_inode_page(vfs, &new_inode, page_number, page_index);
 
+    bool created = false;
+    struct inode_entry * entry = vfs_inode_entry(vfs, vfs->inodes, &created);
+    entry->inode = new_inode;
+    entry->dirty = false;
 
-    return vfs->inodes++;
+    uint16_t inode_number = vfs->inodes++;
+    pthread_mutex_unlock(&vfs->inode_lock);
+    return inode_number;
 }
 
-void vfs_create(vfs_t vfs)
+/*
+ * @brief: returns the page of inodes holding inode_number.
+ */
+uint32_t vfs_inode_page(vfs_t vfs, uint16_t inode_number)
 {
-    strcpy(vfs->magic_number, "vfs");
-    vfs->pages = VFS_TOTAL_RESERVED_BLOCK_COUNT;
-    vfs->inodes = 0;
+    pthread_mutex_lock(&vfs->inode_lock);
+    uint32_t page_number = vfs_dense_index_read(vfs, inode_number);
+    pthread_mutex_unlock(&vfs->inode_lock);
+    return page_number;
+}
 
-    // Create & write super block
+/*
+ * @brief: records that the page of inodes holding inode_number is now
+ *         page_number. The caller has already copied it there.
+ */
+void vfs_inode_page_move(vfs_t vfs, uint16_t inode_number, uint32_t page_number)
+{
+    pthread_mutex_lock(&vfs->inode_lock);
+    vfs_dense_index_write(vfs, inode_number, page_number);
+    pthread_mutex_unlock(&vfs->inode_lock);
+}
+
+/*
+ * @brief: number of pages vfs_new_inodes() needs for count inodes, beyond
+ *         the room left in the last page of inodes.
+ */
+uint32_t vfs_new_inodes_pages(vfs_t vfs, uint32_t count)
+{
+    pthread_mutex_lock(&vfs->inode_lock);
+    uint32_t used = vfs->inodes % vfs->inodes_per_page;
+    pthread_mutex_unlock(&vfs->inode_lock);
+
+    uint32_t room = (used == 0) ? 0 : vfs->inodes_per_page - used;
+    if(count <= room)
+        return 0;
+    return (count - room + vfs->inodes_per_page - 1) / vfs->inodes_per_page;
+}
+
+/*
+ * @brief: adds count inodes at once, numbered on from the last inode. Those
+ *         that fit in the last page of inodes go there, the rest fill the
+ *         vfs_new_inodes_pages() pages from first_page, which the caller has
+ *         allocated, in a single write.
+ *
+ * @param inodes: contents of the new inodes.
+ * @return: inode number of the first new inode.
+ */
+uint16_t vfs_new_inodes(vfs_t vfs, const struct inode * inodes, uint32_t count, uint32_t first_page)
+{
+    pthread_mutex_lock(&vfs->inode_lock);
+    if(vfs->inodes + count > VFS_MAX_INODES)
+    {
+        ERR("No inode numbers left.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    uint16_t first_inode = (uint16_t) vfs->inodes;
+    uint32_t i = 0;
+    for(i = 0; i < count && vfs->inodes % vfs->inodes_per_page != 0; ++i, ++vfs->inodes)
+        vfs_add_inode_page(vfs, (inode_t) &inodes[i], vfs_dense_index_read(vfs, vfs->inodes), vfs->inodes % vfs->inodes_per_page);
+
+    if(i < count)
+    {
+        uint32_t page_count = (count - i + vfs->inodes_per_page - 1) / vfs->inodes_per_page;
+        uint8_t * pages = (uint8_t *) calloc(page_count, vfs->page_size);
+        memcpy(pages, &inodes[i], (count - i) * sizeof(*inodes));
+        vfs_pages_write(vfs, first_page, page_count, pages);
+        free(pages);
+
+        uint32_t page = 0;
+        for(page = 0; page < page_count; ++page)
+            vfs_dense_index_write(vfs, vfs->inodes + page * vfs->inodes_per_page, first_page + page);
+        vfs->inodes += count - i;
+    }
+    pthread_mutex_unlock(&vfs->inode_lock);
+    return first_inode;
+}
+
+/*
+ * @brief: works out where the metadata regions of a new image go from its
+ *         page size and capacity.
+ *
+ * @param vfs: file system with page_size and capacity set. The capacity is
+ *             rounded up to a whole number of free block vector pages.
+ */
+static void vfs_format_layout(vfs_t vfs)
+{
+    if(vfs->page_size < VFS_MIN_PAGE_SIZE || vfs->page_size > VFS_MAX_PAGE_SIZE
+       || (vfs->page_size & (vfs->page_size - 1)) != 0)
+    {
+        ERR("Page size must be a power of two from 512 bytes to 64 KB.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    if(vfs->capacity == 0 || vfs->capacity > VFS_MAX_CAPACITY)
+    {
+        ERR("Disk capacity out of range.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t pages_per_fbv_page = vfs->page_size * 8;
+    vfs->free_vector_start = VFS_SUPER_BLOCK_PAGE + 1;
+    vfs->free_vector_pages = (vfs->capacity + pages_per_fbv_page - 1) / pages_per_fbv_page;
+    vfs->capacity = vfs->free_vector_pages * pages_per_fbv_page;
+
+    vfs->inodes_per_page = vfs->page_size / sizeof(struct inode);
+    uint32_t inode_pages = VFS_MAX_INODES / vfs->inodes_per_page;
+    vfs->dense_index_start = vfs->free_vector_start + vfs->free_vector_pages;
+    vfs->dense_index_pages = (inode_pages * sizeof(uint32_t) + vfs->page_size - 1) / vfs->page_size;
+
+    // The journal is split in two equal halves.
+    if(vfs->journal_pages != 0 && (vfs->journal_pages < VFS_JOURNAL_MIN_PAGES || vfs->journal_pages % 2 != 0))
+    {
+        ERR("Journal size must be an even number of at least 64 pages.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    vfs->journal_start = vfs->dense_index_start + vfs->dense_index_pages;
+
+    vfs->data_start = vfs->journal_start + vfs->journal_pages;
+    if(vfs->data_start >= vfs->capacity)
+    {
+        ERR("Disk capacity is too small for its metadata.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void vfs_super_block_write(vfs_t vfs)
+{
+    pthread_mutex_lock(&vfs->alloc_lock);
+    uint32_t pages = vfs->pages;
+    pthread_mutex_unlock(&vfs->alloc_lock);
+    pthread_mutex_lock(&vfs->inode_lock);
+    uint32_t inodes = vfs->inodes;
+    pthread_mutex_unlock(&vfs->inode_lock);
+
+    struct vfs_super_block super_block = {
+            .pages = pages,
+            .inodes = inodes,
+            .version = vfs->version,
+            .page_size = vfs->page_size,
+            .capacity = vfs->capacity,
+            .free_vector_start = vfs->free_vector_start,
+            .free_vector_pages = vfs->free_vector_pages,
+            .dense_index_start = vfs->dense_index_start,
+            .dense_index_pages = vfs->dense_index_pages,
+            .data_start = vfs->data_start,
+            .state = vfs->state,
+            .journal_start = vfs->journal_start,
+            .journal_pages = vfs->journal_pages,
+            .journal_sequence = vfs->journal.sequence
+    };
+    memcpy(super_block.magic_number, vfs->magic_number, sizeof(super_block.magic_number));
+
+    vfs_page_write(vfs, VFS_SUPER_BLOCK_PAGE, 0, &super_block, sizeof(super_block));
+}
+
+/*
+ * @brief: reads and checks the super block of an existing image straight
+ *         from the file, before the page cache or mapping is set up, since
+ *         those depend on the page size it records.
+ */
+static void vfs_super_block_read(vfs_t vfs)
+{
+    struct vfs_super_block super_block;
+    if(pread(vfs->fd, &super_block, sizeof(super_block), 0) != sizeof(super_block)
+       || memcmp(super_block.magic_number, "vfs", sizeof("vfs")) != 0)
+    {
+        ERR("Disk image has no valid super block.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    if(super_block.version != VFS_FORMAT_VERSION)
+    {
+        ERR("Disk image format version is not supported.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(vfs->magic_number, super_block.magic_number, sizeof(vfs->magic_number));
+    vfs->version = super_block.version;
+    vfs->pages = super_block.pages;
+    vfs->inodes = super_block.inodes;
+    vfs->state = super_block.state;
+    vfs->page_size = super_block.page_size;
+    vfs->capacity = super_block.capacity;
+    vfs->journal_pages = super_block.journal_pages;
+    vfs->journal.sequence = super_block.journal_sequence;
+
+    // The layout follows from the page size and capacity, anything else
+    // means the super block is damaged.
+    vfs_format_layout(vfs);
+    if(vfs->capacity != super_block.capacity
+       || vfs->free_vector_start != super_block.free_vector_start
+       || vfs->free_vector_pages != super_block.free_vector_pages
+       || vfs->dense_index_start != super_block.dense_index_start
+       || vfs->dense_index_pages != super_block.dense_index_pages
+       || vfs->journal_start != super_block.journal_start
+       || vfs->data_start != super_block.data_start
+       || vfs->pages > vfs->capacity || vfs->inodes > VFS_MAX_INODES)
+    {
+        ERR("Disk image super block is corrupt.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * @brief: writes the super block and makes sure it reached the image.
+ */
+static void vfs_super_block_flush(vfs_t vfs)
+{
+    vfs_super_block_write(vfs);
+    if(vfs->map != NULL)
     {
-        struct page super_block;
-        memset(&super_block.bytes[0], 0x00, sizeof(super_block));
-        memcpy(&super_block.bytes[0], &vfs->magic_number, sizeof("vfs"));
-        memcpy(&super_block.bytes[4], &vfs->pages, sizeof(vfs->pages));
-        memcpy(&super_block.bytes[8], &vfs->inodes, sizeof(vfs->inodes));
-        fwrite(&super_block, sizeof(super_block), 1, vfs->vdisk);
+        msync(vfs->map, vfs->page_size, MS_SYNC);
+        return;
     }
+    vfs_cache_flush(vfs);
+}
+
+/*
+ * @brief: fills count pages from start with the byte fill, writing them
+ *         straight to the image a chunk at a time instead of through the
+ *         page cache.
+ */
+static void vfs_format_pages(vfs_t vfs, uint32_t start, uint32_t count, uint8_t fill)
+{
+    uint32_t chunk_pages = 64;
+    uint8_t * chunk = (uint8_t *) malloc((size_t) chunk_pages * vfs->page_size);
+    memset(chunk, fill, (size_t) chunk_pages * vfs->page_size);
 
-    // Create & write free block
+    while(count != 0)
     {
-        struct page free_block;
-        memset(&free_block, 0b11111111, sizeof(free_block));
-        memset(&free_block, 0b00111111, 2);
-        memset(&free_block, 0b00000000, 1);
-        fwrite(&free_block, sizeof(free_block), 1, vfs->vdisk);
+        uint32_t pages = (count < chunk_pages) ? count : chunk_pages;
+        vfs_pages_write(vfs, start, pages, chunk);
+        start += pages;
+        count -= pages;
     }
+    free(chunk);
+}
+
+void vfs_create(vfs_t vfs)
+{
+    strcpy(vfs->magic_number, "vfs");
+    vfs->version = VFS_FORMAT_VERSION;
+    vfs->inodes = 0;
+    vfs->state = VFS_STATE_DIRTY;
+    vfs_format_layout(vfs);
+    vfs->pages = vfs->data_start;
 
-    // Create reserved blocks
+    // Create & write super block
+    vfs_page_put(vfs, vfs_page_get_zeroed(vfs, VFS_SUPER_BLOCK_PAGE), true);
+    vfs_super_block_write(vfs);
+
+    // Create & write free block vector, every page starts out free.
+    vfs_format_pages(vfs, vfs->free_vector_start, vfs->free_vector_pages, 0b11111111);
+    vfs_free_map_alloc(vfs);
+    memset(vfs->free_map, 0xFF, vfs->free_map_words * sizeof(*vfs->free_map));
+    vfs->free_map_hint = 0;
+
+    // Create dense index
+    vfs_format_pages(vfs, vfs->dense_index_start, vfs->dense_index_pages, 0);
+    vfs_dense_index_alloc(vfs);
+    memset(vfs->dense_index_loaded, true, vfs->dense_index_pages * sizeof(bool));
+
+    // An empty journal, neither half holds a transaction.
+    vfs_format_pages(vfs, vfs->journal_start, vfs->journal_pages, 0);
+
+    // The metadata pages are in use.
     {
-        struct page reserved_blocks[8];
-        memset(&reserved_blocks, 0, sizeof(reserved_blocks));
-        fwrite(&reserved_blocks, sizeof(*reserved_blocks), sizeof(reserved_blocks)/sizeof(*reserved_blocks), vfs->vdisk);
+        uint32_t page = 0;
+        for(page = 0; page < vfs->data_start; ++page)
+            vfs_page_free_mark(vfs, page);
     }
 
     vfs_new_inode(vfs, VFS_NEW_DIRECTORY_FLAGS);
 }
 
 vfs_t vfs_open(const char * vdisk)
+{
+    return vfs_open_with(vdisk, NULL);
+}
+
+/*
+ * @brief: mounts an existing image. Only the super block is read here, the
+ *         free block vector, dense index and inodes are read when first used.
+ */
+static void vfs_mount(vfs_t vfs)
+{
+    vfs->was_dirty = (vfs->state != VFS_STATE_CLEAN);
+    vfs->state = VFS_STATE_DIRTY;
+}
+
+vfs_t vfs_open_with(const char * vdisk, const struct vfs_options * options)
 {
     vfs_t new_vfs = (vfs_t) malloc(sizeof(struct vfs));
 
-    new_vfs->vdisk = fopen(vdisk, "rb+");
+    new_vfs->fd = open(vdisk, O_RDWR);
     new_vfs->pages = 0;
     new_vfs->inodes = 0;
+    new_vfs->state = VFS_STATE_CLEAN;
+    new_vfs->was_dirty = false;
+    new_vfs->free_map = NULL;
+    new_vfs->free_map_dirty = NULL;
+    new_vfs->free_map_words = 0;
+    new_vfs->free_map_hint = 0;
+    new_vfs->free_pending = NULL;
+    new_vfs->free_pending_count = 0;
+    new_vfs->free_pending_size = 0;
+    new_vfs->dense_index = NULL;
+    new_vfs->dense_index_entries = 0;
+    new_vfs->dense_index_loaded = NULL;
+    new_vfs->inode_table = NULL;
+    new_vfs->inode_table_size = 0;
+    new_vfs->dirty_inodes = 0;
 
-    // Check if file exists new_vfs->vdisk
-    if(true) // TODO when done remove this.
+    new_vfs->map = NULL;
+    new_vfs->map_size = 0;
+    new_vfs->map_reserved = 0;
+    pthread_mutex_init(&new_vfs->alloc_lock, NULL);
+    pthread_mutex_init(&new_vfs->inode_lock, NULL);
+    pthread_mutex_init(&new_vfs->map_lock, NULL);
+    memset(&new_vfs->cache, 0, sizeof(new_vfs->cache));
+    vfs_stats_init(new_vfs);
+    // Tracing starts once the image is open, see vfs_trace_init().
+    new_vfs->trace.records = NULL;
+    vfs_dentry_init(new_vfs, VFS_DENTRY_CACHE_ENTRIES);
+    vfs_aio_init(new_vfs, options != NULL && options->aio_threads);
+    vfs_journal_init(new_vfs);
+    new_vfs->readahead_pages = (options != NULL && options->readahead_pages != 0) ? options->readahead_pages : VFS_READAHEAD_DEFAULT_PAGES;
+    new_vfs->write_buffer_size = (options != NULL && options->write_buffer_size != 0) ? options->write_buffer_size : VFS_WRITE_BUFFER_DEFAULT_SIZE;
+
+    // An image that does not exist yet, or is empty, is created.
+    bool exists = false;
+    struct stat image_stat;
+    if(new_vfs->fd >= 0 && fstat(new_vfs->fd, &image_stat) == 0)
+        exists = image_stat.st_size > 0;
+
+    if(exists)
+    {
+        vfs_super_block_read(new_vfs);
+
+        // Bring back the last committed state before anything else is read,
+        // the super block may be part of it.
+        if(new_vfs->state != VFS_STATE_CLEAN && new_vfs->journal_pages != 0 && vfs_journal_replay(new_vfs))
+        {
+            uint64_t sequence = new_vfs->journal.sequence;
+            vfs_super_block_read(new_vfs);
+            if(new_vfs->journal.sequence < sequence)
+                new_vfs->journal.sequence = sequence;
+            printf("Replayed the journal of disk %s\r\n", vdisk);
+        }
+    }
+    else
     {
         printf("Disk doesn't exist. Creating blank disk %s\r\n", vdisk);
-        new_vfs->vdisk = fopen(vdisk, "wb+");
+        if(new_vfs->fd < 0)
+            new_vfs->fd = open(vdisk, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(new_vfs->fd < 0)
+        {
+            ERR("Unable to create disk image.\r\n\t"
+                "Exiting.");
+            exit(EXIT_FAILURE);
+        }
 
-        vfs_create(new_vfs);
+        new_vfs->version = VFS_FORMAT_VERSION;
+        new_vfs->page_size = (options != NULL && options->page_size != 0) ? options->page_size : VFS_DEFAULT_PAGE_SIZE;
+        new_vfs->capacity = (options != NULL && options->capacity != 0) ? options->capacity : VFS_DEFAULT_CAPACITY;
+        new_vfs->journal_pages = 0;
+        if(options == NULL || !options->no_journal)
+            new_vfs->journal_pages = (options != NULL && options->journal_pages != 0) ? options->journal_pages : VFS_JOURNAL_DEFAULT_PAGES;
+        vfs_format_layout(new_vfs);
     }
 
+    bool use_mmap = (options != NULL && options->mmap);
+    if(use_mmap)
+    {
+        vfs_map_open(new_vfs);
+    }
+    else
+    {
+        uint32_t cache_pages = (options != NULL && options->cache_pages != 0) ? options->cache_pages : VFS_CACHE_DEFAULT_PAGES;
+        // Every dirty page has to fit in one transaction.
+        if(new_vfs->journal_pages != 0 && cache_pages > vfs_journal_max_pages(new_vfs))
+            cache_pages = vfs_journal_max_pages(new_vfs);
+        vfs_cache_init(new_vfs, cache_pages);
+    }
+
+    if(exists)
+        vfs_mount(new_vfs);
+    else
+        vfs_create(new_vfs);
+
+    // The image stays marked dirty on disk until vfs_close().
+    vfs_super_block_flush(new_vfs);
+
+    vfs_trace_init(new_vfs, (options != NULL) ? options->trace_path : NULL);
+
+    if(new_vfs->was_dirty)
+        printf("Disk %s was not closed cleanly.\r\n", vdisk);
     printf("Opened disk %s\r\n", vdisk);
 
     return new_vfs;
 }
 
+/*
+ * @brief: puts the pages freed before the last commit back in the free map.
+ *
+ * @return: true if there were any.
+ */
+static bool vfs_free_pending_release(vfs_t vfs)
+{
+    pthread_mutex_lock(&vfs->alloc_lock);
+    uint32_t count = vfs->free_pending_count;
+    uint32_t i = 0;
+    for(i = 0; i < count; ++i)
+        vfs_free_map_set(vfs, vfs->free_pending[i], false);
+    vfs->free_pending_count = 0;
+    pthread_mutex_unlock(&vfs->alloc_lock);
+    return count != 0;
+}
+
+/*
+ * @brief: writes all state held in memory back to the disk image. With a
+ *         journal this commits a transaction, waiting for the operations in
+ *         progress to finish and holding new ones back until it is done.
+ *
+ * @param vfs: file system which the operation executes on.
+ */
+void vfs_sync(vfs_t vfs)
+{
+    uint8_t origin = vfs_trace_enter(VFS_TRACE_ORIGIN_VFS_SYNC);
+    VFS_TRACE(vfs, VFS_TRACE_SYNC, 0, 0, 0);
+    vfs_trace_flush(vfs);
+
+    bool journaled = vfs_journal_active(vfs);
+    if(journaled)
+        pthread_rwlock_wrlock(&vfs->journal.transaction_lock);
+
+    // File data reaches the disk before the metadata that points to it.
+    vfs_aio_drain(vfs);
+
+    vfs_inode_sync(vfs);
+    vfs_free_map_sync(vfs);
+    vfs_super_block_write(vfs);
+    if(vfs->map != NULL)
+    {
+        msync(vfs->map, vfs->map_size, MS_SYNC);
+    }
+    else if(journaled)
+    {
+        vfs_cache_commit(vfs);
+        // The pages freed are reusable now the frees are on disk, the free
+        // block vector saying so goes in a commit of its own.
+        if(vfs_free_pending_release(vfs))
+        {
+            vfs_free_map_sync(vfs);
+            vfs_cache_commit(vfs);
+        }
+        pthread_rwlock_unlock(&vfs->journal.transaction_lock);
+    }
+    else
+    {
+        vfs_cache_flush(vfs);
+    }
+    vfs_trace_leave(origin);
+}
+
 void vfs_close(vfs_t vfs)
 {
-    fclose(vfs->vdisk);
+    vfs_sync(vfs);
+    vfs_aio_destroy(vfs);
+
+    // Everything else is on disk, only now can the image be marked clean.
+    vfs->state = VFS_STATE_CLEAN;
+    vfs_super_block_flush(vfs);
+    vfs_trace_destroy(vfs);
+    if(vfs->map != NULL)
+        vfs_map_close(vfs);
+    close(vfs->fd);
+
+    vfs_cache_destroy(vfs);
+    vfs_dentry_destroy(vfs);
+    vfs_journal_destroy(vfs);
+    vfs_stats_destroy(vfs);
+
+    uint32_t inode_number = 0;
+    for(inode_number = 0; inode_number < vfs->inode_table_size; ++inode_number)
+    {
+        if(vfs->inode_table[inode_number] == NULL)
+            continue;
+        pthread_rwlock_destroy(&vfs->inode_table[inode_number]->lock);
+        free(vfs->inode_table[inode_number]);
+    }
+    free(vfs->inode_table);
+    free(vfs->dense_index);
+    free(vfs->dense_index_loaded);
+
+    free(vfs->free_map);
+    free(vfs->free_map_dirty);
+    free(vfs->free_pending);
+    pthread_mutex_destroy(&vfs->alloc_lock);
+    pthread_mutex_destroy(&vfs->inode_lock);
+    pthread_mutex_destroy(&vfs->map_lock);
     free(vfs);
 }
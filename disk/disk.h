@@ -2,86 +2,295 @@
 #define DISK_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <pthread.h>
 
-#define VFS_PAGE_SIZE 512
+#include "aio.h"
+#include "cache.h"
+#include "dentry.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
-#define VFS_SUPER_BLOCK_PAGE_COUNT 1
-#define VFS_SUPER_BLOCK_PAGE 0
-#define VFS_SUPER_BLOCK_PAGE_OFFSET (VFS_SUPER_BLOCK_PAGE * VFS_PAGE_SIZE)
+/*
+ * On disk layout, format version 2. Page 0 holds the super block, followed by
+ * the free block vector, the dense index, the journal and then data pages.
+ * The page size and the number of pages the image may grow to are chosen when
+ * the image is created and recorded in the super block, the metadata regions
+ * are sized from them. Images without a journal record 0 journal pages.
+ */
+#define VFS_FORMAT_VERSION 2
+
+#define VFS_MIN_PAGE_SIZE 512
+#define VFS_MAX_PAGE_SIZE 65536
+#define VFS_DEFAULT_PAGE_SIZE 512
 
-#define VFS_FREE_BLOCK_VECTOR_COUNT 1
-#define VFS_FREE_BLOCK_VECTOR_PAGE (VFS_SUPER_BLOCK_PAGE_COUNT)
-#define VFS_FREE_BLOCK_VECTOR_PAGE_OFFSET (VFS_FREE_BLOCK_VECTOR_PAGE * VFS_PAGE_SIZE)
+// Number of pages the free block vector describes, the largest the image grows.
+#define VFS_DEFAULT_CAPACITY (1u << 20)
+#define VFS_MAX_CAPACITY (1u << 31)
 
+// Inode numbers are stored in 16 bits in directory entries.
+#define VFS_MAX_INODES 65536
 
-#define VFS_RESERVED_BLOCK_COUNT 8
-#define VFS_RESERVED_PAGES_START (VFS_SUPER_BLOCK_PAGE_COUNT + VFS_FREE_BLOCK_VECTOR_COUNT)
-#define VFS_RESERVED_PAGES_START_OFFSET (VFS_RESERVED_PAGES_START * VFS_PAGE_SIZE)
-#define VFS_RESERVED_PAGES_END (VFS_RESERVED_PAGES_START + VFS_RESERVED_BLOCK_COUNT - 1)
-#define VFS_RESERVED_PAGES_END_OFFSET (VFS_RESERVED_PAGES_END * VFS_PAGE_SIZE)
+#define VFS_SUPER_BLOCK_PAGE 0
 
-#define VFS_TOTAL_RESERVED_BLOCK_COUNT (VFS_SUPER_BLOCK_PAGE_COUNT  +\
-                                        VFS_FREE_BLOCK_VECTOR_COUNT +\
-                                        VFS_RESERVED_BLOCK_COUNT)
+#define VFS_READAHEAD_DEFAULT_PAGES 64
+#define VFS_WRITE_BUFFER_DEFAULT_SIZE (64 * 1024)
 
-#define VFS_DATA_START_BLOCK (VFS_TOTAL_RESERVED_BLOCK_COUNT)
-#define VFS_PAGE_START_OFFSET (VFS_RESERVED_BLOCK_COUNT * VFS_PAGE_SIZE)
+// Super block state, an image is dirty from the time it is opened until it
+// has been closed with vfs_close().
+#define VFS_STATE_CLEAN 0
+#define VFS_STATE_DIRTY 1
+
+struct vfs_super_block {
+    char magic_number[4];
+    uint32_t pages;
+    uint32_t inodes;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t capacity;
+    uint32_t free_vector_start;
+    uint32_t free_vector_pages;
+    uint32_t dense_index_start;
+    uint32_t dense_index_pages;
+    uint32_t data_start;
+    uint32_t state;
+    uint32_t journal_start;
+    uint32_t journal_pages;
+    // Sequence number of the next journal transaction.
+    uint64_t journal_sequence;
+};
 
 #define ERR(x) fprintf(stderr, "Error in %s at line %d in %s:\r\n\t%s\r\n", __func__, __LINE__, __FILE__, x)
 
-void fseek_w(FILE * file, long int offset, int whence);
-void fread_w(void *ptr, size_t size, size_t nmemb, FILE * stream);
-void fwrite_w(void *ptr, size_t size, size_t nmemb, FILE * stream);
+void pread_w(int fd, void * buffer, size_t size, uint64_t offset);
+void pwrite_w(int fd, const void * buffer, size_t size, uint64_t offset);
 
+struct vfs_options {
+    // Number of pages held by the page cache, 0 selects VFS_CACHE_DEFAULT_PAGES.
+    uint32_t cache_pages;
+    // Access the image through a shared memory mapping instead of the page
+    // cache. Pages are used in place and only msync'd by vfs_sync().
+    bool mmap;
+    // Page size of a newly created image, a power of two between
+    // VFS_MIN_PAGE_SIZE and VFS_MAX_PAGE_SIZE. 0 selects VFS_DEFAULT_PAGE_SIZE.
+    uint32_t page_size;
+    // Number of pages a newly created image can hold, rounded up to whole
+    // free block vector pages. 0 selects VFS_DEFAULT_CAPACITY.
+    uint32_t capacity;
+    // Pages reserved for the journal in a newly created image, 0 selects
+    // VFS_JOURNAL_DEFAULT_PAGES.
+    uint32_t journal_pages;
+    // Create the image without a journal.
+    bool no_journal;
+    // Largest readahead window of a file in pages, 0 selects
+    // VFS_READAHEAD_DEFAULT_PAGES. See file_set_readahead().
+    uint32_t readahead_pages;
+    // Bytes file_write() collects per file before appending them, 0 selects
+    // VFS_WRITE_BUFFER_DEFAULT_SIZE. See file_set_write_buffer().
+    uint32_t write_buffer_size;
+    // Send asynchronous I/O to the worker threads even where io_uring is
+    // available.
+    bool aio_threads;
+    // Write a trace of every page access to this file, NULL for none. See
+    // vfs_replay.
+    const char * trace_path;
+};
+
+/*
+ * A vfs_t may be shared by any number of threads. Each file_t and directory_t
+ * belongs to the thread that opened it.
+ *
+ * Locks are taken in this order: an inode's rwlock, inode_lock, alloc_lock,
+ * then the page cache and dentry cache locks.
+ */
 struct vfs {
-    FILE * vdisk;
+    // Image file, all I/O on it is positioned so threads never share an offset.
+    int fd;
     char magic_number[4];
     uint32_t pages;
     uint32_t inodes;
+
+    // Geometry from the super block.
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t capacity;
+    uint32_t free_vector_start;
+    uint32_t free_vector_pages;
+    uint32_t dense_index_start;
+    uint32_t dense_index_pages;
+    uint32_t journal_start;
+    uint32_t journal_pages;
+    uint32_t data_start;
+    uint32_t inodes_per_page;
+    uint32_t state;
+    // The image was not closed cleanly before it was opened.
+    bool was_dirty;
+    // Readahead limit files start out with.
+    uint32_t readahead_pages;
+    // Write buffer size files start out with.
+    uint32_t write_buffer_size;
+
+    // Protects the free map and the page high-water mark.
+    pthread_mutex_t alloc_lock;
+
+    // In memory copy of the free block vector, loaded on first use. Bit i of
+    // word w is page (w * 64 + i), a set bit means the page is free.
+    uint64_t * free_map;
+    // One bit per free_map word, set when the word must be written back.
+    uint64_t * free_map_dirty;
+    uint32_t free_map_words;
+    // No free page exists in any word before this one.
+    uint32_t free_map_hint;
+    // Pages freed with a journal, put back in the free map only once the
+    // transaction freeing them has committed. Until then the image on disk
+    // may still point at them.
+    uint32_t * free_pending;
+    uint32_t free_pending_count;
+    uint32_t free_pending_size;
+
+    // Protects the inode table, the dense index and the inode count.
+    pthread_mutex_t inode_lock;
+
+    // Dense index, the page holding each page worth of inodes. Each dense
+    // index page is read the first time one of its entries is needed.
+    uint32_t * dense_index;
+    uint32_t dense_index_entries;
+    bool * dense_index_loaded;
+
+    // In memory inodes by inode number, NULL until the inode is first used.
+    struct inode_entry ** inode_table;
+    uint32_t inode_table_size;
+    // Inodes changed since vfs_inode_sync() last ran, each can add a page to
+    // the next commit. Read without inode_lock as an estimate.
+    uint32_t dirty_inodes;
+
+    struct page_cache cache;
+    struct dentry_cache dentries;
+    struct vfs_aio aio;
+    struct vfs_journal journal;
+    struct vfs_stats_state stats;
+    struct vfs_trace trace;
+
+    // Base of the image mapping when opened with vfs_options.mmap, else NULL.
+    // Address space for the largest possible image is reserved up front so
+    // growing the mapping never moves pages that are in use.
+    uint8_t * map;
+    size_t map_size;
+    size_t map_reserved;
+    // Serialises growing the mapping.
+    pthread_mutex_t map_lock;
 };
 typedef struct vfs * vfs_t;
 
-struct page {
-    uint8_t bytes[VFS_PAGE_SIZE];
-};
+#define VFS_DIRECT_PAGE_COUNT 10
+#define VFS_INDIRECT_PAGE_ENTRIES(vfs) ((vfs)->page_size / sizeof(uint32_t))
+#define VFS_MAX_FILE_PAGES(vfs) ((uint64_t) VFS_DIRECT_PAGE_COUNT + VFS_INDIRECT_PAGE_ENTRIES(vfs) +\
+                                 (uint64_t) VFS_INDIRECT_PAGE_ENTRIES(vfs) * VFS_INDIRECT_PAGE_ENTRIES(vfs))
 
 #define VFS_NEW_FILE_FLAGS      0x40000000
 #define VFS_NEW_DIRECTORY_FLAGS 0x80000000
+// Directory entries are kept in hashed buckets instead of a flat list.
+#define VFS_HASHED_DIRECTORY_FLAG 0x20000000
+// File data is kept in the inode itself, see VFS_INLINE_DATA_SIZE.
+#define VFS_INLINE_DATA_FLAG 0x10000000
+#define VFS_NEW_HASHED_DIRECTORY_FLAGS (VFS_NEW_DIRECTORY_FLAGS | VFS_HASHED_DIRECTORY_FLAG)
 #define VFS_ERROR_FLAGS         0xFFFFFFFF
 
 struct inode {
     uint32_t file_size;
     uint32_t file_flags;
-    uint16_t d_pages[10];
-    uint16_t si_page;
-    uint16_t di_page;
+    uint32_t d_pages[VFS_DIRECT_PAGE_COUNT];
+    uint32_t si_page;
+    uint32_t di_page;
+    uint32_t reserved[2];
 };
 typedef struct inode * inode_t;
 
-void vfs_page_free_modify(vfs_t vfs, uint16_t page_number, bool marking_as_used);
-static inline void vfs_page_free_mark(vfs_t vfs, uint16_t page_number)
+/*
+ * A file of at most VFS_INLINE_DATA_SIZE bytes keeps its data in place of
+ * d_pages, si_page and di_page and takes no pages. The area is everything
+ * from d_pages up to reserved, so it grows with the inode. The file moves to
+ * pages once it grows past it.
+ */
+#define VFS_INLINE_DATA_SIZE (offsetof(struct inode, reserved) - offsetof(struct inode, d_pages))
+
+static inline bool vfs_inode_is_inline(const struct inode * inode)
+{
+    return (inode->file_flags & VFS_INLINE_DATA_FLAG) != 0;
+}
+
+static inline uint8_t * vfs_inode_inline_data(inode_t inode)
+{
+    return (uint8_t *) inode->d_pages;
+}
+
+/*
+ * Entry in the in memory inode table. The inode_t handed out by
+ * vfs_get_inode() points at the inode member, so every user of an inode
+ * shares the same copy.
+ */
+struct inode_entry {
+    struct inode inode;
+    uint32_t references;
+    bool dirty;
+    // Held shared to read the file or directory, exclusive to change it.
+    pthread_rwlock_t lock;
+};
+
+#define VFS_FREE_MAP_WORD_BITS 64
+
+void vfs_free_map_load(vfs_t vfs);
+void vfs_free_map_sync(vfs_t vfs);
+
+bool vfs_page_free_check(vfs_t vfs, uint32_t page_number);
+void vfs_page_free_modify(vfs_t vfs, uint32_t page_number, bool marking_as_used);
+static inline void vfs_page_free_mark(vfs_t vfs, uint32_t page_number)
 {
     vfs_page_free_modify(vfs, page_number, true);
 }
-static inline void vfs_page_free_unmark(vfs_t vfs, uint16_t page_number)
+static inline void vfs_page_free_unmark(vfs_t vfs, uint32_t page_number)
 {
     vfs_page_free_modify(vfs, page_number, false);
 }
 
-//void vfs_page_write(vfs_t vfs, uint16_t page_number, int8_t * buffer, int16_t buffer_size);
+void vfs_disk_read(vfs_t vfs, uint32_t page_number, uint32_t count, void * buffer);
+void vfs_disk_write(vfs_t vfs, uint32_t page_number, uint32_t count, const void * buffer);
+void vfs_disk_read_range(vfs_t vfs, uint64_t offset, size_t size, void * buffer);
+void vfs_disk_write_range(vfs_t vfs, uint64_t offset, size_t size, const void * buffer);
+
+uint8_t * vfs_map_pages(vfs_t vfs, uint32_t page_number, uint32_t count);
+
+void vfs_add_inode_page(vfs_t vfs, inode_t inode, uint32_t page_number, uint32_t page_index);
+
+uint32_t vfs_allocate_new_page(vfs_t vfs);
 
-void vfs_add_inode_page(vfs_t vfs, inode_t inode, uint16_t page_number, uint16_t page_index);
+uint32_t vfs_allocate_pages(vfs_t vfs, uint32_t count, uint32_t * allocated);
 
-uint16_t vfs_allocate_new_page(vfs_t vfs);
+void vfs_free_map_compact(vfs_t vfs, uint32_t pages);
 
 void vfs_update_inode(vfs_t vfs, inode_t inode, uint16_t inode_number);
 
 inode_t vfs_get_inode(vfs_t vfs, int16_t inode_number);
 
+void vfs_put_inode(vfs_t vfs, inode_t inode);
+
+void vfs_inode_read_lock(inode_t inode);
+void vfs_inode_write_lock(inode_t inode);
+void vfs_inode_unlock(inode_t inode);
+
+void vfs_inode_sync(vfs_t vfs);
+
 uint16_t vfs_new_inode(vfs_t vfs, int32_t flags);
 
+uint32_t vfs_inode_page(vfs_t vfs, uint16_t inode_number);
+void vfs_inode_page_move(vfs_t vfs, uint16_t inode_number, uint32_t page_number);
+
+uint32_t vfs_new_inodes_pages(vfs_t vfs, uint32_t count);
+uint16_t vfs_new_inodes(vfs_t vfs, const struct inode * inodes, uint32_t count, uint32_t first_page);
+
 static inline uint16_t vfs_new_file_inode(vfs_t vfs)
 {
     return vfs_new_inode(vfs, VFS_NEW_FILE_FLAGS);
@@ -92,10 +301,19 @@ static inline uint16_t vfs_new_dir_inode(vfs_t vfs)
     return vfs_new_inode(vfs, VFS_NEW_DIRECTORY_FLAGS);
 }
 
+static inline uint16_t vfs_new_hashed_dir_inode(vfs_t vfs)
+{
+    return vfs_new_inode(vfs, VFS_NEW_HASHED_DIRECTORY_FLAGS);
+}
+
 void vfs_create(vfs_t vfs);
 
 vfs_t vfs_open(const char * vdisk);
 
+vfs_t vfs_open_with(const char * vdisk, const struct vfs_options * options);
+
+void vfs_sync(vfs_t vfs);
+
 void vfs_close(vfs_t vfs);
 
 #endif
\ No newline at end of file
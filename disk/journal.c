@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+
+void vfs_journal_init(vfs_t vfs)
+{
+    struct vfs_journal * journal = &vfs->journal;
+    journal->sequence = 0;
+    journal->commits = 0;
+
+    // A commit waits for the operations in progress, new ones wait for it
+    // rather than starving it.
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&journal->transaction_lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+}
+
+void vfs_journal_destroy(vfs_t vfs)
+{
+    pthread_rwlock_destroy(&vfs->journal.transaction_lock);
+}
+
+/*
+ * @return: true if changes to metadata go through the journal. A mapped image
+ *          is written back by the kernel in any order, so it is not journaled.
+ */
+bool vfs_journal_active(vfs_t vfs)
+{
+    return vfs->journal_pages != 0 && vfs->map == NULL;
+}
+
+static uint32_t vfs_journal_descriptor_pages(vfs_t vfs, uint32_t count)
+{
+    return (uint32_t) ((sizeof(struct vfs_journal_header) + (size_t) count * sizeof(uint32_t) + vfs->page_size - 1) / vfs->page_size);
+}
+
+/*
+ * @return: the most pages one transaction can hold.
+ */
+uint32_t vfs_journal_max_pages(vfs_t vfs)
+{
+    uint32_t half_pages = vfs->journal_pages / 2;
+    return half_pages - 1 - vfs_journal_descriptor_pages(vfs, half_pages);
+}
+
+static uint64_t vfs_journal_checksum(const uint8_t * data, size_t size)
+{
+    // FNV-1a over 64 bit words, the size is always a whole number of pages.
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for(i = 0; i < size; i += sizeof(uint64_t))
+    {
+        uint64_t word = 0;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/*
+ * @brief: writes count page images to the journal as the next transaction,
+ *         with one write, and waits for it to reach the disk. The pages may
+ *         be written in place once this returns.
+ */
+void vfs_journal_write(vfs_t vfs, const uint32_t * page_numbers, const uint8_t ** contents, uint32_t count)
+{
+    struct vfs_journal * journal = &vfs->journal;
+    const uint32_t page_size = vfs->page_size;
+    uint32_t descriptor_pages = vfs_journal_descriptor_pages(vfs, count);
+    uint32_t total_pages = descriptor_pages + count + 1;
+    if(count > vfs_journal_max_pages(vfs))
+    {
+        ERR("Transaction does not fit in the journal.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t * transaction = (uint8_t *) calloc(total_pages, page_size);
+    struct vfs_journal_header header = { .magic_number = "vfJ", .count = count, .sequence = journal->sequence };
+    memcpy(transaction, &header, sizeof(header));
+    memcpy(transaction + sizeof(header), page_numbers, count * sizeof(*page_numbers));
+
+    uint32_t i = 0;
+    for(i = 0; i < count; ++i)
+        memcpy(transaction + (size_t) (descriptor_pages + i) * page_size, contents[i], page_size);
+
+    size_t logged_size = (size_t) (descriptor_pages + count) * page_size;
+    struct vfs_journal_commit commit = {
+            .magic_number = "vfC",
+            .count = count,
+            .sequence = journal->sequence,
+            .checksum = vfs_journal_checksum(transaction, logged_size)
+    };
+    memcpy(transaction + logged_size, &commit, sizeof(commit));
+
+    uint32_t half_pages = vfs->journal_pages / 2;
+    vfs_disk_write(vfs, vfs->journal_start + (uint32_t) (journal->sequence % 2) * half_pages, total_pages, transaction);
+    if(fdatasync(vfs->fd) != 0)
+    {
+        ERR("Unable to commit the journal.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    free(transaction);
+
+    journal->sequence++;
+    journal->commits++;
+}
+
+/*
+ * @brief: reads the transaction in one half of the journal.
+ *
+ * @return: the whole transaction, or NULL if the half holds no complete one.
+ */
+static uint8_t * vfs_journal_read_half(vfs_t vfs, uint32_t half, struct vfs_journal_header * header)
+{
+    const uint32_t page_size = vfs->page_size;
+    uint32_t half_pages = vfs->journal_pages / 2;
+    uint32_t start = vfs->journal_start + half * half_pages;
+
+    uint8_t * first_page = (uint8_t *) malloc(page_size);
+    vfs_disk_read(vfs, start, 1, first_page);
+    memcpy(header, first_page, sizeof(*header));
+    free(first_page);
+    if(memcmp(header->magic_number, "vfJ", sizeof("vfJ")) != 0 || header->count > vfs_journal_max_pages(vfs))
+        return NULL;
+
+    uint32_t descriptor_pages = vfs_journal_descriptor_pages(vfs, header->count);
+    size_t logged_size = (size_t) (descriptor_pages + header->count) * page_size;
+    uint8_t * transaction = (uint8_t *) malloc(logged_size + page_size);
+    vfs_disk_read(vfs, start, descriptor_pages + header->count + 1, transaction);
+
+    struct vfs_journal_commit commit;
+    memcpy(&commit, transaction + logged_size, sizeof(commit));
+    bool valid = memcmp(commit.magic_number, "vfC", sizeof("vfC")) == 0
+                 && commit.count == header->count && commit.sequence == header->sequence
+                 && commit.checksum == vfs_journal_checksum(transaction, logged_size);
+
+    // Only pages outside the journal itself can have been logged.
+    uint32_t i = 0;
+    for(i = 0; valid && i < header->count; ++i)
+    {
+        uint32_t page_number = 0;
+        memcpy(&page_number, transaction + sizeof(*header) + i * sizeof(page_number), sizeof(page_number));
+        valid = page_number < vfs->capacity
+                && (page_number < vfs->journal_start || page_number >= vfs->journal_start + vfs->journal_pages);
+    }
+
+    if(!valid)
+    {
+        free(transaction);
+        return NULL;
+    }
+    return transaction;
+}
+
+/*
+ * @brief: writes the pages of the newest committed transaction in place.
+ *         Called when opening an image that was not closed cleanly, before
+ *         anything else is read from it.
+ *
+ * @return: true if a transaction was replayed.
+ */
+bool vfs_journal_replay(vfs_t vfs)
+{
+    struct vfs_journal_header headers[2];
+    uint8_t * transactions[2];
+    transactions[0] = vfs_journal_read_half(vfs, 0, &headers[0]);
+    transactions[1] = vfs_journal_read_half(vfs, 1, &headers[1]);
+
+    int newest = -1;
+    if(transactions[0] != NULL)
+        newest = 0;
+    if(transactions[1] != NULL && (newest == -1 || headers[1].sequence > headers[0].sequence))
+        newest = 1;
+
+    if(newest != -1)
+    {
+        uint8_t * transaction = transactions[newest];
+        uint32_t descriptor_pages = vfs_journal_descriptor_pages(vfs, headers[newest].count);
+        uint32_t i = 0;
+        for(i = 0; i < headers[newest].count; ++i)
+        {
+            uint32_t page_number = 0;
+            memcpy(&page_number, transaction + sizeof(struct vfs_journal_header) + i * sizeof(page_number), sizeof(page_number));
+            vfs_disk_write(vfs, page_number, 1, transaction + (size_t) (descriptor_pages + i) * vfs->page_size);
+        }
+        if(fdatasync(vfs->fd) != 0)
+        {
+            ERR("Unable to write the replayed journal.\r\n\t"
+                "Exiting.");
+            exit(EXIT_FAILURE);
+        }
+        vfs->journal.sequence = headers[newest].sequence + 1;
+    }
+
+    free(transactions[0]);
+    free(transactions[1]);
+    return newest != -1;
+}
+
+/*
+ * @return: the most pages the next commit can hold, the dirty pages in the
+ *          cache and an inode page for every dirty inode.
+ */
+static uint32_t vfs_journal_pending_pages(vfs_t vfs)
+{
+    return vfs_cache_dirty_count(vfs) + __atomic_load_n(&vfs->dirty_inodes, __ATOMIC_RELAXED);
+}
+
+/*
+ * @brief: brackets an operation that changes metadata. Everything it changes
+ *         is committed in the same transaction. Once enough pages are dirty
+ *         the operation ending commits the transaction, so many operations
+ *         share one journal write and one flush to disk.
+ */
+void vfs_transaction_begin(vfs_t vfs)
+{
+    if(!vfs_journal_active(vfs))
+        return;
+
+    // Once the cache is into its spare frames, commit before starting so
+    // only the operations already in progress can use more of them.
+    if(vfs_journal_pending_pages(vfs) >= vfs->cache.capacity)
+        vfs_sync(vfs);
+    pthread_rwlock_rdlock(&vfs->journal.transaction_lock);
+}
+
+void vfs_transaction_end(vfs_t vfs)
+{
+    if(!vfs_journal_active(vfs))
+        return;
+
+    pthread_rwlock_unlock(&vfs->journal.transaction_lock);
+    if(vfs_journal_pending_pages(vfs) > vfs->cache.capacity / 2)
+        vfs_sync(vfs);
+}
@@ -0,0 +1,60 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define VFS_JOURNAL_DEFAULT_PAGES 1024
+#define VFS_JOURNAL_MIN_PAGES 64
+
+struct vfs;
+
+/*
+ * On disk a transaction is a header page, followed by as many pages of page
+ * numbers as it needs, the page images in the same order and a commit
+ * record. The checksum covers everything before the commit record, so a
+ * transaction that did not reach the disk whole is ignored.
+ */
+struct vfs_journal_header {
+    char magic_number[4];
+    uint32_t count;
+    uint64_t sequence;
+};
+
+struct vfs_journal_commit {
+    char magic_number[4];
+    uint32_t count;
+    uint64_t sequence;
+    uint64_t checksum;
+};
+
+/*
+ * Write-ahead journal of metadata pages. The journal region is split in two
+ * halves and transaction n is written to half n % 2, so the newest committed
+ * transaction is never overwritten by the next one before that has been
+ * committed. Every page written in place before a commit was made durable by
+ * it, so replay only ever needs the newest committed transaction.
+ */
+struct vfs_journal {
+    // Operations that change metadata hold this shared, a commit holds it
+    // exclusively so it never sees an operation half done.
+    pthread_rwlock_t transaction_lock;
+    // Sequence number of the next transaction.
+    uint64_t sequence;
+
+    uint64_t commits;
+};
+
+void vfs_journal_init(struct vfs * vfs);
+void vfs_journal_destroy(struct vfs * vfs);
+bool vfs_journal_active(struct vfs * vfs);
+uint32_t vfs_journal_max_pages(struct vfs * vfs);
+
+void vfs_journal_write(struct vfs * vfs, const uint32_t * page_numbers, const uint8_t ** contents, uint32_t count);
+bool vfs_journal_replay(struct vfs * vfs);
+
+void vfs_transaction_begin(struct vfs * vfs);
+void vfs_transaction_end(struct vfs * vfs);
+
+#endif
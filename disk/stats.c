@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+
+static const char * vfs_stats_operation_names[VFS_STATS_OPERATIONS] = {
+        "file_read",
+        "file_write",
+        "file_open",
+        "file_create"
+};
+
+__thread uint32_t vfs_stats_slot_number = 0;
+
+// Thread slots are shared by every vfs. Those of threads that have exited
+// are handed out again before new ones.
+static pthread_mutex_t vfs_stats_slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t vfs_stats_free_slots[VFS_STATS_THREAD_SLOTS];
+static uint32_t vfs_stats_free_slot_count = 0;
+static uint32_t vfs_stats_next_slot = 0;
+static pthread_key_t vfs_stats_slot_key;
+static pthread_once_t vfs_stats_slot_once = PTHREAD_ONCE_INIT;
+
+static void vfs_stats_slot_release(void * slot_number)
+{
+    pthread_mutex_lock(&vfs_stats_slot_lock);
+    vfs_stats_free_slots[vfs_stats_free_slot_count++] = (uint32_t) (uintptr_t) slot_number - 1;
+    pthread_mutex_unlock(&vfs_stats_slot_lock);
+    // Anything counted by a later destructor goes to the shared slot.
+    vfs_stats_slot_number = VFS_STATS_THREAD_SLOTS + 1;
+}
+
+static void vfs_stats_slot_key_create(void)
+{
+    pthread_key_create(&vfs_stats_slot_key, vfs_stats_slot_release);
+}
+
+/*
+ * @brief: gives the calling thread a slot of its own, given back when the
+ *         thread exits, or the shared slot if every slot is in use.
+ *
+ * @return: the slot plus one, as kept in vfs_stats_slot_number.
+ */
+uint32_t vfs_stats_thread_slot(void)
+{
+    pthread_once(&vfs_stats_slot_once, vfs_stats_slot_key_create);
+
+    uint32_t slot = VFS_STATS_THREAD_SLOTS;
+    pthread_mutex_lock(&vfs_stats_slot_lock);
+    if(vfs_stats_free_slot_count != 0)
+        slot = vfs_stats_free_slots[--vfs_stats_free_slot_count];
+    else if(vfs_stats_next_slot < VFS_STATS_THREAD_SLOTS)
+        slot = vfs_stats_next_slot++;
+    pthread_mutex_unlock(&vfs_stats_slot_lock);
+
+    if(slot < VFS_STATS_THREAD_SLOTS)
+        pthread_setspecific(vfs_stats_slot_key, (void *) (uintptr_t) (slot + 1));
+    vfs_stats_slot_number = slot + 1;
+    return slot + 1;
+}
+
+void vfs_stats_init(vfs_t vfs)
+{
+    size_t size = (VFS_STATS_THREAD_SLOTS + 1) * sizeof(struct vfs_stats_slot);
+    vfs->stats.slots = (struct vfs_stats_slot *) aligned_alloc(_Alignof(struct vfs_stats_slot), size);
+    if(vfs->stats.slots == NULL)
+    {
+        ERR("Unable to allocate memory for the statistics.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    memset(vfs->stats.slots, 0, size);
+    memset(vfs->stats.base, 0, sizeof(vfs->stats.base));
+    memset(vfs->stats.latency, 0, sizeof(vfs->stats.latency));
+}
+
+void vfs_stats_destroy(vfs_t vfs)
+{
+    free(vfs->stats.slots);
+    vfs->stats.slots = NULL;
+}
+
+static uint32_t vfs_stats_bucket(uint64_t ns)
+{
+    if(ns < 2)
+        return 0;
+    uint32_t bucket = 63 - (uint32_t) __builtin_clzll(ns);
+    return (bucket < VFS_STATS_HISTOGRAM_BUCKETS) ? bucket : VFS_STATS_HISTOGRAM_BUCKETS - 1;
+}
+
+/*
+ * @brief: adds the time since start_ns, from vfs_stats_now(), to the latency
+ *         histogram of an operation.
+ */
+void vfs_stats_record(vfs_t vfs, enum vfs_stats_operation operation, uint64_t start_ns)
+{
+    uint64_t ns = vfs_stats_now() - start_ns;
+    struct vfs_latency_histogram * histogram = &vfs->stats.latency[operation];
+
+    __atomic_fetch_add(&histogram->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->buckets[vfs_stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+
+    uint64_t max_ns = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while(ns > max_ns && !__atomic_compare_exchange_n(&histogram->max_ns, &max_ns, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Every thread's part of a counter since the vfs was opened.
+static uint64_t vfs_stats_sum(vfs_t vfs, size_t counter)
+{
+    uint64_t sum = 0;
+    size_t slot = 0;
+    for(slot = 0; slot <= VFS_STATS_THREAD_SLOTS; ++slot)
+        sum += __atomic_load_n(&vfs->stats.slots[slot].counters[counter], __ATOMIC_RELAXED);
+    return sum;
+}
+
+/*
+ * @return: a copy of the counters. Each counter is read atomically, the copy
+ *          as a whole is not a snapshot while other threads are working.
+ */
+struct vfs_stats vfs_stats_get(vfs_t vfs)
+{
+    struct vfs_stats stats;
+    uint64_t * copy = (uint64_t *) &stats;
+
+    size_t i = 0;
+    for(i = 0; i < VFS_STATS_COUNTERS; ++i)
+        copy[i] = vfs_stats_sum(vfs, i) - __atomic_load_n(&vfs->stats.base[i], __ATOMIC_RELAXED);
+
+    uint64_t * source = (uint64_t *) vfs->stats.latency;
+    copy = (uint64_t *) stats.latency;
+    for(i = 0; i < sizeof(stats.latency) / sizeof(uint64_t); ++i)
+        copy[i] = __atomic_load_n(&source[i], __ATOMIC_RELAXED);
+
+    int operation = 0;
+    for(operation = 0; operation < VFS_STATS_OPERATIONS; ++operation)
+    {
+        struct vfs_latency_histogram * histogram = &stats.latency[operation];
+        histogram->samples = 0;
+        for(i = 0; i < VFS_STATS_HISTOGRAM_BUCKETS; ++i)
+            histogram->samples += histogram->buckets[i];
+    }
+    return stats;
+}
+
+/*
+ * @brief: starts the counters again from zero. The thread slots are left as
+ *         they are, vfs_stats_get() subtracts what they held now.
+ */
+void vfs_stats_reset(vfs_t vfs)
+{
+    size_t i = 0;
+    for(i = 0; i < VFS_STATS_COUNTERS; ++i)
+        __atomic_store_n(&vfs->stats.base[i], vfs_stats_sum(vfs, i), __ATOMIC_RELAXED);
+
+    uint64_t * latency = (uint64_t *) vfs->stats.latency;
+    for(i = 0; i < sizeof(vfs->stats.latency) / sizeof(uint64_t); ++i)
+        __atomic_store_n(&latency[i], 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * @return: upper bound in nanoseconds of the bucket holding the given
+ *          fraction of the calls.
+ */
+static uint64_t vfs_stats_percentile(const struct vfs_latency_histogram * histogram, double fraction)
+{
+    uint64_t wanted = (uint64_t) ((double) histogram->samples * fraction);
+    uint64_t seen = 0;
+    uint32_t i = 0;
+    for(i = 0; i < VFS_STATS_HISTOGRAM_BUCKETS; ++i)
+    {
+        seen += histogram->buckets[i];
+        if(seen > wanted)
+            break;
+    }
+    return (i < VFS_STATS_HISTOGRAM_BUCKETS - 1) ? 2ull << i : histogram->max_ns;
+}
+
+static void vfs_stats_print_duration(FILE * out, uint64_t ns)
+{
+    if(ns < 1000)
+        fprintf(out, "%lluns", (unsigned long long) ns);
+    else if(ns < 1000000)
+        fprintf(out, "%.1fus", (double) ns / 1e3);
+    else if(ns < 1000000000)
+        fprintf(out, "%.1fms", (double) ns / 1e6);
+    else
+        fprintf(out, "%.2fs", (double) ns / 1e9);
+}
+
+/*
+ * @brief: prints the counters, the page and dentry cache hit rates and the
+ *         latency histograms as text.
+ */
+void vfs_stats_dump(vfs_t vfs, FILE * out)
+{
+    struct vfs_stats stats = vfs_stats_get(vfs);
+    struct vfs_cache_stats cache = vfs_cache_stats(vfs);
+
+    fprintf(out, "seek calls               %llu\n", (unsigned long long) stats.seek_calls);
+    fprintf(out, "read calls               %llu\n", (unsigned long long) stats.read_calls);
+    fprintf(out, "bytes read               %llu\n", (unsigned long long) stats.bytes_read);
+    fprintf(out, "write calls              %llu\n", (unsigned long long) stats.write_calls);
+    fprintf(out, "bytes written            %llu\n", (unsigned long long) stats.bytes_written);
+    fprintf(out, "pages allocated          %llu\n", (unsigned long long) stats.pages_allocated);
+    fprintf(out, "pages freed              %llu\n", (unsigned long long) stats.pages_freed);
+    fprintf(out, "inode reads              %llu\n", (unsigned long long) stats.inode_reads);
+    fprintf(out, "inode writes             %llu\n", (unsigned long long) stats.inode_writes);
+    fprintf(out, "directory pages scanned  %llu\n", (unsigned long long) stats.directory_pages_scanned);
+    fprintf(out, "page map builds          %llu\n", (unsigned long long) stats.page_map_builds);
+    fprintf(out, "page cache               %llu hits %llu misses %llu evictions %llu writebacks %llu overflows\n",
+            (unsigned long long) cache.hits, (unsigned long long) cache.misses,
+            (unsigned long long) cache.evictions, (unsigned long long) cache.writebacks,
+            (unsigned long long) cache.overflows);
+    pthread_mutex_lock(&vfs->dentries.lock);
+    fprintf(out, "dentry cache             %llu hits %llu misses\n",
+            (unsigned long long) vfs->dentries.hits, (unsigned long long) vfs->dentries.misses);
+    pthread_mutex_unlock(&vfs->dentries.lock);
+
+    int operation = 0;
+    for(operation = 0; operation < VFS_STATS_OPERATIONS; ++operation)
+    {
+        const struct vfs_latency_histogram * histogram = &stats.latency[operation];
+        fprintf(out, "%s: %llu sampled calls", vfs_stats_operation_names[operation], (unsigned long long) histogram->samples);
+        if(histogram->samples == 0)
+        {
+            fprintf(out, "\n");
+            continue;
+        }
+
+        fprintf(out, ", mean ");
+        vfs_stats_print_duration(out, histogram->total_ns / histogram->samples);
+        fprintf(out, ", p50 < ");
+        vfs_stats_print_duration(out, vfs_stats_percentile(histogram, 0.50));
+        fprintf(out, ", p99 < ");
+        vfs_stats_print_duration(out, vfs_stats_percentile(histogram, 0.99));
+        fprintf(out, ", max ");
+        vfs_stats_print_duration(out, histogram->max_ns);
+        fprintf(out, "\n");
+
+        uint32_t i = 0;
+        for(i = 0; i < VFS_STATS_HISTOGRAM_BUCKETS; ++i)
+        {
+            if(histogram->buckets[i] == 0)
+                continue;
+            fprintf(out, "  [");
+            vfs_stats_print_duration(out, (i == 0) ? 0 : 1ull << i);
+            fprintf(out, ", ");
+            if(i == VFS_STATS_HISTOGRAM_BUCKETS - 1)
+                fprintf(out, "inf");
+            else
+                vfs_stats_print_duration(out, 2ull << i);
+            fprintf(out, ") %llu\n", (unsigned long long) histogram->buckets[i]);
+        }
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+// Bucket i of a latency histogram counts calls that took [2^i, 2^(i+1))
+// nanoseconds, the last bucket everything longer.
+#define VFS_STATS_HISTOGRAM_BUCKETS 40
+// One call in this many, per thread, is timed. A power of two.
+#define VFS_STATS_SAMPLE_PERIOD 16
+// Threads with counters of their own, any more share one slot.
+#define VFS_STATS_THREAD_SLOTS 64
+
+struct vfs;
+
+enum vfs_stats_operation {
+    VFS_STATS_FILE_READ,
+    VFS_STATS_FILE_WRITE,
+    VFS_STATS_FILE_OPEN,
+    VFS_STATS_FILE_CREATE,
+    VFS_STATS_OPERATIONS
+};
+
+struct vfs_latency_histogram {
+    // Timed calls, filled in by vfs_stats_get().
+    uint64_t samples;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[VFS_STATS_HISTOGRAM_BUCKETS];
+};
+
+/*
+ * Counters kept by every vfs, always on. Each thread adds to a slot of its
+ * own without a locked instruction and vfs_stats_get() sums the slots, past
+ * VFS_STATS_THREAD_SLOTS threads the rest share a slot updated atomically.
+ * Reading the clock costs more than most buffered reads and writes, so the
+ * latency histograms sample one call in VFS_STATS_SAMPLE_PERIOD. Every field
+ * is a uint64_t, vfs_stats_get() and vfs_stats_reset() rely on it.
+ */
+struct vfs_stats {
+    // Calls to file_seek(), not disk accesses out of sequence.
+    uint64_t seek_calls;
+    uint64_t read_calls;
+    uint64_t bytes_read;
+    uint64_t write_calls;
+    uint64_t bytes_written;
+    uint64_t pages_allocated;
+    uint64_t pages_freed;
+    uint64_t inode_reads;
+    uint64_t inode_writes;
+    uint64_t directory_pages_scanned;
+    uint64_t page_map_builds;
+
+    struct vfs_latency_histogram latency[VFS_STATS_OPERATIONS];
+};
+
+#define VFS_STATS_COUNTERS (offsetof(struct vfs_stats, latency) / sizeof(uint64_t))
+
+// A cache line or more each, so threads do not share lines.
+struct vfs_stats_slot {
+    uint64_t counters[VFS_STATS_COUNTERS];
+} __attribute__((aligned(64)));
+
+struct vfs_stats_state {
+    // VFS_STATS_THREAD_SLOTS slots each used by one thread, then the shared one.
+    struct vfs_stats_slot * slots;
+    // The counters as they were at the last vfs_stats_reset().
+    uint64_t base[VFS_STATS_COUNTERS];
+    struct vfs_latency_histogram latency[VFS_STATS_OPERATIONS];
+};
+
+// The calling thread's slot plus one, 0 until vfs_stats_thread_slot() is called.
+extern __thread uint32_t vfs_stats_slot_number;
+uint32_t vfs_stats_thread_slot(void);
+
+static inline void vfs_stats_add(struct vfs_stats_slot * slots, size_t counter, uint64_t amount)
+{
+    uint32_t slot = vfs_stats_slot_number;
+    if(slot == 0)
+        slot = vfs_stats_thread_slot();
+
+    uint64_t * value = &slots[slot - 1].counters[counter];
+    if(slot <= VFS_STATS_THREAD_SLOTS)
+        __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(value, amount, __ATOMIC_RELAXED);
+}
+
+#define VFS_STATS_ADD(vfs, counter, amount) \
+    vfs_stats_add((vfs)->stats.slots, offsetof(struct vfs_stats, counter) / sizeof(uint64_t), (uint64_t) (amount))
+
+static inline uint64_t vfs_stats_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+void vfs_stats_record(struct vfs * vfs, enum vfs_stats_operation operation, uint64_t start_ns);
+
+/*
+ * @return: the time a call starts if it is one of the sampled calls, else 0.
+ *          Pass it to vfs_stats_end() when the call returns.
+ */
+static inline uint64_t vfs_stats_start(enum vfs_stats_operation operation)
+{
+    static __thread uint32_t calls[VFS_STATS_OPERATIONS];
+    if((++calls[operation] & (VFS_STATS_SAMPLE_PERIOD - 1)) != 0)
+        return 0;
+    return vfs_stats_now();
+}
+
+static inline void vfs_stats_end(struct vfs * vfs, enum vfs_stats_operation operation, uint64_t start_ns)
+{
+    if(start_ns != 0)
+        vfs_stats_record(vfs, operation, start_ns);
+}
+
+void vfs_stats_init(struct vfs * vfs);
+void vfs_stats_destroy(struct vfs * vfs);
+struct vfs_stats vfs_stats_get(struct vfs * vfs);
+void vfs_stats_reset(struct vfs * vfs);
+void vfs_stats_dump(struct vfs * vfs, FILE * out);
+
+#endif
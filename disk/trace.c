@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "disk.h"
+
+__thread uint8_t vfs_trace_origin = VFS_TRACE_ORIGIN_OTHER;
+
+static const char * vfs_trace_origin_names[VFS_TRACE_ORIGINS] = {
+        "other",
+        "file_create",
+        "file_open",
+        "file_read",
+        "file_read_async",
+        "file_write",
+        "file_write_async",
+        "file_seek",
+        "file_flush",
+        "directory_create",
+        "directory_open",
+        "directory_add",
+        "vfs_sync"
+};
+
+const char * vfs_trace_origin_name(uint8_t origin)
+{
+    return (origin < VFS_TRACE_ORIGINS) ? vfs_trace_origin_names[origin] : "unknown";
+}
+
+/*
+ * @brief: starts writing a trace of the page accesses to trace_path, or
+ *         leaves tracing off if it is NULL. Called once the geometry of the
+ *         image is known.
+ */
+void vfs_trace_init(vfs_t vfs, const char * trace_path)
+{
+    struct vfs_trace * trace = &vfs->trace;
+    trace->fd = -1;
+    trace->records = NULL;
+    trace->count = 0;
+    pthread_mutex_init(&trace->lock, NULL);
+    if(trace_path == NULL)
+        return;
+
+    trace->fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(trace->fd < 0)
+    {
+        ERR("Unable to create the trace file.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct vfs_trace_header header = {
+            .magic_number = "vfT",
+            .version = VFS_TRACE_VERSION,
+            .page_size = vfs->page_size,
+            .capacity = vfs->capacity
+    };
+    pwrite_w(trace->fd, &header, sizeof(header), 0);
+    trace->offset = sizeof(header);
+
+    trace->records = (struct vfs_trace_record *) malloc(VFS_TRACE_BUFFER_RECORDS * sizeof(*trace->records));
+    trace->start_ns = vfs_stats_now();
+}
+
+static void vfs_trace_write_records(struct vfs_trace * trace)
+{
+    if(trace->count == 0)
+        return;
+
+    size_t size = trace->count * sizeof(*trace->records);
+    pwrite_w(trace->fd, trace->records, size, trace->offset);
+    trace->offset += size;
+    trace->count = 0;
+}
+
+/*
+ * @brief: writes the records collected so far to the trace file.
+ */
+void vfs_trace_flush(vfs_t vfs)
+{
+    struct vfs_trace * trace = &vfs->trace;
+    if(trace->records == NULL)
+        return;
+
+    pthread_mutex_lock(&trace->lock);
+    vfs_trace_write_records(trace);
+    pthread_mutex_unlock(&trace->lock);
+}
+
+void vfs_trace_destroy(vfs_t vfs)
+{
+    struct vfs_trace * trace = &vfs->trace;
+    if(trace->records != NULL)
+    {
+        vfs_trace_write_records(trace);
+        free(trace->records);
+        trace->records = NULL;
+    }
+    if(trace->fd >= 0)
+        close(trace->fd);
+    trace->fd = -1;
+    pthread_mutex_destroy(&trace->lock);
+}
+
+/*
+ * @brief: adds one access to the trace, use VFS_TRACE() so nothing is done
+ *         while tracing is off.
+ */
+void vfs_trace_record(vfs_t vfs, enum vfs_trace_operation operation, uint32_t page_number, uint32_t offset, size_t size)
+{
+    struct vfs_trace * trace = &vfs->trace;
+    struct vfs_trace_record record = {
+            .page_number = page_number,
+            .offset = offset,
+            .size = (uint32_t) size,
+            .operation = (uint8_t) operation,
+            .origin = vfs_trace_origin,
+            .reserved = 0
+    };
+
+    // Stamped under the lock so the records of all threads are in time order.
+    pthread_mutex_lock(&trace->lock);
+    record.time_ns = vfs_stats_now() - trace->start_ns;
+    trace->records[trace->count++] = record;
+    if(trace->count == VFS_TRACE_BUFFER_RECORDS)
+        vfs_trace_write_records(trace);
+    pthread_mutex_unlock(&trace->lock);
+}
@@ -0,0 +1,108 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Records collected before they are written to the trace file.
+#define VFS_TRACE_BUFFER_RECORDS 4096
+#define VFS_TRACE_VERSION 1
+
+struct vfs;
+
+enum vfs_trace_operation {
+    VFS_TRACE_READ,
+    VFS_TRACE_WRITE,
+    // vfs_sync(), page_number, offset and size are 0.
+    VFS_TRACE_SYNC
+};
+
+// Public call a page access was made for.
+enum vfs_trace_origin {
+    VFS_TRACE_ORIGIN_OTHER,
+    VFS_TRACE_ORIGIN_FILE_CREATE,
+    VFS_TRACE_ORIGIN_FILE_OPEN,
+    VFS_TRACE_ORIGIN_FILE_READ,
+    VFS_TRACE_ORIGIN_FILE_READ_ASYNC,
+    VFS_TRACE_ORIGIN_FILE_WRITE,
+    VFS_TRACE_ORIGIN_FILE_WRITE_ASYNC,
+    VFS_TRACE_ORIGIN_FILE_SEEK,
+    VFS_TRACE_ORIGIN_FILE_FLUSH,
+    VFS_TRACE_ORIGIN_DIRECTORY_CREATE,
+    VFS_TRACE_ORIGIN_DIRECTORY_OPEN,
+    VFS_TRACE_ORIGIN_DIRECTORY_ADD,
+    VFS_TRACE_ORIGIN_VFS_SYNC,
+    VFS_TRACE_ORIGINS
+};
+
+/*
+ * A trace file is this header followed by fixed size records in the order
+ * they were made. Records are page accesses as the file layer asks for them,
+ * before the page cache, so replaying a trace exercises the cache again.
+ */
+struct vfs_trace_header {
+    char magic_number[4];
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t capacity;
+};
+
+struct vfs_trace_record {
+    // Nanoseconds since the trace was started.
+    uint64_t time_ns;
+    uint32_t page_number;
+    // Bytes into page_number the access starts at, and its length.
+    uint32_t offset;
+    uint32_t size;
+    uint8_t operation;
+    uint8_t origin;
+    uint16_t reserved;
+};
+
+struct vfs_trace {
+    int fd;
+    pthread_mutex_t lock;
+    // NULL while tracing is off.
+    struct vfs_trace_record * records;
+    uint32_t count;
+    // Where the next records go in the trace file.
+    uint64_t offset;
+    uint64_t start_ns;
+};
+
+extern __thread uint8_t vfs_trace_origin;
+
+/*
+ * @brief: sets the origin of the accesses made by the calling thread until
+ *         vfs_trace_leave(). Within a call already traced the outermost
+ *         origin is kept.
+ *
+ * @return: the origin to pass to vfs_trace_leave().
+ */
+static inline uint8_t vfs_trace_enter(enum vfs_trace_origin origin)
+{
+    uint8_t previous = vfs_trace_origin;
+    if(previous == VFS_TRACE_ORIGIN_OTHER)
+        vfs_trace_origin = (uint8_t) origin;
+    return previous;
+}
+
+static inline void vfs_trace_leave(uint8_t previous)
+{
+    vfs_trace_origin = previous;
+}
+
+#define VFS_TRACE(vfs, operation, page_number, offset, size) \
+    do { \
+        if((vfs)->trace.records != NULL) \
+            vfs_trace_record((vfs), (operation), (page_number), (offset), (size)); \
+    } while(0)
+
+void vfs_trace_init(struct vfs * vfs, const char * trace_path);
+void vfs_trace_destroy(struct vfs * vfs);
+void vfs_trace_flush(struct vfs * vfs);
+void vfs_trace_record(struct vfs * vfs, enum vfs_trace_operation operation, uint32_t page_number, uint32_t offset, size_t size);
+const char * vfs_trace_origin_name(uint8_t origin);
+
+#endif
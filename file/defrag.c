@@ -0,0 +1,398 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "defrag.h"
+
+/*
+ * Offline defragmentation. Every page in use in the data region is given a
+ * new place, in the layout vfs_mkimage() writes: the pages of inodes first,
+ * then each directory's pages followed by its indirect pages and the
+ * indirect pages of each file, in inode order, then the data of each file,
+ * in inode order. Pages nothing refers to are left out, so the data region
+ * ends up without holes.
+ *
+ * The pages are then permuted in place, following each chain of moves until
+ * it reaches a page that is free or has already been moved. Indirect pages
+ * and hashed directory buckets have the page numbers they hold translated
+ * on the way, and the inodes and the dense index are updated at the end.
+ */
+
+enum defrag_page_kind {
+    DEFRAG_PAGE_PLAIN = 0,
+    // Holds page numbers, a single or double indirect page.
+    DEFRAG_PAGE_INDIRECT,
+    // Starts with a bucket_header, a hashed directory bucket or overflow page.
+    DEFRAG_PAGE_BUCKET
+};
+
+// Everything of one inode that lives in the data region.
+struct defrag_object {
+    bool directory;
+    bool hashed;
+    struct page_map pagemap;
+    // Single indirect page, double indirect page, then the single indirect
+    // pages below it.
+    uint32_t * indirect;
+    uint32_t indirect_count;
+    // Overflow pages of a hashed directory's buckets.
+    uint32_t * overflow;
+    uint32_t overflow_count;
+};
+
+struct defrag_layout {
+    // The data region, [first, first + count).
+    uint32_t first;
+    uint32_t count;
+    // New page for each page of the region, 0 for pages nothing refers to.
+    uint32_t * destination;
+    uint8_t * kind;
+    uint32_t next;
+};
+
+// Holes are skipped, the pages either side of one are adjacent if they are on disk.
+static void defrag_count_extents(const struct page_map * pagemap, struct vfs_fragmentation * fragmentation)
+{
+    uint32_t previous = 0;
+    uint32_t i = 0;
+    for(i = 0; i < pagemap->page_count; ++i)
+    {
+        if(pagemap->pages[i] == 0)
+            continue;
+        if(previous == 0)
+            fragmentation->objects++;
+        if(previous == 0 || pagemap->pages[i] != previous + 1)
+            fragmentation->extents++;
+        fragmentation->pages++;
+        previous = pagemap->pages[i];
+    }
+}
+
+/*
+ * @brief: measures how scattered the pages of files and directories are.
+ *         Indirect pages and overflow pages are not counted as pages, but an
+ *         indirect page placed between two data pages breaks their run.
+ */
+struct vfs_fragmentation vfs_fragmentation(vfs_t vfs)
+{
+    struct vfs_fragmentation fragmentation;
+    memset(&fragmentation, 0, sizeof(fragmentation));
+
+    uint32_t inode_number = 0;
+    for(inode_number = 0; inode_number < vfs->inodes; ++inode_number)
+    {
+        inode_t inode = vfs_get_inode(vfs, (int16_t) inode_number);
+        vfs_inode_read_lock(inode);
+        struct page_map pagemap = build_page_map(vfs, inode);
+        vfs_inode_unlock(inode);
+        vfs_put_inode(vfs, inode);
+
+        defrag_count_extents(&pagemap, &fragmentation);
+        free(pagemap.pages);
+    }
+
+    if(fragmentation.pages > fragmentation.objects)
+        fragmentation.score = (double) (fragmentation.extents - fragmentation.objects)
+                              / (double) (fragmentation.pages - fragmentation.objects);
+    return fragmentation;
+}
+
+static void defrag_collect(vfs_t vfs, inode_t inode, struct defrag_object * object)
+{
+    const uint32_t indirect_entries = VFS_INDIRECT_PAGE_ENTRIES(vfs);
+    memset(object, 0, sizeof(*object));
+    object->directory = (inode->file_flags & VFS_NEW_DIRECTORY_FLAGS) == VFS_NEW_DIRECTORY_FLAGS;
+    object->hashed = object->directory && (inode->file_flags & VFS_HASHED_DIRECTORY_FLAG) != 0;
+    object->pagemap = build_page_map(vfs, inode);
+    // An inline file has nothing to move.
+    if(vfs_inode_is_inline(inode))
+        return;
+
+    uint32_t below = 0;
+    uint32_t page_count = object->pagemap.page_count;
+    if(inode->di_page != 0 && page_count > VFS_DIRECT_PAGE_COUNT + indirect_entries)
+        below = (page_count - VFS_DIRECT_PAGE_COUNT - indirect_entries + indirect_entries - 1) / indirect_entries;
+
+    object->indirect = (uint32_t *) malloc((2 + below) * sizeof(uint32_t));
+    if(inode->si_page != 0)
+        object->indirect[object->indirect_count++] = inode->si_page;
+    if(inode->di_page != 0)
+    {
+        object->indirect[object->indirect_count++] = inode->di_page;
+        vfs_page_read(vfs, inode->di_page, 0, object->indirect + object->indirect_count, below * sizeof(uint32_t));
+
+        // Single indirect pages are missing where a hole spans all they map.
+        uint32_t * below_pages = object->indirect + object->indirect_count;
+        uint32_t i = 0;
+        for(i = 0; i < below; ++i)
+        {
+            if(below_pages[i] != 0)
+                object->indirect[object->indirect_count++] = below_pages[i];
+        }
+    }
+
+    if(!object->hashed)
+        return;
+
+    uint32_t capacity = 0;
+    uint32_t bucket = 0;
+    for(bucket = 0; bucket < page_count; ++bucket)
+    {
+        struct bucket_header header;
+        vfs_page_read(vfs, object->pagemap.pages[bucket], 0, &header, sizeof(header));
+        while(header.overflow_page != 0)
+        {
+            if(object->overflow_count == capacity)
+            {
+                capacity = (capacity < 16) ? 16 : capacity * 2;
+                object->overflow = (uint32_t *) realloc(object->overflow, capacity * sizeof(uint32_t));
+            }
+            object->overflow[object->overflow_count++] = header.overflow_page;
+            vfs_page_read(vfs, header.overflow_page, 0, &header, sizeof(header));
+        }
+    }
+}
+
+static void defrag_place(struct defrag_layout * layout, uint32_t page_number, uint8_t kind)
+{
+    if(page_number < layout->first || page_number - layout->first >= layout->count
+       || layout->destination[page_number - layout->first] != 0)
+    {
+        ERR("A page is outside the data region or in use twice.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    layout->destination[page_number - layout->first] = layout->next++;
+    layout->kind[page_number - layout->first] = kind;
+}
+
+static void defrag_place_pages(struct defrag_layout * layout, const uint32_t * pages, uint32_t count, uint8_t kind)
+{
+    uint32_t i = 0;
+    for(i = 0; i < count; ++i)
+    {
+        // Holes have no page to place.
+        if(pages[i] != 0)
+            defrag_place(layout, pages[i], kind);
+    }
+}
+
+// The new page of a page, pages that do not move or are unknown keep theirs.
+static uint32_t defrag_new_page(const struct defrag_layout * layout, uint32_t page_number)
+{
+    if(page_number < layout->first || page_number - layout->first >= layout->count
+       || layout->destination[page_number - layout->first] == 0)
+        return page_number;
+    return layout->destination[page_number - layout->first];
+}
+
+static void defrag_translate(const struct defrag_layout * layout, uint8_t kind, uint8_t * page, uint32_t page_size)
+{
+    if(kind == DEFRAG_PAGE_INDIRECT)
+    {
+        uint32_t * entries = (uint32_t *) page;
+        uint32_t i = 0;
+        for(i = 0; i < page_size / sizeof(uint32_t); ++i)
+        {
+            if(entries[i] != 0)
+                entries[i] = defrag_new_page(layout, entries[i]);
+        }
+    }
+    else if(kind == DEFRAG_PAGE_BUCKET)
+    {
+        struct bucket_header header;
+        memcpy(&header, page, sizeof(header));
+        if(header.overflow_page != 0)
+            header.overflow_page = defrag_new_page(layout, header.overflow_page);
+        memcpy(page, &header, sizeof(header));
+    }
+}
+
+/*
+ * @brief: moves every page to its new place. Each chain of moves is
+ *         followed from where it starts, reading a page's contents before
+ *         the page is overwritten, until it reaches a page that held nothing
+ *         or whose contents have already moved on.
+ *
+ * @return: number of pages moved.
+ */
+static uint32_t defrag_move_pages(vfs_t vfs, const struct defrag_layout * layout)
+{
+    const uint32_t page_size = vfs->page_size;
+    uint64_t * moved = (uint64_t *) calloc(layout->count / 64 + 1, sizeof(uint64_t));
+    uint8_t * held = (uint8_t *) malloc(page_size);
+    uint8_t * next = (uint8_t *) malloc(page_size);
+    uint32_t pages_moved = 0;
+
+    uint32_t index = 0;
+    for(index = 0; index < layout->count; ++index)
+    {
+        if(layout->destination[index] == 0 || (moved[index / 64] & (1ull << index % 64)) != 0)
+            continue;
+        moved[index / 64] |= 1ull << index % 64;
+
+        uint32_t source = layout->first + index;
+        uint8_t kind = layout->kind[index];
+        if(layout->destination[index] == source && kind == DEFRAG_PAGE_PLAIN)
+            continue;
+
+        vfs_pages_read(vfs, source, 1, held);
+        while(true)
+        {
+            uint32_t target = layout->destination[source - layout->first];
+            uint32_t target_index = target - layout->first;
+            bool occupied = target != source && layout->destination[target_index] != 0
+                            && (moved[target_index / 64] & (1ull << target_index % 64)) == 0;
+            if(occupied)
+                vfs_pages_read(vfs, target, 1, next);
+
+            defrag_translate(layout, kind, held, page_size);
+            vfs_pages_write(vfs, target, 1, held);
+            if(target != source)
+                pages_moved++;
+            if(!occupied)
+                break;
+
+            uint8_t * swap = held;
+            held = next;
+            next = swap;
+            moved[target_index / 64] |= 1ull << target_index % 64;
+            kind = layout->kind[target_index];
+            source = target;
+        }
+    }
+
+    free(held);
+    free(next);
+    free(moved);
+    return pages_moved;
+}
+
+static void defrag_update_inode(vfs_t vfs, const struct defrag_layout * layout, uint16_t inode_number)
+{
+    inode_t inode = vfs_get_inode(vfs, (int16_t) inode_number);
+    vfs_inode_write_lock(inode);
+    if(vfs_inode_is_inline(inode))
+    {
+        vfs_inode_unlock(inode);
+        vfs_put_inode(vfs, inode);
+        return;
+    }
+
+    uint32_t i = 0;
+    for(i = 0; i < VFS_DIRECT_PAGE_COUNT; ++i)
+    {
+        if(inode->d_pages[i] != 0)
+            inode->d_pages[i] = defrag_new_page(layout, inode->d_pages[i]);
+    }
+    if(inode->si_page != 0)
+        inode->si_page = defrag_new_page(layout, inode->si_page);
+    if(inode->di_page != 0)
+        inode->di_page = defrag_new_page(layout, inode->di_page);
+
+    vfs_update_inode(vfs, inode, inode_number);
+    vfs_inode_unlock(inode);
+    vfs_put_inode(vfs, inode);
+}
+
+/*
+ * @brief: rewrites the data region so every file's data, and every group of
+ *         indirect pages, is one contiguous run, with the directories
+ *         together ahead of the file data, and shrinks the image to the
+ *         pages in use.
+ *
+ *         No file or directory may be open and no other thread may use the
+ *         vfs while this runs. Pages are moved in place without the journal,
+ *         an image this is interrupted on is lost, so keep a copy.
+ *
+ * @param report: set to the fragmentation before and after, may be NULL.
+ */
+void vfs_defrag(vfs_t vfs, struct vfs_defrag_report * report)
+{
+    struct vfs_defrag_report local;
+    if(report == NULL)
+        report = &local;
+    memset(report, 0, sizeof(*report));
+
+    // Everything is on disk before pages start moving under the cache.
+    vfs_sync(vfs);
+    report->before = vfs_fragmentation(vfs);
+
+    uint32_t inode_count = vfs->inodes;
+    struct defrag_object * objects = (struct defrag_object *) malloc(inode_count * sizeof(*objects));
+    uint32_t inode_number = 0;
+    for(inode_number = 0; inode_number < inode_count; ++inode_number)
+    {
+        inode_t inode = vfs_get_inode(vfs, (int16_t) inode_number);
+        defrag_collect(vfs, inode, &objects[inode_number]);
+        vfs_put_inode(vfs, inode);
+    }
+
+    struct defrag_layout layout;
+    layout.first = vfs->data_start;
+    layout.count = vfs->pages - vfs->data_start;
+    layout.destination = (uint32_t *) calloc(layout.count, sizeof(uint32_t));
+    layout.kind = (uint8_t *) calloc(layout.count, sizeof(uint8_t));
+    layout.next = vfs->data_start;
+
+    for(inode_number = 0; inode_number < inode_count; inode_number += vfs->inodes_per_page)
+        defrag_place(&layout, vfs_inode_page(vfs, (uint16_t) inode_number), DEFRAG_PAGE_PLAIN);
+    for(inode_number = 0; inode_number < inode_count; ++inode_number)
+    {
+        struct defrag_object * object = &objects[inode_number];
+        if(object->directory)
+        {
+            uint8_t kind = object->hashed ? DEFRAG_PAGE_BUCKET : DEFRAG_PAGE_PLAIN;
+            defrag_place_pages(&layout, object->pagemap.pages, object->pagemap.page_count, kind);
+            defrag_place_pages(&layout, object->overflow, object->overflow_count, DEFRAG_PAGE_BUCKET);
+        }
+        defrag_place_pages(&layout, object->indirect, object->indirect_count, DEFRAG_PAGE_INDIRECT);
+    }
+    for(inode_number = 0; inode_number < inode_count; ++inode_number)
+    {
+        struct defrag_object * object = &objects[inode_number];
+        if(!object->directory)
+            defrag_place_pages(&layout, object->pagemap.pages, object->pagemap.page_count, DEFRAG_PAGE_PLAIN);
+    }
+
+    report->pages_moved = defrag_move_pages(vfs, &layout);
+
+    // The inode pages are found at their new places before any changed
+    // inode is written. Each inode is its own transaction so the changed
+    // inodes are committed as they pile up, not all at once.
+    for(inode_number = 0; inode_number < inode_count; inode_number += vfs->inodes_per_page)
+        vfs_inode_page_move(vfs, (uint16_t) inode_number, defrag_new_page(&layout, vfs_inode_page(vfs, (uint16_t) inode_number)));
+    for(inode_number = 0; inode_number < inode_count; ++inode_number)
+    {
+        vfs_transaction_begin(vfs);
+        defrag_update_inode(vfs, &layout, (uint16_t) inode_number);
+        vfs_transaction_end(vfs);
+    }
+
+    report->pages_released = vfs->pages - layout.next;
+    vfs_free_map_compact(vfs, layout.next);
+    vfs_sync(vfs);
+
+    // Nothing past the last page in use is read again before it is written.
+    struct stat image_stat;
+    if(vfs->map == NULL && fstat(vfs->fd, &image_stat) == 0
+       && (uint64_t) image_stat.st_size > (uint64_t) layout.next * vfs->page_size)
+    {
+        if(ftruncate(vfs->fd, (off_t) layout.next * vfs->page_size) != 0)
+            ERR("Unable to shrink the disk image.");
+    }
+
+    report->after = vfs_fragmentation(vfs);
+
+    for(inode_number = 0; inode_number < inode_count; ++inode_number)
+    {
+        free(objects[inode_number].pagemap.pages);
+        free(objects[inode_number].indirect);
+        free(objects[inode_number].overflow);
+    }
+    free(objects);
+    free(layout.destination);
+    free(layout.kind);
+}
@@ -0,0 +1,29 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include "file.h"
+
+struct vfs_fragmentation {
+    // Files and directories with at least one page.
+    uint32_t objects;
+    uint64_t pages;
+    // Runs of consecutive pages their contents are split into.
+    uint64_t extents;
+    // Share of the steps from one page of a file or directory to the next
+    // that are not to the following page on disk, 0 when every file and
+    // directory is contiguous, 1 when none of their pages are adjacent.
+    double score;
+};
+
+struct vfs_defrag_report {
+    struct vfs_fragmentation before;
+    struct vfs_fragmentation after;
+    uint32_t pages_moved;
+    // Pages the image shrank by, including pages nothing referred to.
+    uint32_t pages_released;
+};
+
+struct vfs_fragmentation vfs_fragmentation(vfs_t vfs);
+void vfs_defrag(vfs_t vfs, struct vfs_defrag_report * report);
+
+#endif
@@ -1,68 +1,91 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include "file.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VFS_X86_SIMD 1
+#endif
+
+/*
+ * @brief: number of pages the data of a file or directory takes, holes
+ *         included. Inline files take none.
+ */
+static uint32_t inode_page_count(vfs_t vfs, inode_t inode)
+{
+    if(vfs_inode_is_inline(inode))
+        return 0;
+    // count full pages, and add an extra page for an unfilled page.
+    return inode->file_size / vfs->page_size + ((inode->file_size % vfs->page_size == 0) ? 0 : 1);
+}
+
 struct page_map build_page_map(vfs_t vfs, inode_t inode)
 {
+    const uint32_t indirect_entries = VFS_INDIRECT_PAGE_ENTRIES(vfs);
     struct page_map pagemap = {};
-    // count full pages, and add an extra page for an unfilled page.
-    pagemap.page_count = inode->file_size / 512 + ((inode->file_size % 512 == 0) ? 0 : 1);
-    pagemap.pages = calloc(pagemap.page_count, sizeof(int16_t));
+    VFS_STATS_ADD(vfs, page_map_builds, 1);
+    pagemap.page_count = inode_page_count(vfs, inode);
+    pagemap.capacity = pagemap.page_count;
+    pagemap.pages = calloc(pagemap.page_count, sizeof(uint32_t));
+    // The page numbers of an inline file hold its data.
+    if(vfs_inode_is_inline(inode))
+        return pagemap;
 
     //printf("page map for %d pages\r\n", pagemap.page_count);
 
     size_t pages_added = 0;
 
     int i = 0;
-    for(i = 0; i < ((pagemap.page_count < 10) ? pagemap.page_count : 10); ++i)
+    for(i = 0; i < ((pagemap.page_count < VFS_DIRECT_PAGE_COUNT) ? pagemap.page_count : VFS_DIRECT_PAGE_COUNT); ++i)
     {
         pagemap.pages[pages_added++] = inode->d_pages[i];
     }
 
-    // TODO add all single indirect pages and double indirect page
+    // A page number of 0 is a hole, and a missing indirect page leaves all
+    // the pages it would map as holes. The map starts out zeroed.
     if (inode->si_page != 0)
     {
         // read in si page.
-        uint16_t si_buffer[VFS_PAGE_SIZE / 2] = {};
-        fseek_w(vfs->vdisk, inode->si_page * VFS_PAGE_SIZE, SEEK_SET);
+        uint8_t * si_page = vfs_page_get(vfs, inode->si_page);
+        uint32_t * si_buffer = (uint32_t *) si_page;
 
-        fread_w(si_buffer, sizeof(*si_buffer), VFS_PAGE_SIZE / 2, vfs->vdisk);
-
-        uint16_t d_page = 0;
-        for(d_page = 0; d_page < pagemap.page_count - 10 && d_page < 256; ++d_page)
+        uint32_t d_page = 0;
+        for(d_page = 0; pages_added < pagemap.page_count && d_page < indirect_entries; ++d_page)
         {
-            // add each direct page number (if it's not zero)
             //printf("build page map si_dpage %d\r\n", si_buffer[d_page]);
-            memcpy(&pagemap.pages[pages_added++], &si_buffer[d_page], sizeof(*pagemap.pages));
+            pagemap.pages[pages_added++] = si_buffer[d_page];
         }
+        vfs_page_put(vfs, si_page, false);
     }
+    if(pagemap.page_count > VFS_DIRECT_PAGE_COUNT)
+        pages_added = (pagemap.page_count < VFS_DIRECT_PAGE_COUNT + indirect_entries) ? pagemap.page_count : VFS_DIRECT_PAGE_COUNT + indirect_entries;
+
     // Add all double indirect pages.
-    bool done = false;
     if (inode->di_page != 0) {
         // read in di_page
-        uint16_t si_pages[VFS_PAGE_SIZE / 2] = {};
-        fseek_w(vfs->vdisk, inode->di_page * VFS_PAGE_SIZE, SEEK_SET);
-        fread_w(si_pages, sizeof(*si_pages), VFS_PAGE_SIZE / 2, vfs->vdisk);
+        uint8_t * di_page = vfs_page_get(vfs, inode->di_page);
+        uint32_t * si_pages = (uint32_t *) di_page;
 
-        uint16_t si_page = 0;
-        for (si_page = 0; si_page < 256 && !done; ++si_page)
+        uint32_t si_page = 0;
+        for (si_page = 0; si_page < indirect_entries && pages_added < pagemap.page_count; ++si_page)
         {
-            // read in si page.
-            uint16_t d_pages[VFS_PAGE_SIZE / 2] = {};
-            fseek_w(vfs->vdisk, si_pages[si_page] * VFS_PAGE_SIZE, SEEK_SET);
-            fread_w(d_pages, sizeof(*d_pages), VFS_PAGE_SIZE / 2, vfs->vdisk);
+            size_t entries = pagemap.page_count - pages_added;
+            if(entries > indirect_entries)
+                entries = indirect_entries;
 
-            uint16_t d_page = 0;
-            for(d_page = 0; d_page < 256 && !done; ++d_page)
+            if(si_pages[si_page] != 0)
             {
-                // add each direct page number (if it's not zero)
-                memcpy(&pagemap.pages[pages_added++], &d_pages[d_page], sizeof(*pagemap.pages));
-                if(pages_added == pagemap.page_count)
-                    done = true;
+                // read in si page.
+                uint8_t * d_page_buffer = vfs_page_get(vfs, si_pages[si_page]);
+                memcpy(pagemap.pages + pages_added, d_page_buffer, entries * sizeof(uint32_t));
+                vfs_page_put(vfs, d_page_buffer, false);
             }
+            pages_added += entries;
         }
+        vfs_page_put(vfs, di_page, false);
     }
     // read double indirect page.
     // read each page of single indirect pages from double indirect.
@@ -71,34 +94,452 @@ struct page_map build_page_map(vfs_t vfs, inode_t inode)
     return pagemap;
 }
 
-uint16_t directory_get_inode_number(directory_t dir, char *entry_name)
+/*
+ * @brief: appends page numbers to the end of a page map, growing its storage
+ *         geometrically. With pages NULL count holes are appended.
+ */
+static void page_map_append(struct page_map * pagemap, uint32_t * pages, uint32_t count)
+{
+    if(pagemap->page_count + count > pagemap->capacity)
+    {
+        uint32_t capacity = (pagemap->capacity < 16) ? 16 : pagemap->capacity * 2;
+        while(capacity < pagemap->page_count + count)
+            capacity *= 2;
+        pagemap->pages = (uint32_t *) realloc(pagemap->pages, capacity * sizeof(*pagemap->pages));
+        pagemap->capacity = capacity;
+    }
+    if(pages != NULL)
+        memcpy(pagemap->pages + pagemap->page_count, pages, count * sizeof(*pages));
+    else
+        memset(pagemap->pages + pagemap->page_count, 0, count * sizeof(*pagemap->pages));
+    pagemap->page_count += count;
+}
+
+static void file_unpin(file_t file, struct pinned_page * pin)
+{
+    if(pin->data != NULL)
+        vfs_page_put(file->vfs, pin->data, pin->dirty);
+    pin->data = NULL;
+    pin->page_number = 0;
+    pin->dirty = false;
+}
+
+static uint32_t * file_pin(file_t file, struct pinned_page * pin, uint32_t page_number)
+{
+    if(pin->data != NULL && pin->page_number != page_number)
+        file_unpin(file, pin);
+    if(pin->data == NULL)
+    {
+        pin->data = vfs_page_get(file->vfs, page_number);
+        pin->page_number = page_number;
+    }
+    return (uint32_t *) pin->data;
+}
+
+/*
+ * @brief: rebuilds the page map of a file if another handle sharing its inode
+ *         changed the file size since the map was built.
+ */
+static void file_refresh_page_map(file_t file)
+{
+    if(file->pagemap.page_count == inode_page_count(file->vfs, file->inode))
+        return;
+
+    free(file->pagemap.pages);
+    file->pagemap = build_page_map(file->vfs, file->inode);
+}
+
+/*
+ * @brief: returns the disk page holding page index of a file or directory,
+ *         reading at most the indirect pages on the way to it.
+ */
+static uint32_t inode_page_number(vfs_t vfs, inode_t inode, uint32_t index)
+{
+    const uint32_t indirect_entries = VFS_INDIRECT_PAGE_ENTRIES(vfs);
+    uint32_t page_number = 0;
+    if(index < VFS_DIRECT_PAGE_COUNT)
+        return inode->d_pages[index];
+
+    index -= VFS_DIRECT_PAGE_COUNT;
+    if(index < indirect_entries)
+    {
+        vfs_page_read(vfs, inode->si_page, index * sizeof(page_number), &page_number, sizeof(page_number));
+        return page_number;
+    }
+
+    index -= indirect_entries;
+    vfs_page_read(vfs, inode->di_page, (index / indirect_entries) * sizeof(page_number), &page_number, sizeof(page_number));
+    vfs_page_read(vfs, page_number, (index % indirect_entries) * sizeof(page_number), &page_number, sizeof(page_number));
+    return page_number;
+}
+
+/*
+ * @brief: records page_number as page index of a file or directory,
+ *         allocating indirect pages as needed.
+ */
+static void inode_map_page(vfs_t vfs, inode_t inode, uint32_t index, uint32_t page_number)
 {
-    // create a page map.
-    struct page_map pagemap = build_page_map(dir->vfs, dir->inode);
+    const uint32_t indirect_entries = VFS_INDIRECT_PAGE_ENTRIES(vfs);
+    if(index < VFS_DIRECT_PAGE_COUNT)
+    {
+        inode->d_pages[index] = page_number;
+        return;
+    }
 
+    index -= VFS_DIRECT_PAGE_COUNT;
+    if(index < indirect_entries)
+    {
+        if(inode->si_page == 0)
+            inode->si_page = vfs_allocate_new_page(vfs);
+        vfs_page_write(vfs, inode->si_page, index * sizeof(page_number), &page_number, sizeof(page_number));
+        return;
+    }
+
+    index -= indirect_entries;
+    if(inode->di_page == 0)
+        inode->di_page = vfs_allocate_new_page(vfs);
+
+    uint32_t si_page = 0;
+    uint32_t di_offset = (index / indirect_entries) * sizeof(si_page);
+    vfs_page_read(vfs, inode->di_page, di_offset, &si_page, sizeof(si_page));
+    if(si_page == 0)
+    {
+        si_page = vfs_allocate_new_page(vfs);
+        vfs_page_write(vfs, inode->di_page, di_offset, &si_page, sizeof(si_page));
+    }
+    vfs_page_write(vfs, si_page, (index % indirect_entries) * sizeof(page_number), &page_number, sizeof(page_number));
+}
+
+/*
+ * Directory page matching. The key is laid out like a directory entry, with
+ * the name zero padded to VFS_DIRECTORY_NAME_LENGTH, so a match is a 30 byte
+ * equality test on the name field. The inode bytes of the key are ignored.
+ */
+#define DIRECTORY_NAME_MASK (~(uint32_t) 0 << sizeof(uint16_t))
+
+static int directory_page_match_scalar(const uint8_t * page, int first, int last, const uint8_t * key)
+{
+    int j = 0;
+    for(j = first; j < last; ++j)
+    {
+        if(memcmp(page + j * VFS_DIRECTORY_ENTRY_SIZE + sizeof(uint16_t), key + sizeof(uint16_t), VFS_DIRECTORY_NAME_LENGTH) == 0)
+            return j;
+    }
+    return -1;
+}
+
+#ifdef VFS_X86_SIMD
+static int directory_page_match_sse2(const uint8_t * page, int first, int last, const uint8_t * key)
+{
+    const __m128i key_low = _mm_loadu_si128((const __m128i *) key);
+    const __m128i key_high = _mm_loadu_si128((const __m128i *) (key + 16));
+
+    int j = 0;
+    for(j = first; j < last; ++j)
+    {
+        const uint8_t * entry = page + j * VFS_DIRECTORY_ENTRY_SIZE;
+        uint32_t low = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) entry), key_low));
+        uint32_t high = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (entry + 16)), key_high));
+        if(((low | high << 16) & DIRECTORY_NAME_MASK) == DIRECTORY_NAME_MASK)
+            return j;
+    }
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static int directory_page_match_avx2(const uint8_t * page, int first, int last, const uint8_t * key)
+{
+    const __m256i key_entry = _mm256_loadu_si256((const __m256i *) key);
+
+    int j = 0;
+    for(j = first; j < last; ++j)
+    {
+        __m256i entry = _mm256_loadu_si256((const __m256i *) (page + j * VFS_DIRECTORY_ENTRY_SIZE));
+        uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(entry, key_entry));
+        if((equal & DIRECTORY_NAME_MASK) == DIRECTORY_NAME_MASK)
+            return j;
+    }
+    return -1;
+}
+#endif
+
+static int (* directory_page_match_best)(const uint8_t *, int, int, const uint8_t *) = NULL;
+static pthread_once_t directory_page_match_once = PTHREAD_ONCE_INIT;
+
+static void directory_page_match_select(void)
+{
+    directory_page_match_best = directory_page_match_scalar;
+#ifdef VFS_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        directory_page_match_best = directory_page_match_avx2;
+    else if(__builtin_cpu_supports("sse2"))
+        directory_page_match_best = directory_page_match_sse2;
+#endif
+}
+
+/*
+ * @brief: returns the first slot in [first, last) of a directory page whose
+ *         name equals the key, or -1. Uses the widest compare the CPU has.
+ */
+static int directory_page_match(const uint8_t * page, int first, int last, const uint8_t * key)
+{
+    pthread_once(&directory_page_match_once, directory_page_match_select);
+    return directory_page_match_best(page, first, last, key);
+}
+
+static void directory_make_key(uint8_t * key, const char * entry_name)
+{
+    memset(key, 0, VFS_DIRECTORY_ENTRY_SIZE);
+    memcpy(key + sizeof(uint16_t), entry_name, strnlen(entry_name, VFS_DIRECTORY_NAME_LENGTH));
+}
+
+uint32_t directory_name_hash(const char * name)
+{
+    // FNV-1a over the stored part of the name.
+    uint32_t hash = 2166136261u;
     int i = 0;
-    for(i = 0; i < pagemap.page_count; ++i) {
-        fseek_w(dir->vfs->vdisk, pagemap.pages[i] * VFS_PAGE_SIZE, SEEK_SET);
-
-        int j = 0;
-        for(j = 0; j < 16; ++j) {
-            uint16_t read_inode = 0;
-            char  name[31] = {};
-            fread_w(&read_inode, sizeof(read_inode), 1, dir->vfs->vdisk);
-            fread_w(name, sizeof(*name), sizeof(name), dir->vfs->vdisk);
-
-            if(strncmp(entry_name, name, sizeof(name)-1) == 0) {
-                return read_inode;
-            }
+    for(i = 0; i < VFS_DIRECTORY_NAME_LENGTH && name[i] != '\0'; ++i)
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+    return hash;
+}
+
+/*
+ * @brief: linear hashing address of a name in a directory of bucket_count
+ *         buckets. Buckets below the split point have already been split and
+ *         use one more bit of the hash.
+ */
+uint32_t directory_bucket(uint32_t hash, uint32_t bucket_count)
+{
+    uint32_t level_size = 1u << (31 - __builtin_clz(bucket_count));
+    uint32_t split = bucket_count - level_size;
+
+    uint32_t bucket = hash & (level_size - 1);
+    if(bucket < split)
+        bucket = hash & (level_size * 2 - 1);
+    return bucket;
+}
+
+static uint16_t hashed_directory_lookup(vfs_t vfs, inode_t directory_inode, const char * entry_name)
+{
+    uint32_t bucket = directory_bucket(directory_name_hash(entry_name), directory_inode->file_size / vfs->page_size);
+    uint32_t page_number = inode_page_number(vfs, directory_inode, bucket);
+
+    uint8_t key[VFS_DIRECTORY_ENTRY_SIZE];
+    directory_make_key(key, entry_name);
+
+    while(page_number != 0)
+    {
+        uint8_t * page = vfs_page_get(vfs, page_number);
+        struct bucket_header header;
+        memcpy(&header, page, sizeof(header));
+        VFS_STATS_ADD(vfs, directory_pages_scanned, 1);
+
+        int j = directory_page_match(page, 1, header.count + 1, key);
+        if(j >= 0)
+        {
+            uint16_t inode_number = 0;
+            memcpy(&inode_number, page + j * VFS_DIRECTORY_ENTRY_SIZE, sizeof(inode_number));
+            vfs_page_put(vfs, page, false);
+            return inode_number;
         }
+
+        vfs_page_put(vfs, page, false);
+        page_number = header.overflow_page;
     }
     return 0;
 }
 
+/*
+ * @brief: stores a directory entry in the first free slot of a bucket's page
+ *         chain, adding an overflow page when the chain is full.
+ */
+static void hashed_directory_insert(vfs_t vfs, inode_t directory_inode, uint32_t bucket, uint8_t * entry)
+{
+    uint32_t page_number = inode_page_number(vfs, directory_inode, bucket);
+    while(true)
+    {
+        uint8_t * page = vfs_page_get(vfs, page_number);
+        struct bucket_header header;
+        memcpy(&header, page, sizeof(header));
+
+        if(header.count < VFS_BUCKET_ENTRIES(vfs))
+        {
+            header.count++;
+            memcpy(page + header.count * VFS_DIRECTORY_ENTRY_SIZE, entry, VFS_DIRECTORY_ENTRY_SIZE);
+            memcpy(page, &header, sizeof(header));
+            vfs_page_put(vfs, page, true);
+            return;
+        }
+
+        if(header.overflow_page == 0)
+        {
+            header.overflow_page = vfs_allocate_new_page(vfs);
+            memcpy(page, &header, sizeof(header));
+            vfs_page_put(vfs, page, true);
+        }
+        else
+        {
+            vfs_page_put(vfs, page, false);
+        }
+        page_number = header.overflow_page;
+    }
+}
+
+/*
+ * @brief: adds the next bucket and moves into it the entries of the bucket
+ *         it splits from.
+ */
+static void hashed_directory_split(directory_t dir)
+{
+    vfs_t vfs = dir->vfs;
+    uint32_t bucket_count = dir->inode->file_size / vfs->page_size;
+    uint32_t level_size = 1u << (31 - __builtin_clz(bucket_count));
+    uint32_t split = bucket_count - level_size;
+
+    inode_map_page(vfs, dir->inode, bucket_count, vfs_allocate_new_page(vfs));
+    dir->inode->file_size += vfs->page_size;
+
+    // Take every entry out of the bucket being split, releasing its overflow pages.
+    uint32_t entry_count = 0;
+    uint32_t entry_capacity = VFS_BUCKET_ENTRIES(vfs);
+    uint8_t * entries = (uint8_t *) malloc(entry_capacity * VFS_DIRECTORY_ENTRY_SIZE);
+
+    uint32_t bucket_page = inode_page_number(vfs, dir->inode, split);
+    uint32_t page_number = bucket_page;
+    while(page_number != 0)
+    {
+        uint8_t * page = vfs_page_get(vfs, page_number);
+        struct bucket_header header;
+        memcpy(&header, page, sizeof(header));
+
+        if(entry_count + header.count > entry_capacity)
+        {
+            entry_capacity = (entry_count + header.count) * 2;
+            entries = (uint8_t *) realloc(entries, entry_capacity * VFS_DIRECTORY_ENTRY_SIZE);
+        }
+        memcpy(entries + entry_count * VFS_DIRECTORY_ENTRY_SIZE, page + VFS_DIRECTORY_ENTRY_SIZE, header.count * VFS_DIRECTORY_ENTRY_SIZE);
+        entry_count += header.count;
+
+        if(page_number == bucket_page)
+        {
+            // Keep the bucket page, and the directory entry count if this is bucket 0.
+            struct bucket_header empty = { .count = 0, .overflow_page = 0, .entries = header.entries };
+            memset(page, 0, vfs->page_size);
+            memcpy(page, &empty, sizeof(empty));
+            vfs_page_put(vfs, page, true);
+        }
+        else
+        {
+            vfs_page_put(vfs, page, false);
+            vfs_page_free_unmark(vfs, page_number);
+        }
+        page_number = header.overflow_page;
+    }
+
+    uint32_t i = 0;
+    for(i = 0; i < entry_count; ++i)
+    {
+        uint8_t * entry = entries + i * VFS_DIRECTORY_ENTRY_SIZE;
+        char name[VFS_DIRECTORY_NAME_LENGTH + 1] = {};
+        memcpy(name, entry + sizeof(uint16_t), VFS_DIRECTORY_NAME_LENGTH);
+        uint32_t bucket = directory_name_hash(name) & (level_size * 2 - 1);
+        hashed_directory_insert(vfs, dir->inode, bucket, entry);
+    }
+
+    free(entries);
+}
+
+static void hashed_directory_add(directory_t dir, uint8_t * entry)
+{
+    vfs_t vfs = dir->vfs;
+    char name[VFS_DIRECTORY_NAME_LENGTH + 1] = {};
+    memcpy(name, entry + sizeof(uint16_t), VFS_DIRECTORY_NAME_LENGTH);
+
+    uint32_t bucket_count = dir->inode->file_size / vfs->page_size;
+    hashed_directory_insert(vfs, dir->inode, directory_bucket(directory_name_hash(name), bucket_count), entry);
+
+    // The directory wide entry count lives in the header of bucket 0.
+    struct bucket_header header;
+    uint32_t first_bucket = inode_page_number(vfs, dir->inode, 0);
+    vfs_page_read(vfs, first_bucket, 0, &header, sizeof(header));
+    header.entries++;
+    vfs_page_write(vfs, first_bucket, 0, &header, sizeof(header));
+
+    if(header.entries > bucket_count * VFS_BUCKET_SPLIT_LOAD)
+        hashed_directory_split(dir);
+}
+
+/*
+ * @brief: finds the inode number of entry_name in a directory. Results,
+ *         including names that do not exist, are kept in the dentry cache so
+ *         repeated lookups need no directory pages.
+ *
+ * @return: inode number of the entry, 0 if there is none.
+ */
+static uint16_t directory_lookup(vfs_t vfs, uint16_t directory_inode_number, const char * entry_name)
+{
+    uint16_t inode_number = 0;
+    if(vfs_dentry_lookup(vfs, directory_inode_number, entry_name, &inode_number))
+        return inode_number;
+
+    // The result is cached before the directory is unlocked, so a negative
+    // entry can not replace the entry of a name added in the meantime.
+    inode_t directory_inode = vfs_get_inode(vfs, directory_inode_number);
+    vfs_inode_read_lock(directory_inode);
+    if((directory_inode->file_flags & VFS_HASHED_DIRECTORY_FLAG) != 0)
+    {
+        inode_number = hashed_directory_lookup(vfs, directory_inode, entry_name);
+        vfs_dentry_insert(vfs, directory_inode_number, entry_name, inode_number);
+        vfs_inode_unlock(directory_inode);
+        vfs_put_inode(vfs, directory_inode);
+        return inode_number;
+    }
+
+    struct page_map pagemap = build_page_map(vfs, directory_inode);
+    uint32_t entry_count = directory_inode->file_size / VFS_DIRECTORY_ENTRY_SIZE;
+    const uint32_t entries_per_page = vfs->page_size / VFS_DIRECTORY_ENTRY_SIZE;
+
+    uint8_t key[VFS_DIRECTORY_ENTRY_SIZE];
+    directory_make_key(key, entry_name);
+
+    bool found = false;
+    int i = 0;
+    for(i = 0; i < pagemap.page_count && !found; ++i) {
+        uint8_t * page = vfs_page_get(vfs, pagemap.pages[i]);
+
+        // match the whole page at once, the last page may be partly filled.
+        uint32_t page_entries = entry_count - i * entries_per_page;
+        if(page_entries > entries_per_page)
+            page_entries = entries_per_page;
+
+        int j = directory_page_match(page, 0, page_entries, key);
+        VFS_STATS_ADD(vfs, directory_pages_scanned, 1);
+        if(j >= 0) {
+            memcpy(&inode_number, page + j * VFS_DIRECTORY_ENTRY_SIZE, sizeof(inode_number));
+            found = true;
+        }
+        vfs_page_put(vfs, page, false);
+    }
+
+    free(pagemap.pages);
+
+    vfs_dentry_insert(vfs, directory_inode_number, entry_name, inode_number);
+    vfs_inode_unlock(directory_inode);
+    vfs_put_inode(vfs, directory_inode);
+    return inode_number;
+}
+
+uint16_t directory_get_inode_number(directory_t dir, char *entry_name)
+{
+    return directory_lookup(dir->vfs, dir->inode_number, entry_name);
+}
+
 
 directory_t directory_open(vfs_t vfs, char * directory_path)
 {
     directory_t dir = (directory_t) malloc(sizeof(struct directory));
+    uint8_t origin = vfs_trace_enter(VFS_TRACE_ORIGIN_DIRECTORY_OPEN);
     // Stuff that doesn't change with loop.
     dir->vfs = vfs;
     dir->path = (char *) calloc(strlen(directory_path) + 1, sizeof(char));
@@ -108,61 +549,35 @@ directory_t directory_open(vfs_t vfs, char * directory_path)
     // Stuff that changes with loop.
     char * token = strtok(directory_path, "/");
     uint16_t current_inode = 0;
-    inode_t current_dir = vfs_get_inode(vfs, current_inode);
-    struct page_map current_dir_page_map = build_page_map(dir->vfs, current_dir);
     while(token != NULL)
     {
         memset(dir->name, 0, 31);
-        memcpy(dir->name, token, strlen(token));
+        memcpy(dir->name, token, strnlen(token, 30));
 
-        bool found = false;
-
-        // search in the pages of current_dir for
-        int i = 0;
-        for(i = 0; i < current_dir_page_map.page_count && !found; ++i) {
-            // Read page at pages[i]
-            fseek_w(vfs->vdisk, current_dir_page_map.pages[i] * VFS_PAGE_SIZE, SEEK_SET);
-
-            // read each entry in the page.
-            int j = 0;
-            for(j = 0; j < 16 && !found; ++j)
-            {
-                uint16_t read_inode = 0;
-                char  name[31] = {};
-                fread_w(&read_inode, sizeof(read_inode), 1, vfs->vdisk);
-                fread_w(name, sizeof(*name), sizeof(name)-1, vfs->vdisk);
-
-                // compare name with token
-                if(strncmp(token, name, strlen(token)) == 0) {
-                    found = true;
-                    current_inode = read_inode;
-                    current_dir = vfs_get_inode(vfs, current_inode);
-                    free(current_dir_page_map.pages);
-                    current_dir_page_map = build_page_map(vfs, current_dir);
-                }
-            }
-        }
         // the entry matching token
         // if found update current dir
+        uint16_t found_inode = directory_lookup(vfs, current_inode, token);
+        if(found_inode != 0)
+            current_inode = found_inode;
 
         token = strtok(NULL, "/");
     }
 
     dir->inode_number = current_inode;
-    dir->inode = current_dir;
+    dir->inode = vfs_get_inode(vfs, current_inode);
 
-    free(current_dir_page_map.pages);
+    vfs_trace_leave(origin);
     return dir;
 }
 
 void directory_close(directory_t dir)
 {
-    dir->vfs = NULL;
-
     if(dir->inode != NULL)
-        free(dir->inode);
+        vfs_put_inode(dir->vfs, dir->inode);
     dir->inode = NULL;
 
+    dir->vfs = NULL;
+
     dir->inode_number = 0;
 
     if(dir->name != NULL)
@@ -176,46 +591,79 @@ void directory_close(directory_t dir)
     free(dir);
 }
 
-void directory_add_directory(directory_t parent_dir, directory_t dir)
+/*
+ * @brief: appends a (inode number, name) entry to the directory.
+ */
+static void directory_add_entry(directory_t dir, uint16_t inode_number, char * name)
 {
-    struct page_map page_map = build_page_map(parent_dir->vfs, parent_dir->inode);
+    uint8_t entry[VFS_DIRECTORY_ENTRY_SIZE] = {};
+    memcpy(entry, &inode_number, sizeof(inode_number));
+    memcpy(entry + sizeof(inode_number), name, strnlen(name, VFS_DIRECTORY_NAME_LENGTH));
 
-    // can we hold the entry in the number of pages we have?
-    if (parent_dir->inode->file_size < page_map.page_count * VFS_PAGE_SIZE)
+    vfs_inode_write_lock(dir->inode);
+    if((dir->inode->file_flags & VFS_HASHED_DIRECTORY_FLAG) != 0)
     {
-        // we got room
-        // write the directory entry with the inode number and file name
-        fseek_w(parent_dir->vfs->vdisk, page_map.pages[page_map.page_count - 1] * VFS_PAGE_SIZE + parent_dir->inode->file_size, SEEK_SET);
-        fwrite_w(&dir->inode_number, sizeof(dir->inode_number), 1, parent_dir->vfs->vdisk);
-        fwrite_w(dir->name, sizeof(*dir->name), 30, parent_dir->vfs->vdisk);
+        hashed_directory_add(dir, entry);
     }
     else
     {
-        // we need room
-        uint16_t new_page = vfs_allocate_new_page(parent_dir->vfs);
+        uint32_t page_index = dir->inode->file_size / dir->vfs->page_size;
 
-        fseek_w(parent_dir->vfs->vdisk, new_page * VFS_PAGE_SIZE + (parent_dir->inode->file_size / 32) % 16, SEEK_SET);
+        // can we hold the entry in the number of pages we have?
+        if (dir->inode->file_size % dir->vfs->page_size != 0)
+        {
+            // we got room
+            // write the directory entry with the inode number and file name
+            vfs_page_write(dir->vfs, inode_page_number(dir->vfs, dir->inode, page_index), dir->inode->file_size % dir->vfs->page_size, entry, sizeof(entry));
+        }
+        else
+        {
+            // we need room
+            uint32_t new_page = vfs_allocate_new_page(dir->vfs);
 
-        fwrite_w(&dir->inode_number, sizeof(dir->inode_number), 1, parent_dir->vfs->vdisk);
+            vfs_page_write(dir->vfs, new_page, 0, entry, sizeof(entry));
 
-        fwrite_w(dir->name, sizeof(*dir->name), 30, parent_dir->vfs->vdisk);
+            inode_map_page(dir->vfs, dir->inode, page_index, new_page);
+        }
 
-        parent_dir->inode->d_pages[parent_dir->inode->file_size / 16] = new_page;
+        dir->inode->file_size += VFS_DIRECTORY_ENTRY_SIZE;
     }
 
-    parent_dir->inode->file_size += 32;
-    vfs_update_inode(parent_dir->vfs, parent_dir->inode, parent_dir->inode_number);
+    vfs_update_inode(dir->vfs, dir->inode, dir->inode_number);
+
+    // Replaces a negative entry for the name if there was one.
+    vfs_dentry_insert(dir->vfs, dir->inode_number, name, inode_number);
+    vfs_inode_unlock(dir->inode);
 }
 
-directory_t directory_create(vfs_t vfs, char * directory_path)
+void directory_add_directory(directory_t parent_dir, directory_t dir)
+{
+    uint8_t origin = vfs_trace_enter(VFS_TRACE_ORIGIN_DIRECTORY_ADD);
+    vfs_transaction_begin(parent_dir->vfs);
+    directory_add_entry(parent_dir, dir->inode_number, dir->name);
+    vfs_transaction_end(parent_dir->vfs);
+    vfs_trace_leave(origin);
+}
+
+static directory_t directory_create_with_flags(vfs_t vfs, char * directory_path, int32_t flags)
 {
     directory_t dir = (directory_t) malloc(sizeof(struct directory));
     dir->vfs = vfs;
+    uint8_t origin = vfs_trace_enter(VFS_TRACE_ORIGIN_DIRECTORY_CREATE);
+    vfs_transaction_begin(vfs);
     // create and store new inode
-    dir->inode_number =  vfs_new_dir_inode(vfs);
+    dir->inode_number =  vfs_new_inode(vfs, flags);
     // get inode
     dir->inode = vfs_get_inode(vfs, dir->inode_number);
 
+    if((flags & VFS_HASHED_DIRECTORY_FLAG) != 0)
+    {
+        // A hashed directory always has at least bucket 0.
+        inode_map_page(vfs, dir->inode, 0, vfs_allocate_new_page(vfs));
+        dir->inode->file_size = vfs->page_size;
+        vfs_update_inode(vfs, dir->inode, dir->inode_number);
+    }
+
     // parse filepath
     // build directory path
     // get filename
@@ -252,56 +700,54 @@ directory_t directory_create(vfs_t vfs, char * directory_path)
     // add directory entry
     directory_t parent_dir = directory_open(vfs, absolute_path);
 
-    directory_add_directory(parent_dir, dir);
+    directory_add_entry(parent_dir, dir->inode_number, dir->name);
 
     directory_close(parent_dir);
+    free(absolute_path);
+    vfs_transaction_end(vfs);
+    vfs_trace_leave(origin);
 
     return dir;
 }
 
-void directory_add_file(directory_t dir, file_t file)
+directory_t directory_create(vfs_t vfs, char * directory_path)
 {
-    struct page_map page_map = build_page_map(dir->vfs, dir->inode);
-
-    // can we hold the entry in the number of pages we have?
-    if (dir->inode->file_size < page_map.page_count * VFS_PAGE_SIZE)
-    {
-        // we got room
-        // write the directory entry with the inode number and file name
-        fseek_w(dir->vfs->vdisk, page_map.pages[page_map.page_count - 1] * VFS_PAGE_SIZE + dir->inode->file_size, SEEK_SET);
-
-        fwrite_w(&file->inode_number, sizeof(file->inode_number), 1, dir->vfs->vdisk);
-
-        fwrite_w(file->name, sizeof(*file->name), 30, dir->vfs->vdisk);
-    }
-    else
-    {
-        // we need room
-        uint16_t new_page = vfs_allocate_new_page(dir->vfs);
-
-        fseek_w(dir->vfs->vdisk, new_page * VFS_PAGE_SIZE + (dir->inode->file_size / 32) % 16, SEEK_SET);
-
-        fwrite_w(&file->inode_number, sizeof(file->inode_number), 1, dir->vfs->vdisk);
-
-        fwrite_w(file->name, sizeof(*file->name), 30, dir->vfs->vdisk);
+    return directory_create_with_flags(vfs, directory_path, VFS_NEW_DIRECTORY_FLAGS);
+}
 
-        dir->inode->d_pages[dir->inode->file_size / 16] = new_page;
-    }
+/*
+ * @brief: creates a directory that keeps its entries in hashed buckets, so a
+ *         lookup reads about one page however many entries it holds.
+ */
+directory_t directory_create_hashed(vfs_t vfs, char * directory_path)
+{
+    return directory_create_with_flags(vfs, directory_path, VFS_NEW_HASHED_DIRECTORY_FLAGS);
+}
 
-    dir->inode->file_size += 32;
-    vfs_update_inode(dir->vfs, dir->inode, dir->inode_number);
+void directory_add_file(directory_t dir, file_t file)
+{
+    uint8_t origin = vfs_trace_enter(VFS_TRACE_ORIGIN_DIRECTORY_ADD);
+    vfs_transaction_begin(dir->vfs);
+    directory_add_entry(dir, file->inode_number, file->name);
+    vfs_transaction_end(dir->vfs);
+    vfs_trace_leave(origin);
 }
 
 file_t file_create(vfs_t vfs, char * file_path)
 {
-    file_t new_file = (file_t) malloc(sizeof(struct file));
+    uint64_t start_ns = vfs_stats_start(VFS_STATS_FILE_CREATE);
+    uint8_t origin = vfs_trace_enter(VFS_TRACE_ORIGIN_FILE_CREATE);
+    file_t new_file = (file_t) calloc(1, sizeof(struct file));
     new_file->vfs = vfs;
+    vfs_transaction_begin(vfs);
     // create and store new inode
     new_file->inode_number =  vfs_new_file_inode(vfs);
     // get inode
     new_file->inode = vfs_get_inode(vfs, new_file->inode_number);
     // Reset file cursor
     new_file->pagemap = build_page_map(new_file->vfs, new_file->inode);
+    new_file->readahead.max_pages = vfs->readahead_pages;
+    new_file->write_buffer.limit = vfs->write_buffer_size;
     new_file->cursor_page = 0;
     new_file->cursor_page_pos = 0;
 
@@ -341,14 +787,19 @@ file_t file_create(vfs_t vfs, char * file_path)
     // add directory entry
     directory_t parent_dir = directory_open(vfs, absolute_path);
 
-    directory_add_file(parent_dir, new_file);
+    directory_add_entry(parent_dir, new_file->inode_number, new_file->name);
 
     directory_close(parent_dir);
+    vfs_transaction_end(vfs);
+    vfs_trace_leave(origin);
+    vfs_stats_end(vfs, VFS_STATS_FILE_CREATE, start_ns);
     return new_file;
 }
 
 file_t file_open(vfs_t vfs, char * file_path)
 {
+    uint64_t start_ns = vfs_stats_start(VFS_STATS_FILE_OPEN);
+    uint8_t origin = vfs_trace_enter(VFS_TRACE_ORIGIN_FILE_OPEN);
     file_t file = (file_t) calloc(1, sizeof(struct file));
     file->vfs = vfs;
 
@@ -398,231 +849,710 @@ file_t file_open(vfs_t vfs, char * file_path)
     if(file->inode_number == 0)
     {
         file_close(file);
+        vfs_trace_leave(origin);
+        vfs_stats_end(vfs, VFS_STATS_FILE_OPEN, start_ns);
         return NULL;
     }
 
     file->inode = vfs_get_inode(vfs, file->inode_number);
+    vfs_inode_read_lock(file->inode);
     file->pagemap = build_page_map(file->vfs, file->inode);
+    vfs_inode_unlock(file->inode);
     file->cursor_page = 0;
     file->cursor_page_pos = 0;
+    file->readahead.max_pages = vfs->readahead_pages;
+    file->write_buffer.limit = vfs->write_buffer_size;
 
+    vfs_trace_leave(origin);
+    vfs_stats_end(vfs, VFS_STATS_FILE_OPEN, start_ns);
     return file;
 }
 
-void file_close(file_t file)
+/*
+ * @brief: records page numbers for pages [page_index, page_index + count) of
+ *         the file in the inode and its indirect pages, allocating indirect
+ *         pages as needed. The indirect pages stay pinned in the file so
+ *         repeated appends do not look them up again.
+ */
+static void file_map_pages(file_t file, uint32_t page_index, uint32_t * pages, uint32_t count)
 {
-    file->vfs = NULL;
+    vfs_t vfs = file->vfs;
+    const uint32_t indirect_entries = VFS_INDIRECT_PAGE_ENTRIES(vfs);
 
-    if(file->name != NULL)
-        free(file->name);
-    file->name = NULL;
+    uint32_t i = 0;
+    while(i < count)
+    {
+        uint32_t index = page_index + i;
+        if(index < VFS_DIRECT_PAGE_COUNT)
+        {
+            file->inode->d_pages[index] = pages[i++];
+            continue;
+        }
 
-    file->pagemap.page_count = 0;
-    if(file->pagemap.pages != NULL)
-        free(file->pagemap.pages);
-    file->cursor_page_pos = 0;
-    file->cursor_page = 0;
+        struct pinned_page * pin = NULL;
+        uint32_t si_offset = 0;
+        if(index < VFS_DIRECT_PAGE_COUNT + indirect_entries)
+        {
+            if(file->inode->si_page == 0)
+                file->inode->si_page = vfs_allocate_new_page(vfs);
+            file_pin(file, &file->si, file->inode->si_page);
+            pin = &file->si;
+            si_offset = index - VFS_DIRECT_PAGE_COUNT;
+        }
+        else
+        {
+            if(file->inode->di_page == 0)
+                file->inode->di_page = vfs_allocate_new_page(vfs);
+            uint32_t * si_pages = file_pin(file, &file->di, file->inode->di_page);
 
-    file->inode_number = 0;
+            uint32_t di_offset = (index - VFS_DIRECT_PAGE_COUNT - indirect_entries) / indirect_entries;
+            if(si_pages[di_offset] == 0)
+            {
+                si_pages[di_offset] = vfs_allocate_new_page(vfs);
+                file->di.dirty = true;
+            }
+            file_pin(file, &file->di_si, si_pages[di_offset]);
+            pin = &file->di_si;
+            si_offset = (index - VFS_DIRECT_PAGE_COUNT - indirect_entries) % indirect_entries;
+        }
 
-    if(file->inode != NULL)
-        free(file->inode);
-    file->inode = NULL;
+        uint32_t entries = indirect_entries - si_offset;
+        if(entries > count - i)
+            entries = count - i;
 
-    if(file->path != NULL)
-        free(file->path);
-    file->path = NULL;
+        memcpy((uint32_t *) pin->data + si_offset, &pages[i], entries * sizeof(*pages));
+        pin->dirty = true;
+        i += entries;
+    }
+}
 
-    free(file);
+static uint64_t file_position(file_t file)
+{
+    return (uint64_t) file->cursor_page * file->vfs->page_size + file->cursor_page_pos;
 }
 
-size_t file_write(void * buffer, size_t elem_size, size_t num_elems, file_t file)
+static void file_advance(file_t file, size_t bytes)
 {
-    size_t buffer_size = elem_size * num_elems;
+    uint64_t position = file_position(file) + bytes;
+    file->cursor_page = position / file->vfs->page_size;
+    file->cursor_page_pos = position % file->vfs->page_size;
+}
 
-    uint32_t file_page_count = file->inode->file_size / 512;
-    uint32_t file_end_offset = file->inode->file_size % VFS_PAGE_SIZE;
+/*
+ * @brief: grows the file to size without allocating anything, the pages
+ *         after the old end of the file are holes. Callers hold the inode
+ *         lock exclusively.
+ */
+static void file_leave_hole(file_t file, uint32_t size)
+{
+    const uint32_t page_size = file->vfs->page_size;
+    uint32_t page_count = size / page_size + ((size % page_size == 0) ? 0 : 1);
+    if(page_count > file->pagemap.page_count)
+        page_map_append(&file->pagemap, NULL, page_count - file->pagemap.page_count);
+    file->inode->file_size = size;
+}
+
+/*
+ * @brief: moves the data of an inline file to a page of its own so it can
+ *         grow past VFS_INLINE_DATA_SIZE. Callers hold the inode lock
+ *         exclusively.
+ */
+static void file_inline_spill(file_t file)
+{
+    vfs_t vfs = file->vfs;
+
+    // The page is written whole, it is not zeroed when allocated.
+    uint32_t allocated = 0;
+    uint32_t page_number = vfs_allocate_pages(vfs, 1, &allocated);
+    uint8_t * page = (uint8_t *) calloc(1, vfs->page_size);
+    memcpy(page, vfs_inode_inline_data(file->inode), file->inode->file_size);
+    vfs_pages_write(vfs, page_number, 1, page);
+    free(page);
+
+    memset(vfs_inode_inline_data(file->inode), 0, VFS_INLINE_DATA_SIZE);
+    file->inode->file_flags &= ~VFS_INLINE_DATA_FLAG;
+    file->inode->d_pages[0] = page_number;
+    page_map_append(&file->pagemap, &page_number, 1);
+}
+
+/*
+ * @brief: appends the buffer to the end of the file. A partly filled last
+ *         page is filled in place, only the pages needed beyond it are
+ *         allocated, in as few contiguous runs as possible. With io the data
+ *         writes are added to it rather than done at once, the file's pages
+ *         and size are updated either way. A cursor seeked past the end of
+ *         the file leaves a hole between the end and the cursor. A file
+ *         that stays within VFS_INLINE_DATA_SIZE is kept in its inode.
+ */
+static void file_append(const void * buffer, size_t buffer_size, file_t file, struct vfs_io * io)
+{
+    const uint8_t * data = (const uint8_t *) buffer;
+    const uint32_t page_size = file->vfs->page_size;
+
+    vfs_inode_write_lock(file->inode);
+    file_refresh_page_map(file);
+
+    uint64_t position = file_position(file);
+    uint64_t end = ((position > file->inode->file_size) ? position : file->inode->file_size) + buffer_size;
+    if((file->inode->file_size == 0 || vfs_inode_is_inline(file->inode)) && end <= VFS_INLINE_DATA_SIZE)
+    {
+        // The bytes after the end of an inline file are zero, so a hole
+        // needs nothing written.
+        memcpy(vfs_inode_inline_data(file->inode) + (end - buffer_size), data, buffer_size);
+        file->inode->file_flags |= VFS_INLINE_DATA_FLAG;
+        file->inode->file_size = (uint32_t) end;
+        file->cursor_page = end / page_size;
+        file->cursor_page_pos = end % page_size;
+        vfs_update_inode(file->vfs, file->inode, file->inode_number);
+        vfs_inode_unlock(file->inode);
+        return;
+    }
+    if(vfs_inode_is_inline(file->inode))
+        file_inline_spill(file);
 
-    //printf("buffer of %d, file with %d pages, hangoff of %d\r\n", buffer_size, file_page_count, file_end_offset);
+    if(position > file->inode->file_size && position + buffer_size <= UINT32_MAX)
+        file_leave_hole(file, (uint32_t) position);
 
-    // assume the cursor is at the end of the file.
+    uint32_t file_page_count = file->inode->file_size / page_size;
+    uint32_t file_end_offset = file->inode->file_size % page_size;
+
+    // the cursor is at the end of the file, or anywhere before it.
     file->cursor_page = file_page_count;
     file->cursor_page_pos = file_end_offset;
 
-    file->inode->file_size -= file->cursor_page_pos;
+    size_t tail_bytes = 0;
+    if(file->cursor_page_pos != 0)
+        tail_bytes = (buffer_size < page_size - file->cursor_page_pos) ? buffer_size : page_size - file->cursor_page_pos;
 
-    size_t new_buffer_size = file->cursor_page_pos + buffer_size;
-    uint8_t new_buffer[new_buffer_size];
+    size_t new_bytes = buffer_size - tail_bytes;
+    size_t required_pages = new_bytes / page_size + (((new_bytes % page_size) == 0) ? 0 : 1);
+    uint32_t first_new_page = file_page_count + ((file->cursor_page_pos != 0) ? 1 : 0);
 
-    if(file->cursor_page_pos != 0)
+    if(first_new_page + required_pages > VFS_MAX_FILE_PAGES(file->vfs)
+       || (uint64_t) file->inode->file_size + buffer_size > UINT32_MAX
+       || position + buffer_size > UINT32_MAX)
     {
-        //printf("Preserving existing data in current block.\r\n");
-        fseek_w(file->vfs->vdisk, file->pagemap.pages[file->cursor_page] * VFS_PAGE_SIZE, SEEK_SET);
-        size_t readme = ftell(file->vfs->vdisk);
-        fread_w(new_buffer, sizeof(*new_buffer), file->cursor_page_pos, file->vfs->vdisk);
-        vfs_page_free_unmark(file->vfs, file->pagemap.pages[file->cursor_page]);
-        memcpy(new_buffer + file->cursor_page_pos, buffer, buffer_size);
+        vfs_inode_unlock(file->inode);
+        printf("You've added a file too large. Please don't do that.\r\n");
+        exit(EXIT_FAILURE);
     }
-    else
+
+    if(tail_bytes != 0 && file->pagemap.pages[file->cursor_page] == 0)
     {
-        //printf("No existing data in current block.\r\n");
-        memcpy(new_buffer, buffer, buffer_size);
+        // The last page is a hole. It is written whole at once, so it is
+        // allocated without being zeroed first.
+        uint32_t allocated = 0;
+        uint32_t page_number = vfs_allocate_pages(file->vfs, 1, &allocated);
+        uint8_t * page = (uint8_t *) calloc(1, page_size);
+        memcpy(page + file->cursor_page_pos, data, tail_bytes);
+        vfs_pages_write(file->vfs, page_number, 1, page);
+        free(page);
+
+        file_map_pages(file, file->cursor_page, &page_number, 1);
+        file->pagemap.pages[file->cursor_page] = page_number;
+        data += tail_bytes;
+        file->inode->file_size += tail_bytes;
+    }
+    else if(tail_bytes != 0)
+    {
+        // Fill the existing last page in place.
+        if(io != NULL)
+            vfs_range_write_async(file->vfs, io, file->pagemap.pages[file->cursor_page], file->cursor_page_pos, tail_bytes, data);
+        else
+            vfs_range_write(file->vfs, file->pagemap.pages[file->cursor_page], file->cursor_page_pos, tail_bytes, data);
+        data += tail_bytes;
+        file->inode->file_size += tail_bytes;
     }
 
-    size_t required_pages = (new_buffer_size) / VFS_PAGE_SIZE \
-                          + (((new_buffer_size % VFS_PAGE_SIZE) == 0) ? 0 : 1);
-    size_t buffer_remaining = new_buffer_size;
-
-    int i = 0;
-    for (i = 0; i < required_pages; ++i)
+    if(required_pages != 0)
     {
-        if(file->cursor_page > 0xFFFF)
+        // Allocate the pages in as few contiguous runs as possible. Whole
+        // pages are written straight from the caller's buffer, one write per
+        // run, and a partial last page is padded with zeros.
+        uint32_t * new_pages = (uint32_t *) malloc(required_pages * sizeof(*new_pages));
+        uint32_t pages_written = 0;
+        while(pages_written < required_pages)
         {
-            printf("You've added a file too large. Please don't do that.\r\n");
-            exit(EXIT_FAILURE);
+            uint32_t run_length = 0;
+            uint32_t run_start = vfs_allocate_pages(file->vfs, required_pages - pages_written, &run_length);
+
+            size_t run_offset = (size_t) pages_written * page_size;
+            uint32_t full_pages = run_length;
+            if(run_offset + (size_t) run_length * page_size > new_bytes)
+                full_pages = run_length - 1;
+
+            if(full_pages != 0 && io != NULL)
+                vfs_range_write_async(file->vfs, io, run_start, 0, (size_t) full_pages * page_size, data + run_offset);
+            else if(full_pages != 0)
+                vfs_pages_write(file->vfs, run_start, full_pages, data + run_offset);
+            // The padded last page is always written at once.
+            if(full_pages != run_length)
+            {
+                uint8_t * last_page = (uint8_t *) calloc(1, page_size);
+                size_t last_offset = run_offset + (size_t) full_pages * page_size;
+                memcpy(last_page, data + last_offset, new_bytes - last_offset);
+                vfs_pages_write(file->vfs, run_start + full_pages, 1, last_page);
+                free(last_page);
+            }
+
+            uint32_t j = 0;
+            for(j = 0; j < run_length; ++j)
+                new_pages[pages_written++] = run_start + j;
         }
 
-        if((file->cursor_page >= 256+10) && file->cursor_page < 0xFFFF)
-        {
-            if (file->inode->di_page == 0)
-                file->inode->di_page = vfs_allocate_new_page(file->vfs);
+        file_map_pages(file, first_new_page, new_pages, required_pages);
+        page_map_append(&file->pagemap, new_pages, required_pages);
+        file->inode->file_size += new_bytes;
 
-            uint16_t si_pages[VFS_PAGE_SIZE / 2] = {};
+        free(new_pages);
+    }
 
-            fseek_w(file->vfs->vdisk, file->inode->di_page * VFS_PAGE_SIZE, SEEK_SET);
-            fread_w(si_pages, sizeof(*si_pages), VFS_PAGE_SIZE / 2, file->vfs->vdisk);
-            if(si_pages[(file->cursor_page - 256 - 10) / 256] == 0)
-                si_pages[(file->cursor_page - 256 - 10) / 256] = vfs_allocate_new_page(file->vfs);
-            fseek_w(file->vfs->vdisk, file->inode->di_page * VFS_PAGE_SIZE, SEEK_SET);
-            fwrite_w(si_pages, sizeof(*si_pages), VFS_PAGE_SIZE / 2, file->vfs->vdisk);
-        }
+    file->cursor_page = file->inode->file_size / page_size;
+    file->cursor_page_pos = file->inode->file_size % page_size;
+
+    // A commit can happen before file_flush(), it has to see the pinned
+    // indirect pages and the inode as they are now.
+    if(file->si.dirty)
+        vfs_page_dirty(file->vfs, file->si.data);
+    if(file->di.dirty)
+        vfs_page_dirty(file->vfs, file->di.data);
+    if(file->di_si.dirty)
+        vfs_page_dirty(file->vfs, file->di_si.data);
+    vfs_update_inode(file->vfs, file->inode, file->inode_number);
+    vfs_inode_unlock(file->inode);
+}
 
-        if(file->cursor_page >= 10 && file->cursor_page < 256+10)
-            if (file->inode->si_page == 0)
-                file->inode->si_page = vfs_allocate_new_page(file->vfs);
-
-        uint16_t new_page = vfs_allocate_new_page(file->vfs);
-        fseek_w(file->vfs->vdisk, new_page * VFS_PAGE_SIZE, SEEK_SET);
-        size_t write_amount = (buffer_remaining < VFS_PAGE_SIZE) ? buffer_remaining : VFS_PAGE_SIZE;
-        //printf("Writing %d bytes to page %d of %d.\r\n", write_amount, i, required_pages);
-        fwrite_w(new_buffer, 1, write_amount, file->vfs->vdisk);
-        buffer_remaining -= write_amount;
-        file->inode->file_size += write_amount;
-        if(file->cursor_page < 10)
-        {
-            // add it to d_pages;
-            file->inode->d_pages[file->cursor_page] = new_page;
-        }
-        else if(file->cursor_page < 256 + 10)
-        {
-            // add it to the d_pages in si_page
-            uint16_t d_pages[VFS_PAGE_SIZE / 2] = {};
+/*
+ * @brief: appends the bytes held in the write buffer to the file, as one
+ *         allocation. Callers are in a transaction.
+ */
+static void file_write_buffer_append(file_t file)
+{
+    struct write_buffer * wb = &file->write_buffer;
+    if(wb->size == 0)
+        return;
 
-            fseek_w(file->vfs->vdisk, file->inode->si_page * VFS_PAGE_SIZE, SEEK_SET);
-            fread_w(d_pages, sizeof(*d_pages), VFS_PAGE_SIZE / 2, file->vfs->vdisk);
+    file_append(wb->data, wb->size, file, NULL);
+    wb->size = 0;
+}
 
-            d_pages[file->cursor_page - 10] = new_page;
+/*
+ * @brief: appends what the write buffer holds before the file is read,
+ *         seeked or written around the buffer.
+ */
+static void file_write_buffer_drain(file_t file)
+{
+    if(file->write_buffer.size == 0)
+        return;
 
-            fseek_w(file->vfs->vdisk, -VFS_PAGE_SIZE, SEEK_CUR);
-            fwrite_w(d_pages, sizeof(*d_pages), VFS_PAGE_SIZE / 2, file->vfs->vdisk);
-        }
-        else
-        {
-            // read si_pages to find where si page is
-            uint16_t si_pages[VFS_PAGE_SIZE / 2] = {};
-            fseek_w(file->vfs->vdisk, file->inode->di_page * VFS_PAGE_SIZE, SEEK_SET);
-            fread_w(si_pages, sizeof(*si_pages), VFS_PAGE_SIZE / 2, file->vfs->vdisk);
-            uint16_t si_page = si_pages[(file->cursor_page - 256 - 10) / 256];
+    vfs_transaction_begin(file->vfs);
+    file_write_buffer_append(file);
+    vfs_transaction_end(file->vfs);
+}
 
-            uint16_t d_pages[VFS_PAGE_SIZE / 2] = {};
-            fseek_w(file->vfs->vdisk, si_page * VFS_PAGE_SIZE, SEEK_SET);
-            fread_w(d_pages, sizeof(*d_pages), VFS_PAGE_SIZE / 2, file->vfs->vdisk);
+/*
+ * @brief: appends to the file. Small writes are collected in the file's
+ *         write buffer and appended together once it fills, on file_flush()
+ *         or on file_close(), so pages are allocated and the inode updated
+ *         once per buffer rather than once per write. Other handles on the
+ *         file do not see buffered bytes until then.
+ *
+ * @return: number of elements written.
+ */
+size_t file_write(void * buffer, size_t elem_size, size_t num_elems, file_t file)
+{
+    struct write_buffer * wb = &file->write_buffer;
+    size_t size = elem_size * num_elems;
+    uint64_t start_ns = vfs_stats_start(VFS_STATS_FILE_WRITE);
+    uint8_t origin = vfs_trace_enter(VFS_TRACE_ORIGIN_FILE_WRITE);
+    VFS_STATS_ADD(file->vfs, write_calls, 1);
+    VFS_STATS_ADD(file->vfs, bytes_written, size);
+
+    if(size < wb->limit && wb->size + size <= wb->limit)
+    {
+        if(wb->data == NULL)
+            wb->data = (uint8_t *) malloc(wb->limit);
+        memcpy(wb->data + wb->size, buffer, size);
+        wb->size += size;
+        vfs_trace_leave(origin);
+        vfs_stats_end(file->vfs, VFS_STATS_FILE_WRITE, start_ns);
+        return num_elems;
+    }
 
+    vfs_transaction_begin(file->vfs);
+    file_write_buffer_append(file);
+    if(size < wb->limit)
+    {
+        memcpy(wb->data + wb->size, buffer, size);
+        wb->size += size;
+    }
+    else
+    {
+        file_append(buffer, size, file, NULL);
+    }
+    vfs_transaction_end(file->vfs);
+    vfs_trace_leave(origin);
+    vfs_stats_end(file->vfs, VFS_STATS_FILE_WRITE, start_ns);
+    return num_elems;
+}
 
-            d_pages[(file->cursor_page - 256 - 10) % 256] = new_page;
+/*
+ * @brief: appends like file_write() but returns once the writes are queued.
+ *         The file's size and pages are updated at once, the data is on disk
+ *         once io is done. buffer must stay untouched until then, and the
+ *         new part of the file should not be read before it.
+ *
+ * @param io: request to track the writes with, see vfs_io_wait().
+ * @param callback: called once io is done, may be NULL.
+ * @return: number of elements queued.
+ */
+size_t file_write_async(const void * buffer, size_t elem_size, size_t num_elems, file_t file,
+                        struct vfs_io * io, vfs_io_callback callback, void * context)
+{
+    vfs_io_begin(io, callback, context);
+    io->bytes = elem_size * num_elems;
+    VFS_STATS_ADD(file->vfs, write_calls, 1);
+    VFS_STATS_ADD(file->vfs, bytes_written, io->bytes);
+    uint8_t origin = vfs_trace_enter(VFS_TRACE_ORIGIN_FILE_WRITE_ASYNC);
+    vfs_transaction_begin(file->vfs);
+    file_write_buffer_append(file);
+    file_append(buffer, elem_size * num_elems, file, io);
+    vfs_io_submit(file->vfs, io);
+    vfs_transaction_end(file->vfs);
+    vfs_trace_leave(origin);
+    return num_elems;
+}
 
-            fseek_w(file->vfs->vdisk, si_page * VFS_PAGE_SIZE, SEEK_SET);
-            fwrite_w(d_pages, sizeof(*d_pages), VFS_PAGE_SIZE / 2, file->vfs->vdisk);
+/*
+ * @brief: appends what the write buffer holds, then writes the indirect
+ *         pages changed by file_write() back to the page cache and releases
+ *         them. Every append has already recorded its change to the inode.
+ */
+void file_flush(file_t file)
+{
+    if(file->inode == NULL)
+        return;
+
+    uint8_t origin = vfs_trace_enter(VFS_TRACE_ORIGIN_FILE_FLUSH);
+    vfs_transaction_begin(file->vfs);
+    file_write_buffer_append(file);
+    vfs_inode_write_lock(file->inode);
+    file_unpin(file, &file->si);
+    file_unpin(file, &file->di);
+    file_unpin(file, &file->di_si);
+    vfs_inode_unlock(file->inode);
+    vfs_transaction_end(file->vfs);
+    vfs_trace_leave(origin);
+}
 
+void file_close(file_t file)
+{
+    file_flush(file);
 
-        }
-        file->cursor_page++;
-    }
+    // A readahead still in flight writes into the buffer.
+    if(file->readahead.in_flight)
+        vfs_io_wait(file->vfs, &file->readahead.io);
+    free(file->readahead.buffer);
+    file->readahead.buffer = NULL;
+    free(file->write_buffer.data);
+    file->write_buffer.data = NULL;
 
-    file->cursor_page = file->inode->file_size / VFS_PAGE_SIZE;
-    file->cursor_page_pos = file->inode->file_size % VFS_PAGE_SIZE;
+    if(file->name != NULL)
+        free(file->name);
+    file->name = NULL;
 
-    free(file->pagemap.pages);
-    file->pagemap = build_page_map(file->vfs, file->inode);
+    file->pagemap.page_count = 0;
+    if(file->pagemap.pages != NULL)
+        free(file->pagemap.pages);
+    file->cursor_page_pos = 0;
+    file->cursor_page = 0;
 
-    vfs_update_inode(file->vfs, file->inode, file->inode_number);
+    file->inode_number = 0;
+
+    if(file->inode != NULL)
+        vfs_put_inode(file->vfs, file->inode);
+    file->inode = NULL;
+
+    file->vfs = NULL;
+
+    if(file->path != NULL)
+        free(file->path);
+    file->path = NULL;
+
+    free(file);
 }
 
-// NOTE all pages of the file are read into memory.
-size_t file_read(void * buffer, size_t elem_size, size_t num_elems, file_t file)
+/*
+ * @brief: reads from position into buffer, touching only the pages that
+ *         cover the requested range. Each run of pages that is contiguous on
+ *         disk is read with one positioned read straight into buffer, or
+ *         added to io when there is one. Holes are zero filled at once, and
+ *         an inline file is copied from its inode. Callers hold the inode
+ *         lock.
+ *
+ * @return: number of bytes read, less than size at the end of the file.
+ */
+static size_t file_read_pages(file_t file, uint64_t position, void * buffer, size_t size, struct vfs_io * io)
 {
-    uint8_t page_contents[file->pagemap.page_count * VFS_PAGE_SIZE];
-    int i = 0;
-    for(i = 0; i < file->pagemap.page_count; ++i)
+    const uint32_t page_size = file->vfs->page_size;
+    if(position >= file->inode->file_size)
+        return 0;
+
+    file_refresh_page_map(file);
+
+    size_t copying_byte_count = file->inode->file_size - position;
+    if(size < copying_byte_count)
+        copying_byte_count = size;
+
+    if(vfs_inode_is_inline(file->inode))
+    {
+        memcpy(buffer, vfs_inode_inline_data(file->inode) + position, copying_byte_count);
+        return copying_byte_count;
+    }
+
+    size_t copied = 0;
+    while(copied < copying_byte_count)
     {
-        fseek_w(file->vfs->vdisk, file->pagemap.pages[i] * VFS_PAGE_SIZE, SEEK_SET);
+        uint32_t page_index = (position + copied) / page_size;
+        uint32_t page_offset = (position + copied) % page_size;
+        size_t wanted = copying_byte_count - copied;
+
+        // Extend the run while the next page follows the previous one on
+        // disk, or while both are holes.
+        const uint32_t first_page = file->pagemap.pages[page_index];
+        uint32_t run_pages = 1;
+        while((size_t) run_pages * page_size - page_offset < wanted
+              && page_index + run_pages < file->pagemap.page_count
+              && file->pagemap.pages[page_index + run_pages] == ((first_page == 0) ? 0 : first_page + run_pages))
+            ++run_pages;
+
+        size_t run_bytes = (size_t) run_pages * page_size - page_offset;
+        if(run_bytes > wanted)
+            run_bytes = wanted;
+
+        // Holes read as zeros without touching the image.
+        if(first_page == 0)
+            memset((uint8_t *) buffer + copied, 0, run_bytes);
+        else if(io != NULL)
+            vfs_range_read_async(file->vfs, io, first_page, page_offset, run_bytes, (uint8_t *) buffer + copied);
+        else
+            vfs_range_read(file->vfs, first_page, page_offset, run_bytes, (uint8_t *) buffer + copied);
+        copied += run_bytes;
+    }
+    return copied;
+}
+
+/*
+ * @brief: reads from the cursor, which advances by the bytes read.
+ */
+static size_t file_read_runs(void * buffer, size_t buffer_size, file_t file, struct vfs_io * io)
+{
+    vfs_inode_read_lock(file->inode);
+    size_t copied = file_read_pages(file, file_position(file), buffer, buffer_size, io);
+    vfs_inode_unlock(file->inode);
+
+    file_advance(file, copied);
+    return copied;
+}
+
+/*
+ * @brief: waits for the readahead in flight, if any. A readahead that failed
+ *         is dropped, the data is read again when it is wanted.
+ */
+static void file_readahead_wait(file_t file)
+{
+    struct readahead * ra = &file->readahead;
+    if(!ra->in_flight)
+        return;
 
-        fread_w(page_contents + VFS_PAGE_SIZE * i, sizeof(*page_contents), VFS_PAGE_SIZE, file->vfs->vdisk);
+    if(vfs_io_wait(file->vfs, &ra->io) != 0)
+        ra->length = 0;
+    ra->in_flight = false;
+}
+
+/*
+ * @brief: starts reading the next window of the file, from position, into the
+ *         readahead buffer.
+ */
+static void file_readahead_start(file_t file, uint64_t position)
+{
+    struct readahead * ra = &file->readahead;
+    size_t size = (size_t) ra->window * file->vfs->page_size;
+
+    if(size > ra->capacity)
+    {
+        free(ra->buffer);
+        ra->buffer = (uint8_t *) malloc(size);
+        ra->capacity = size;
     }
 
-    size_t buffer_size = elem_size * num_elems;
-    size_t page_contents_offset = file->cursor_page * VFS_PAGE_SIZE + file->cursor_page_pos;
-    size_t page_contents_after_offset = file->inode->file_size - page_contents_offset;
-    size_t copying_byte_count = ((buffer_size) < page_contents_after_offset) ? buffer_size : page_contents_after_offset;
+    vfs_io_begin(&ra->io, NULL, NULL);
+    vfs_inode_read_lock(file->inode);
+    ra->start = position;
+    ra->length = file_read_pages(file, position, ra->buffer, size, &ra->io);
+    vfs_inode_unlock(file->inode);
 
-    if(copying_byte_count > 0)
-        memcpy(buffer, page_contents + page_contents_offset, copying_byte_count);
+    ra->in_flight = true;
+    vfs_io_submit(file->vfs, &ra->io);
+}
 
-    file->cursor_page_pos += 8;
-    if(file->cursor_page_pos / VFS_PAGE_SIZE != 0)
+static size_t file_read_with_readahead(void * buffer, size_t buffer_size, file_t file)
+{
+    struct readahead * ra = &file->readahead;
+    file_write_buffer_drain(file);
+
+    // A mapped image is read ahead by the kernel.
+    if(ra->max_pages == 0 || file->vfs->map != NULL)
+        return file_read_runs(buffer, buffer_size, file, NULL);
+
+    uint64_t position = file_position(file);
+    if(position == ra->next_position)
     {
-        ++file->cursor_page;
-        file->cursor_page_pos = file->cursor_page_pos % VFS_PAGE_SIZE;
+        ra->window = (ra->window == 0) ? VFS_READAHEAD_MIN_PAGES : ra->window * 2;
+        if(ra->window > ra->max_pages)
+            ra->window = ra->max_pages;
     }
+    else
+    {
+        ra->window = 0;
+    }
+
+    // Take what the buffer holds, the rest is read directly.
+    file_readahead_wait(file);
+    size_t copied = 0;
+    if(position >= ra->start && position < ra->start + ra->length)
+    {
+        copied = ra->start + ra->length - position;
+        if(copied > buffer_size)
+            copied = buffer_size;
+        memcpy(buffer, ra->buffer + (position - ra->start), copied);
+        file_advance(file, copied);
+    }
+    if(copied < buffer_size)
+        copied += file_read_runs((uint8_t *) buffer + copied, buffer_size - copied, file, NULL);
+
+    position = file_position(file);
+    ra->next_position = position;
+    if(ra->window != 0 && position >= ra->start + ra->length)
+        file_readahead_start(file, position);
 
-    // Now we have a contiguous section of storage in page_contents
-    return copying_byte_count;
+    return copied;
 }
 
+/*
+ * @brief: reads from the cursor into buffer. While the file is read
+ *         sequentially the pages after each read are read ahead in the
+ *         background, in a window that doubles with each sequential read up
+ *         to the file's readahead limit. Any other access turns readahead off
+ *         until the reads are sequential again.
+ *
+ * @return: number of bytes read, the cursor advances by the same amount.
+ */
+size_t file_read(void * buffer, size_t elem_size, size_t num_elems, file_t file)
+{
+    uint64_t start_ns = vfs_stats_start(VFS_STATS_FILE_READ);
+    uint8_t origin = vfs_trace_enter(VFS_TRACE_ORIGIN_FILE_READ);
+    size_t bytes = file_read_with_readahead(buffer, elem_size * num_elems, file);
+    vfs_trace_leave(origin);
+
+    VFS_STATS_ADD(file->vfs, read_calls, 1);
+    VFS_STATS_ADD(file->vfs, bytes_read, bytes);
+    vfs_stats_end(file->vfs, VFS_STATS_FILE_READ, start_ns);
+    return bytes;
+}
+
+/*
+ * @brief: reads like file_read() but returns once the reads are queued, one
+ *         per contiguous run of pages. The cursor advances at once, buffer
+ *         holds the data once io is done.
+ *
+ * @param io: request to track the reads with, see vfs_io_wait().
+ * @param callback: called once io is done, may be NULL.
+ * @return: number of bytes queued.
+ */
+size_t file_read_async(void * buffer, size_t elem_size, size_t num_elems, file_t file,
+                       struct vfs_io * io, vfs_io_callback callback, void * context)
+{
+    uint8_t origin = vfs_trace_enter(VFS_TRACE_ORIGIN_FILE_READ_ASYNC);
+    file_write_buffer_drain(file);
+    vfs_io_begin(io, callback, context);
+    io->bytes = file_read_runs(buffer, elem_size * num_elems, file, io);
+    vfs_io_submit(file->vfs, io);
+    vfs_trace_leave(origin);
+    VFS_STATS_ADD(file->vfs, read_calls, 1);
+    VFS_STATS_ADD(file->vfs, bytes_read, io->bytes);
+    return io->bytes;
+}
+
+/*
+ * @brief: moves the cursor. SEEK_END moves it offset bytes back from the end
+ *         of the file. The cursor may be set past the end of the file, the
+ *         next write then leaves a hole from the end of the file to it, which
+ *         reads as zeros and takes no pages.
+ *
+ * @return: 0 if the cursor is inside the file, 1 if it is at or past its end,
+ *          or was clamped to its start.
+ */
 size_t file_seek(file_t file, uint32_t offset, uint8_t mode)
 {
+    const uint32_t page_size = file->vfs->page_size;
+    uint8_t origin = vfs_trace_enter(VFS_TRACE_ORIGIN_FILE_SEEK);
+    file_write_buffer_drain(file);
+    vfs_trace_leave(origin);
+    VFS_STATS_ADD(file->vfs, seek_calls, 1);
+
+    uint64_t position = 0;
     switch(mode) {
         default:
         case VFS_SEEK_SET:
-            file->cursor_page = offset / VFS_PAGE_SIZE;
-            file->cursor_page_pos = offset % VFS_PAGE_SIZE;
-            if(file->cursor_page * VFS_PAGE_SIZE + file->cursor_page_pos < file->inode->file_size)
-                return 0;
-            file->cursor_page = file->pagemap.page_count - 1;
-            file->cursor_page_pos = file->inode->file_size - (file->cursor_page * VFS_PAGE_SIZE);
-            return 1;
+            position = offset;
+            break;
         case VFS_SEEK_CUR:
-            file->cursor_page += offset / VFS_PAGE_SIZE;
-            file->cursor_page_pos += offset % VFS_PAGE_SIZE;
-            if(file->cursor_page * VFS_PAGE_SIZE + file->cursor_page_pos < file->inode->file_size)
-                return 0;
-            file->cursor_page = file->pagemap.page_count - 1;
-            file->cursor_page_pos = file->inode->file_size - (file->cursor_page * VFS_PAGE_SIZE);
-            return 1;
+            position = file_position(file) + offset;
+            break;
         case VFS_SEEK_END:
-            file->cursor_page = file->pagemap.pages[file->pagemap.page_count - 1] - (offset / VFS_PAGE_SIZE);
-            file->cursor_page_pos = VFS_PAGE_SIZE - (offset % VFS_PAGE_SIZE);
-            if(file->cursor_page * VFS_PAGE_SIZE + file->cursor_page_pos > 0)
-                return 0;
-            file->cursor_page = 0;
-            file->cursor_page_pos = 0;
-            return 1;
+            if(offset > file->inode->file_size)
+            {
+                file->cursor_page = 0;
+                file->cursor_page_pos = 0;
+                return 1;
+            }
+            position = file->inode->file_size - offset;
+            break;
     }
+    file->cursor_page = position / page_size;
+    file->cursor_page_pos = position % page_size;
+    return (position < file->inode->file_size) ? 0 : 1;
+}
+
+/*
+ * @brief: sets the largest readahead window of the file in pages, 0 turns
+ *         readahead off. Files start with vfs_options.readahead_pages.
+ */
+void file_set_readahead(file_t file, uint32_t max_pages)
+{
+    file->readahead.max_pages = max_pages;
+    if(file->readahead.window > max_pages)
+        file->readahead.window = max_pages;
+}
+
+/*
+ * @brief: sets how many bytes file_write() collects before appending them,
+ *         0 turns buffering off. Files start with
+ *         vfs_options.write_buffer_size.
+ */
+void file_set_write_buffer(file_t file, uint32_t limit)
+{
+    file_write_buffer_drain(file);
+    free(file->write_buffer.data);
+    file->write_buffer.data = NULL;
+    file->write_buffer.limit = limit;
 }
 
 size_t file_rewind(file_t file)
 {
-    size_t rewind_amount = file->cursor_page * VFS_PAGE_SIZE + file->cursor_page_pos;
+    file_write_buffer_drain(file);
+    size_t rewind_amount = (size_t) file->cursor_page * file->vfs->page_size + file->cursor_page_pos;
     file->cursor_page = 0;
     file->cursor_page_pos = 0;
     return rewind_amount;
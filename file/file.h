@@ -3,21 +3,82 @@
 
 #include "../disk/disk.h"
 
+#define VFS_DIRECTORY_ENTRY_SIZE 32
+#define VFS_DIRECTORY_NAME_LENGTH 30
+
+/*
+ * Hashed directories (VFS_HASHED_DIRECTORY_FLAG) use linear hashing. Page i
+ * of the directory is bucket i, file_size is the number of buckets times the
+ * page size. The first entry slot of every bucket page holds this header,
+ * full buckets chain to overflow pages that are not part of the page map.
+ */
+struct bucket_header {
+    uint32_t count;
+    uint32_t overflow_page;
+    // Number of entries in the whole directory, only kept in bucket 0.
+    uint32_t entries;
+};
+#define VFS_BUCKET_ENTRIES(vfs) ((vfs)->page_size / VFS_DIRECTORY_ENTRY_SIZE - 1)
+// A bucket is split once the directory averages this many entries per bucket.
+#define VFS_BUCKET_SPLIT_LOAD 12
+
 struct page_map {
-    uint16_t * pages;
+    uint32_t * pages;
     uint32_t page_count;
+    uint32_t capacity;
 };
 typedef struct page_map page_map;
 
+// An indirect page held pinned in the page cache by an open file.
+struct pinned_page {
+    uint8_t * data;
+    uint32_t page_number;
+    bool dirty;
+};
+
+// First readahead window of a file that is read sequentially, in pages.
+#define VFS_READAHEAD_MIN_PAGES 4
+
+// Readahead state of an open file, see file_read().
+struct readahead {
+    // Largest window in pages, 0 turns readahead off for the file.
+    uint32_t max_pages;
+    // Pages read ahead after the current read, 0 while reads are not sequential.
+    uint32_t window;
+    // Where the next read starts if the file is being read sequentially.
+    uint64_t next_position;
+    // File bytes [start, start + length) are in, or being read into, buffer.
+    uint8_t * buffer;
+    size_t capacity;
+    uint64_t start;
+    size_t length;
+    struct vfs_io io;
+    bool in_flight;
+};
+
+// Appends file_write() has not passed on yet, see file_write().
+struct write_buffer {
+    // Bytes held before they are appended, 0 turns buffering off for the file.
+    uint32_t limit;
+    uint8_t * data;
+    uint32_t size;
+};
+
 struct file {
     vfs_t vfs;
     uint16_t inode_number;
     page_map pagemap;
-    uint16_t cursor_page;
-    uint16_t cursor_page_pos;
+    uint32_t cursor_page;
+    uint32_t cursor_page_pos;
     inode_t inode;
     char * name;
     char * path;
+    // Indirect pages file_write() appends to, kept until file_flush().
+    struct pinned_page si;
+    struct pinned_page di;
+    struct pinned_page di_si;
+    struct readahead readahead;
+    struct write_buffer write_buffer;
 };
 typedef struct file * file_t;
 
@@ -30,7 +91,12 @@ struct directory {
 };
 typedef struct directory * directory_t;
 
+struct page_map build_page_map(vfs_t vfs, inode_t inode);
+uint32_t directory_name_hash(const char * name);
+uint32_t directory_bucket(uint32_t hash, uint32_t bucket_count);
+
 directory_t directory_create(vfs_t vfs, char * directory_path);
+directory_t directory_create_hashed(vfs_t vfs, char * directory_path);
 directory_t directory_open(vfs_t vfs, char * directory_path);
 void directory_close(directory_t dir);
 
@@ -38,11 +104,18 @@ file_t file_create(vfs_t vfs, char * file_path);
 file_t file_open(vfs_t vfs, char * filepath);
 size_t file_read(void * buffer, size_t elem_size, size_t num_elems, file_t file);
 size_t file_write(void * buffer, size_t elem_size, size_t num_elems, file_t file);
+size_t file_read_async(void * buffer, size_t elem_size, size_t num_elems, file_t file,
+                       struct vfs_io * io, vfs_io_callback callback, void * context);
+size_t file_write_async(const void * buffer, size_t elem_size, size_t num_elems, file_t file,
+                        struct vfs_io * io, vfs_io_callback callback, void * context);
 #define VFS_SEEK_SET 0b00000001
 #define VFS_SEEK_CUR 0b00000010
 #define VFS_SEEK_END 0b00000100
 size_t file_seek(file_t file, uint32_t offset, uint8_t mode);
+void file_set_readahead(file_t file, uint32_t max_pages);
+void file_set_write_buffer(file_t file, uint32_t limit);
 size_t file_rewind(file_t avlec);
+void file_flush(file_t file);
 void file_close(file_t file);
 
 #endif
@@ -0,0 +1,732 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "mkimage.h"
+
+/*
+ * Builds an image from a host directory tree in one pass. The tree is
+ * scanned first and every inode, directory page, indirect page and page of
+ * file data is given its place in a single run of pages before anything is
+ * written. File data is copied by several threads, each gathering the parts
+ * of the host files that fall in one segment of the run and writing the
+ * segment at once. The metadata follows, directories and indirect pages in
+ * one write and the inodes in another.
+ *
+ * Directories with more than VFS_MKIMAGE_HASHED_DIRECTORY_PAGES pages of
+ * entries are written as hashed directories, with the buckets they would
+ * have had the entries been added one at a time. The overflow pages of full
+ * buckets follow the bucket pages.
+ *
+ * Inode numbers follow a breadth first walk of the tree, so the entries of
+ * a directory have consecutive inode numbers. The root directory keeps
+ * inode 0.
+ */
+
+// A file or directory of the source tree, its index is its inode number.
+struct mkimage_node {
+    char * host_path;
+    char name[VFS_DIRECTORY_NAME_LENGTH + 1];
+    bool directory;
+    uint64_t size;
+    // The children of a directory are consecutive nodes.
+    uint32_t first_child;
+    uint32_t child_count;
+    uint32_t page_count;
+    uint32_t indirect_count;
+    // First page of the contents and of the indirect pages that map them.
+    uint32_t first_page;
+    uint32_t first_indirect;
+    // A hashed directory's pages are its buckets, the overflow pages of its
+    // full buckets are not part of page_count.
+    bool hashed;
+    uint32_t overflow_count;
+    uint32_t first_overflow;
+};
+
+struct mkimage_tree {
+    struct mkimage_node * nodes;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t skipped;
+};
+
+// Shared by the threads copying file data, see mkimage_copy_worker().
+struct mkimage_copy {
+    vfs_t vfs;
+    const struct mkimage_tree * tree;
+    // Files with data, in the order of their pages.
+    uint32_t * files;
+    uint32_t file_count;
+    uint32_t data_start;
+    uint32_t data_pages;
+    uint32_t segment_pages;
+    uint32_t next_segment;
+};
+
+static uint32_t mkimage_add_node(struct mkimage_tree * tree, const char * host_path, const char * name, bool directory, uint64_t size)
+{
+    if(tree->count == VFS_MAX_INODES)
+    {
+        ERR("The source tree has more entries than an image has inodes.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    if(tree->count == tree->capacity)
+    {
+        tree->capacity = (tree->capacity < 64) ? 64 : tree->capacity * 2;
+        tree->nodes = (struct mkimage_node *) realloc(tree->nodes, tree->capacity * sizeof(*tree->nodes));
+    }
+
+    struct mkimage_node * node = &tree->nodes[tree->count];
+    memset(node, 0, sizeof(*node));
+    node->host_path = strdup(host_path);
+    strncpy(node->name, name, VFS_DIRECTORY_NAME_LENGTH);
+    node->directory = directory;
+    node->size = size;
+    return tree->count++;
+}
+
+static int mkimage_compare_names(const void * a, const void * b)
+{
+    return strcmp(((const struct mkimage_node *) a)->name, ((const struct mkimage_node *) b)->name);
+}
+
+/*
+ * @brief: adds the entries of a directory as consecutive nodes, sorted by
+ *         name. Entries that are neither files nor directories, or whose
+ *         names do not fit in a directory entry, are skipped.
+ */
+static void mkimage_scan_directory(struct mkimage_tree * tree, uint32_t index)
+{
+    DIR * dir = opendir(tree->nodes[index].host_path);
+    if(dir == NULL)
+    {
+        ERR("Unable to read a directory of the source tree.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t first_child = tree->count;
+    struct dirent * entry = NULL;
+    while((entry = readdir(dir)) != NULL)
+    {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        const char * parent_path = tree->nodes[index].host_path;
+        char * path = (char *) malloc(strlen(parent_path) + strlen(entry->d_name) + 2);
+        sprintf(path, "%s/%s", parent_path, entry->d_name);
+
+        struct stat entry_stat;
+        if(strlen(entry->d_name) <= VFS_DIRECTORY_NAME_LENGTH && lstat(path, &entry_stat) == 0
+           && (S_ISDIR(entry_stat.st_mode) || S_ISREG(entry_stat.st_mode)))
+        {
+            bool directory = S_ISDIR(entry_stat.st_mode);
+            mkimage_add_node(tree, path, entry->d_name, directory, directory ? 0 : (uint64_t) entry_stat.st_size);
+        }
+        else
+        {
+            fprintf(stderr, "Skipping %s\r\n", path);
+            tree->skipped++;
+        }
+        free(path);
+    }
+    closedir(dir);
+
+    tree->nodes[index].first_child = first_child;
+    tree->nodes[index].child_count = tree->count - first_child;
+    qsort(tree->nodes + first_child, tree->count - first_child, sizeof(*tree->nodes), mkimage_compare_names);
+}
+
+static void mkimage_scan(struct mkimage_tree * tree, const char * source_path)
+{
+    struct stat source_stat;
+    if(stat(source_path, &source_stat) != 0 || !S_ISDIR(source_stat.st_mode))
+    {
+        ERR("The source is not a directory.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Directories are scanned in the order they were found, breadth first.
+    mkimage_add_node(tree, source_path, "", true, 0);
+    uint32_t index = 0;
+    for(index = 0; index < tree->count; ++index)
+    {
+        if(tree->nodes[index].directory)
+            mkimage_scan_directory(tree, index);
+    }
+}
+
+static uint32_t mkimage_indirect_pages(uint32_t page_count, uint32_t indirect_entries)
+{
+    if(page_count <= VFS_DIRECT_PAGE_COUNT)
+        return 0;
+    page_count -= VFS_DIRECT_PAGE_COUNT;
+    if(page_count <= indirect_entries)
+        return 1;
+    page_count -= indirect_entries;
+
+    // The single and double indirect pages, and the single indirect pages
+    // the double indirect page points to.
+    return 2 + (page_count + indirect_entries - 1) / indirect_entries;
+}
+
+// Overflow pages a bucket holding count entries chains to.
+static uint32_t mkimage_overflow_pages(uint32_t count, uint32_t bucket_entries)
+{
+    if(count <= bucket_entries)
+        return 0;
+    return (count + bucket_entries - 1) / bucket_entries - 1;
+}
+
+// Number of the entries of a hashed directory that fall in each bucket.
+static uint32_t * mkimage_bucket_counts(const struct mkimage_tree * tree, const struct mkimage_node * node, uint32_t bucket_count)
+{
+    uint32_t * counts = (uint32_t *) calloc(bucket_count, sizeof(*counts));
+    uint32_t child = 0;
+    for(child = 0; child < node->child_count; ++child)
+        counts[directory_bucket(directory_name_hash(tree->nodes[node->first_child + child].name), bucket_count)]++;
+    return counts;
+}
+
+/*
+ * @brief: sizes a directory that is too large to search page by page as a
+ *         hashed directory, with no more than VFS_BUCKET_SPLIT_LOAD entries
+ *         per bucket like one grown an entry at a time.
+ */
+static void mkimage_size_hashed(const struct mkimage_tree * tree, struct mkimage_node * node, uint32_t page_size)
+{
+    const uint32_t bucket_entries = page_size / VFS_DIRECTORY_ENTRY_SIZE - 1;
+    uint32_t bucket_count = (node->child_count + VFS_BUCKET_SPLIT_LOAD - 1) / VFS_BUCKET_SPLIT_LOAD;
+    if(bucket_count == 0)
+        bucket_count = 1;
+
+    uint32_t * counts = mkimage_bucket_counts(tree, node, bucket_count);
+    node->hashed = true;
+    node->size = (uint64_t) bucket_count * page_size;
+    node->overflow_count = 0;
+    uint32_t bucket = 0;
+    for(bucket = 0; bucket < bucket_count; ++bucket)
+        node->overflow_count += mkimage_overflow_pages(counts[bucket], bucket_entries);
+    free(counts);
+}
+
+/*
+ * @brief: works out the pages every file and directory takes, and the
+ *         indirect pages that map them.
+ *
+ * @param metadata_pages: set to the number of directory and indirect pages.
+ * @return: number of pages of file data.
+ */
+static uint64_t mkimage_size(struct mkimage_tree * tree, uint32_t page_size, uint64_t * metadata_pages)
+{
+    const uint32_t indirect_entries = page_size / sizeof(uint32_t);
+    const uint64_t max_file_pages = VFS_DIRECT_PAGE_COUNT + indirect_entries + (uint64_t) indirect_entries * indirect_entries;
+
+    uint64_t data_pages = 0;
+    *metadata_pages = 0;
+
+    uint32_t index = 0;
+    for(index = 0; index < tree->count; ++index)
+    {
+        struct mkimage_node * node = &tree->nodes[index];
+        if(node->directory)
+        {
+            node->size = (uint64_t) node->child_count * VFS_DIRECTORY_ENTRY_SIZE;
+            if(node->size > (uint64_t) VFS_MKIMAGE_HASHED_DIRECTORY_PAGES * page_size)
+                mkimage_size_hashed(tree, node, page_size);
+        }
+
+        uint64_t page_count = (node->size + page_size - 1) / page_size;
+        // Small files are kept in their inodes.
+        if(!node->directory && node->size <= VFS_INLINE_DATA_SIZE)
+            page_count = 0;
+        if(node->size > UINT32_MAX || page_count > max_file_pages)
+        {
+            fprintf(stderr, "%s\r\n", node->host_path);
+            ERR("File too large for an image with this page size.\r\n\t"
+                "Exiting.");
+            exit(EXIT_FAILURE);
+        }
+        node->page_count = (uint32_t) page_count;
+        node->indirect_count = mkimage_indirect_pages(node->page_count, indirect_entries);
+
+        *metadata_pages += node->indirect_count;
+        if(node->directory)
+            *metadata_pages += node->page_count + node->overflow_count;
+        else
+            data_pages += node->page_count;
+    }
+    return data_pages;
+}
+
+/*
+ * @brief: capacity of a new image with room for pages pages besides its
+ *         super block, free block vector, dense index and journal. Never
+ *         less than VFS_DEFAULT_CAPACITY, so the image can still grow.
+ */
+static uint32_t mkimage_capacity(const struct vfs_options * options, uint32_t page_size, uint64_t pages)
+{
+    uint64_t journal_pages = 0;
+    if(!options->no_journal)
+        journal_pages = (options->journal_pages != 0) ? options->journal_pages : VFS_JOURNAL_DEFAULT_PAGES;
+    uint64_t inode_pages = VFS_MAX_INODES / (page_size / sizeof(struct inode));
+    uint64_t dense_index_pages = (inode_pages * sizeof(uint32_t) + page_size - 1) / page_size;
+
+    uint64_t capacity = 1 + dense_index_pages + journal_pages + pages;
+    // The free block vector covers itself, one more page absorbs that.
+    capacity += (capacity + page_size * 8 - 1) / (page_size * 8) + 1;
+    if(capacity > VFS_MAX_CAPACITY)
+    {
+        ERR("The source tree is larger than an image can hold.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    return (capacity < VFS_DEFAULT_CAPACITY) ? VFS_DEFAULT_CAPACITY : (uint32_t) capacity;
+}
+
+/*
+ * @brief: gives every node its pages. Directory pages and indirect pages
+ *         are placed from metadata_start, each directory's overflow pages
+ *         and then indirect pages after its own, and file data from
+ *         data_start, in inode order.
+ */
+static void mkimage_place(struct mkimage_tree * tree, uint32_t metadata_start, uint32_t data_start)
+{
+    uint32_t metadata_page = metadata_start;
+    uint32_t data_page = data_start;
+
+    uint32_t index = 0;
+    for(index = 0; index < tree->count; ++index)
+    {
+        struct mkimage_node * node = &tree->nodes[index];
+        if(node->directory)
+        {
+            node->first_page = metadata_page;
+            metadata_page += node->page_count;
+            node->first_overflow = metadata_page;
+            metadata_page += node->overflow_count;
+        }
+        else
+        {
+            node->first_page = data_page;
+            data_page += node->page_count;
+        }
+        node->first_indirect = metadata_page;
+        metadata_page += node->indirect_count;
+    }
+}
+
+static void mkimage_set_entry(uint8_t * metadata, uint32_t metadata_start, uint32_t page_size,
+                              uint32_t page_number, uint32_t slot, uint32_t value)
+{
+    memcpy(metadata + (size_t) (page_number - metadata_start) * page_size + slot * sizeof(value), &value, sizeof(value));
+}
+
+static uint8_t * mkimage_metadata_page(uint8_t * metadata, uint32_t metadata_start, uint32_t page_size, uint32_t page_number)
+{
+    return metadata + (size_t) (page_number - metadata_start) * page_size;
+}
+
+static void mkimage_write_entry(uint8_t * entry, uint16_t inode_number, const char * name)
+{
+    memcpy(entry, &inode_number, sizeof(inode_number));
+    memcpy(entry + sizeof(inode_number), name, strnlen(name, VFS_DIRECTORY_NAME_LENGTH));
+}
+
+/*
+ * @brief: writes the entries of a hashed directory into its bucket pages,
+ *         each bucket's overflow pages taken in turn from its share of the
+ *         directory's overflow pages.
+ */
+static void mkimage_build_hashed(const struct mkimage_tree * tree, const struct mkimage_node * node, uint32_t page_size,
+                                 uint8_t * metadata, uint32_t metadata_start)
+{
+    const uint32_t bucket_entries = page_size / VFS_DIRECTORY_ENTRY_SIZE - 1;
+    uint32_t bucket_count = node->page_count;
+
+    // The counts become where each bucket's overflow pages start.
+    uint32_t * next_overflow = mkimage_bucket_counts(tree, node, bucket_count);
+    uint32_t * last_page = (uint32_t *) malloc(bucket_count * sizeof(*last_page));
+    uint32_t overflow_page = node->first_overflow;
+    uint32_t bucket = 0;
+    for(bucket = 0; bucket < bucket_count; ++bucket)
+    {
+        uint32_t count = next_overflow[bucket];
+        next_overflow[bucket] = overflow_page;
+        overflow_page += mkimage_overflow_pages(count, bucket_entries);
+        last_page[bucket] = node->first_page + bucket;
+    }
+
+    uint32_t child = 0;
+    for(child = 0; child < node->child_count; ++child)
+    {
+        const char * name = tree->nodes[node->first_child + child].name;
+        bucket = directory_bucket(directory_name_hash(name), bucket_count);
+
+        struct bucket_header header;
+        uint8_t * page = mkimage_metadata_page(metadata, metadata_start, page_size, last_page[bucket]);
+        memcpy(&header, page, sizeof(header));
+        if(header.count == bucket_entries)
+        {
+            header.overflow_page = next_overflow[bucket]++;
+            memcpy(page, &header, sizeof(header));
+            last_page[bucket] = header.overflow_page;
+            page = mkimage_metadata_page(metadata, metadata_start, page_size, last_page[bucket]);
+            memcpy(&header, page, sizeof(header));
+        }
+
+        header.count++;
+        mkimage_write_entry(page + (size_t) header.count * VFS_DIRECTORY_ENTRY_SIZE, (uint16_t) (node->first_child + child), name);
+        memcpy(page, &header, sizeof(header));
+    }
+
+    // The directory wide entry count lives in the header of bucket 0.
+    struct bucket_header header;
+    uint8_t * first_bucket = mkimage_metadata_page(metadata, metadata_start, page_size, node->first_page);
+    memcpy(&header, first_bucket, sizeof(header));
+    header.entries = node->child_count;
+    memcpy(first_bucket, &header, sizeof(header));
+
+    free(next_overflow);
+    free(last_page);
+}
+
+static void mkimage_read_inline(const struct mkimage_node * node, inode_t inode)
+{
+    int fd = open(node->host_path, O_RDONLY);
+    if(fd < 0)
+    {
+        ERR("Unable to open a file of the source tree.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    pread_w(fd, vfs_inode_inline_data(inode), (size_t) node->size, 0);
+    close(fd);
+}
+
+/*
+ * @brief: fills in the inode of a node, and writes its indirect pages and,
+ *         for a directory, its entries into the metadata pages. A file
+ *         without pages is read into its inode.
+ */
+static void mkimage_build_node(const struct mkimage_tree * tree, uint32_t index, uint32_t page_size,
+                               uint8_t * metadata, uint32_t metadata_start, struct inode * inode)
+{
+    const struct mkimage_node * node = &tree->nodes[index];
+    const uint32_t indirect_entries = page_size / sizeof(uint32_t);
+
+    memset(inode, 0, sizeof(*inode));
+    inode->file_size = (uint32_t) node->size;
+    inode->file_flags = node->directory ? VFS_NEW_DIRECTORY_FLAGS : VFS_NEW_FILE_FLAGS;
+    if(node->hashed)
+        inode->file_flags = VFS_NEW_HASHED_DIRECTORY_FLAGS;
+    if(!node->directory && node->size != 0 && node->page_count == 0)
+    {
+        inode->file_flags |= VFS_INLINE_DATA_FLAG;
+        mkimage_read_inline(node, inode);
+        return;
+    }
+    if(node->indirect_count >= 1)
+        inode->si_page = node->first_indirect;
+    if(node->indirect_count >= 2)
+        inode->di_page = node->first_indirect + 1;
+
+    uint32_t i = 0;
+    for(i = 0; i < node->page_count; ++i)
+    {
+        uint32_t page_number = node->first_page + i;
+        if(i < VFS_DIRECT_PAGE_COUNT)
+        {
+            inode->d_pages[i] = page_number;
+        }
+        else if(i < VFS_DIRECT_PAGE_COUNT + indirect_entries)
+        {
+            mkimage_set_entry(metadata, metadata_start, page_size, inode->si_page, i - VFS_DIRECT_PAGE_COUNT, page_number);
+        }
+        else
+        {
+            // The single indirect pages below the double indirect page
+            // follow it.
+            uint32_t di_index = i - VFS_DIRECT_PAGE_COUNT - indirect_entries;
+            uint32_t si_page = inode->di_page + 1 + di_index / indirect_entries;
+            if(di_index % indirect_entries == 0)
+                mkimage_set_entry(metadata, metadata_start, page_size, inode->di_page, di_index / indirect_entries, si_page);
+            mkimage_set_entry(metadata, metadata_start, page_size, si_page, di_index % indirect_entries, page_number);
+        }
+    }
+
+    if(!node->directory)
+        return;
+    if(node->hashed)
+    {
+        mkimage_build_hashed(tree, node, page_size, metadata, metadata_start);
+        return;
+    }
+
+    // A directory's pages are consecutive, so its entries are too.
+    uint8_t * entries = mkimage_metadata_page(metadata, metadata_start, page_size, node->first_page);
+    uint32_t child = 0;
+    for(child = 0; child < node->child_count; ++child)
+    {
+        uint8_t * entry = entries + (size_t) child * VFS_DIRECTORY_ENTRY_SIZE;
+        mkimage_write_entry(entry, (uint16_t) (node->first_child + child), tree->nodes[node->first_child + child].name);
+    }
+}
+
+/*
+ * @brief: reads the part of a host file that falls in a segment into the
+ *         segment's buffer.
+ */
+static void mkimage_copy_file(const struct mkimage_node * node, uint32_t page_size,
+                              uint32_t segment_start, uint32_t segment_pages, uint8_t * buffer)
+{
+    uint32_t first = (node->first_page > segment_start) ? node->first_page : segment_start;
+    uint32_t end = node->first_page + node->page_count;
+    if(end > segment_start + segment_pages)
+        end = segment_start + segment_pages;
+
+    uint64_t offset = (uint64_t) (first - node->first_page) * page_size;
+    uint64_t size = (uint64_t) (end - first) * page_size;
+    if(offset + size > node->size)
+        size = node->size - offset;
+
+    int fd = open(node->host_path, O_RDONLY);
+    if(fd < 0)
+    {
+        ERR("Unable to open a file of the source tree.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    pread_w(fd, buffer + (size_t) (first - segment_start) * page_size, (size_t) size, offset);
+    close(fd);
+}
+
+/*
+ * @brief: takes segments of the file data in turn until none are left,
+ *         filling each from the host files it covers and writing it to the
+ *         image at once. Padding after the end of a file is zero.
+ */
+static void * mkimage_copy_worker(void * argument)
+{
+    struct mkimage_copy * copy = (struct mkimage_copy *) argument;
+    const struct mkimage_node * nodes = copy->tree->nodes;
+    const uint32_t page_size = copy->vfs->page_size;
+    uint8_t * buffer = (uint8_t *) malloc((size_t) copy->segment_pages * page_size);
+
+    while(true)
+    {
+        uint64_t first = (uint64_t) __atomic_fetch_add(&copy->next_segment, 1, __ATOMIC_RELAXED) * copy->segment_pages;
+        if(first >= copy->data_pages)
+            break;
+
+        uint32_t segment_start = copy->data_start + (uint32_t) first;
+        uint32_t segment_pages = copy->segment_pages;
+        if(first + segment_pages > copy->data_pages)
+            segment_pages = copy->data_pages - (uint32_t) first;
+        memset(buffer, 0, (size_t) segment_pages * page_size);
+
+        // Find the first file that ends inside the segment.
+        uint32_t low = 0;
+        uint32_t high = copy->file_count;
+        while(low < high)
+        {
+            uint32_t middle = low + (high - low) / 2;
+            const struct mkimage_node * node = &nodes[copy->files[middle]];
+            if(node->first_page + node->page_count <= segment_start)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        uint32_t file = 0;
+        for(file = low; file < copy->file_count && nodes[copy->files[file]].first_page < segment_start + segment_pages; ++file)
+            mkimage_copy_file(&nodes[copy->files[file]], page_size, segment_start, segment_pages, buffer);
+
+        vfs_pages_write(copy->vfs, segment_start, segment_pages, buffer);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static void mkimage_copy_data(vfs_t vfs, const struct mkimage_tree * tree, const struct vfs_mkimage_options * options,
+                              uint32_t data_start, uint32_t data_pages)
+{
+    struct mkimage_copy copy = {
+            .vfs = vfs,
+            .tree = tree,
+            .files = (uint32_t *) malloc(tree->count * sizeof(uint32_t)),
+            .file_count = 0,
+            .data_start = data_start,
+            .data_pages = data_pages,
+            .segment_pages = ((options->segment_size != 0) ? options->segment_size : VFS_MKIMAGE_DEFAULT_SEGMENT_SIZE) / vfs->page_size,
+            .next_segment = 0
+    };
+    if(copy.segment_pages == 0)
+        copy.segment_pages = 1;
+
+    uint32_t index = 0;
+    for(index = 0; index < tree->count; ++index)
+    {
+        if(!tree->nodes[index].directory && tree->nodes[index].page_count != 0)
+            copy.files[copy.file_count++] = index;
+    }
+
+    uint32_t segments = (data_pages + copy.segment_pages - 1) / copy.segment_pages;
+    uint32_t thread_count = (options->threads != 0) ? options->threads : VFS_MKIMAGE_DEFAULT_THREADS;
+    if(thread_count > segments)
+        thread_count = segments;
+
+    pthread_t * threads = (pthread_t *) malloc(thread_count * sizeof(*threads));
+    uint32_t i = 0;
+    for(i = 0; i < thread_count; ++i)
+    {
+        if(pthread_create(&threads[i], NULL, mkimage_copy_worker, &copy) != 0)
+        {
+            ERR("Unable to start a copying thread.\r\n\t"
+                "Exiting.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(i = 0; i < thread_count; ++i)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    free(copy.files);
+}
+
+/*
+ * @brief: creates an image holding a copy of a host directory tree. Regular
+ *         files and directories are copied, anything else is skipped. The
+ *         image must not exist yet, or be empty, and is only usable once this
+ *         returns.
+ *
+ * @param image_path: image to create.
+ * @param source_path: host directory that becomes the root directory.
+ * @param options: NULL for the defaults.
+ * @param summary: set to what was copied, may be NULL.
+ */
+void vfs_mkimage(const char * image_path, const char * source_path, const struct vfs_mkimage_options * options,
+                 struct vfs_mkimage_summary * summary)
+{
+    struct vfs_mkimage_options defaults;
+    if(options == NULL)
+    {
+        memset(&defaults, 0, sizeof(defaults));
+        options = &defaults;
+    }
+
+    struct stat image_stat;
+    if(stat(image_path, &image_stat) == 0 && image_stat.st_size > 0)
+    {
+        ERR("The image already exists.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct mkimage_tree tree;
+    memset(&tree, 0, sizeof(tree));
+    mkimage_scan(&tree, source_path);
+
+    struct vfs_options image_options = options->image;
+    uint32_t page_size = (image_options.page_size != 0) ? image_options.page_size : VFS_DEFAULT_PAGE_SIZE;
+    uint64_t metadata_pages = 0;
+    uint64_t data_pages = mkimage_size(&tree, page_size, &metadata_pages);
+    if(image_options.capacity == 0)
+    {
+        uint64_t inode_pages = (tree.count + page_size / sizeof(struct inode) - 1) / (page_size / sizeof(struct inode));
+        image_options.capacity = mkimage_capacity(&image_options, page_size, inode_pages + metadata_pages + data_pages);
+    }
+
+    vfs_t vfs = vfs_open_with(image_path, &image_options);
+
+    // One run of pages for everything, the root directory's inode page
+    // is already in place. Every free block vector page the run touches
+    // goes in the same commit, so a long run is allocated a piece at a
+    // time and each piece committed before the next.
+    uint32_t inode_pages = vfs_new_inodes_pages(vfs, tree.count - 1);
+    uint64_t total_pages = inode_pages + metadata_pages + data_pages;
+    uint64_t piece_pages = total_pages;
+    if(vfs_journal_active(vfs))
+        piece_pages = (uint64_t) (vfs_journal_max_pages(vfs) / 2) * page_size * 8;
+    uint64_t allocated = 0;
+    uint32_t first_page = 0;
+    while(total_pages < vfs->capacity && allocated < total_pages)
+    {
+        uint32_t wanted = (uint32_t) ((total_pages - allocated < piece_pages) ? total_pages - allocated : piece_pages);
+        uint32_t piece_allocated = 0;
+        vfs_transaction_begin(vfs);
+        uint32_t piece_start = vfs_allocate_pages(vfs, wanted, &piece_allocated);
+        vfs_transaction_end(vfs);
+        vfs_sync(vfs);
+        if(allocated == 0)
+            first_page = piece_start;
+        if(piece_start != first_page + allocated || piece_allocated != wanted)
+            break;
+        allocated += piece_allocated;
+    }
+    if(allocated != total_pages)
+    {
+        ERR("The image is too small for the source tree.\r\n\t"
+            "Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t metadata_start = first_page + inode_pages;
+    uint32_t data_start = metadata_start + (uint32_t) metadata_pages;
+    mkimage_place(&tree, metadata_start, data_start);
+
+    // File data reaches the image before the metadata that points to it.
+    mkimage_copy_data(vfs, &tree, options, data_start, (uint32_t) data_pages);
+
+    vfs_transaction_begin(vfs);
+    uint8_t * metadata = (uint8_t *) calloc(metadata_pages + 1, page_size);
+    struct inode * inodes = (struct inode *) malloc(tree.count * sizeof(*inodes));
+    uint32_t index = 0;
+    for(index = 0; index < tree.count; ++index)
+        mkimage_build_node(&tree, index, page_size, metadata, metadata_start, &inodes[index]);
+
+    if(metadata_pages != 0)
+        vfs_pages_write(vfs, metadata_start, (uint32_t) metadata_pages, metadata);
+    vfs_new_inodes(vfs, inodes + 1, tree.count - 1, first_page);
+
+    inode_t root = vfs_get_inode(vfs, 0);
+    vfs_inode_write_lock(root);
+    *root = inodes[0];
+    vfs_update_inode(vfs, root, 0);
+    vfs_inode_unlock(root);
+    vfs_put_inode(vfs, root);
+    vfs_transaction_end(vfs);
+
+    if(summary != NULL)
+    {
+        memset(summary, 0, sizeof(*summary));
+        summary->skipped = tree.skipped;
+        summary->pages = (uint32_t) total_pages;
+        for(index = 1; index < tree.count; ++index)
+        {
+            if(tree.nodes[index].directory)
+            {
+                summary->directories++;
+                continue;
+            }
+            summary->files++;
+            summary->bytes += tree.nodes[index].size;
+        }
+    }
+
+    vfs_close(vfs);
+
+    free(metadata);
+    free(inodes);
+    for(index = 0; index < tree.count; ++index)
+        free(tree.nodes[index].host_path);
+    free(tree.nodes);
+}
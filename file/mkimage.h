@@ -0,0 +1,37 @@
+#ifndef MKIMAGE_H
+#define MKIMAGE_H
+
+#include "file.h"
+
+#define VFS_MKIMAGE_DEFAULT_THREADS 8
+#define VFS_MKIMAGE_DEFAULT_SEGMENT_SIZE (8 * 1024 * 1024)
+// Directories whose entries take more pages than this are made hashed.
+#define VFS_MKIMAGE_HASHED_DIRECTORY_PAGES 2
+
+struct vfs_mkimage_options {
+    // Options the image is created with. A capacity of 0 makes room for at
+    // least the source tree.
+    struct vfs_options image;
+    // Threads reading host files, 0 selects VFS_MKIMAGE_DEFAULT_THREADS.
+    uint32_t threads;
+    // Bytes of file data a thread gathers before writing them to the image
+    // at once, rounded down to whole pages. 0 selects
+    // VFS_MKIMAGE_DEFAULT_SEGMENT_SIZE.
+    uint32_t segment_size;
+};
+
+struct vfs_mkimage_summary {
+    uint32_t directories;
+    uint32_t files;
+    // Entries that are neither files nor directories, or whose names are
+    // longer than VFS_DIRECTORY_NAME_LENGTH.
+    uint32_t skipped;
+    uint64_t bytes;
+    // Pages taken by inodes, directories, indirect pages and file data.
+    uint32_t pages;
+};
+
+void vfs_mkimage(const char * image_path, const char * source_path, const struct vfs_mkimage_options * options,
+                 struct vfs_mkimage_summary * summary);
+
+#endif